@@ -0,0 +1,539 @@
+/*
+ * reader.cpp -- Example program which reads from SimpleExchangeDevice
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <cstring>
+#include <sstream>
+#include <climits>
+
+#include "reader.h"
+#include "../compress.h"
+#include "../log.h"
+
+SEDReader::SEDReader(const std::vector<std::string> &devices,
+                     std::string folder, DedupCache *cache)
+    : folder(folder), cache(cache), features(0), lost(0), next(0),
+      stream(0), running(0)
+{
+    bool opened = true;
+    for (size_t i = 0; i < devices.size(); ++i) {
+        int sedFd = open(devices[i].c_str(), O_RDONLY);
+        if (sedFd == -1) {
+            LOGERR() << "Error opening file " << devices[i];
+            opened = false;
+            continue;
+        }
+        sedFds.push_back(sedFd);
+    }
+    if (!opened) {
+        for (size_t i = 0; i < sedFds.size(); ++i)
+            close(sedFds[i]);
+        sedFds.clear();
+    }
+}
+
+SEDReader::~SEDReader()
+{
+    dropOpenFiles();
+    std::map<uint32_t, ReceivedFrame *>::iterator pit;
+    for (pit = pending.begin(); pit != pending.end(); ++pit)
+        delete pit->second;
+    for (size_t i = 0; i < sedFds.size(); ++i)
+        close(sedFds[i]);
+}
+
+/* Closes a received file. Files which failed verification are removed so
+ * nobody picks up corrupted data; verified ones are remembered for
+ * deduplication, by the digest computed while they were received.
+ */
+bool SEDReader::closeFile(std::map<std::string, ReceivedFile>::iterator it,
+                          bool keep)
+{
+    std::string path = folder + "/" + it->first;
+    close(it->second.fd);
+    if (!keep) {
+        unlink(path.c_str());
+    } else if (cache) {
+        ContentDigest digest;
+        digest.size = it->second.received;
+        digest.hash = xxh64Digest(it->second.hash);
+        digest.crc = it->second.crc;
+        cache->Remember(digest, it->first);
+    }
+    openFiles.erase(it);
+    return keep;
+}
+
+/* Removes files whose writer went away before it finished them. */
+void SEDReader::dropOpenFiles()
+{
+    while (!openFiles.empty()) {
+        LOGERR() << "Not finished by its writer: " << openFiles.begin()->first;
+        closeFile(openFiles.begin(), false);
+    }
+}
+
+/* Copies a file, in kernel where the file system allows it. */
+static bool copyFile(const std::string &from, const std::string &to)
+{
+    int in = open(from.c_str(), O_RDONLY);
+    if (in == -1)
+        return false;
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1) {
+        close(in);
+        return false;
+    }
+
+    bool ret = true;
+    ssize_t count;
+    while ((count = copy_file_range(in, NULL, out, NULL, 0x1000000, 0)) != 0) {
+        if (count > 0)
+            continue;
+        if (errno == EINTR)
+            continue;
+        /* Not supported between these files, copy through user space. */
+        char data[0x10000];
+        while ((count = read(in, data, sizeof data)) > 0) {
+            if (!writeFully(out, data, count)) {
+                count = -1;
+                break;
+            }
+        }
+        ret = count == 0;
+        break;
+    }
+
+    close(in);
+    close(out);
+    if (!ret)
+        unlink(to.c_str());
+    return ret;
+}
+
+/* Recreates a file from content received before under another name. The
+ * local copy is digested again, so a modified copy is never used.
+ */
+bool SEDReader::handleDigest(const ReceivedFrame &frame)
+{
+    const std::string &name = frame.name;
+    if (name.find('/') != std::string::npos || name == "." || name == "..") {
+        LOGERR() << "Rejecting file name " << name;
+        return false;
+    }
+
+    ContentDigest digest;
+    if (frame.hdr.rawLen != sizeof digest) {
+        LOGERR() << "Invalid digest frame for " << name;
+        return false;
+    }
+    memcpy(&digest, frame.payload.data(), sizeof digest);
+
+    /* Try every file which was received with this content. */
+    std::vector<std::string> names;
+    std::string known;
+    if (cache && cache->Find(digest, names)) {
+        for (size_t i = 0; i < names.size() && known.empty(); ++i) {
+            ContentDigest local;
+            if (digestFile(folder + "/" + names[i], local) && local == digest)
+                known = names[i];
+        }
+    }
+    if (known.empty()) {
+        LOGERR() << "Content " << digestToString(digest)
+                 << " is not available, can not recreate " << name;
+        ++lost;
+        return false;
+    }
+
+    if (known != name && !copyFile(folder + "/" + known, folder + "/" + name)) {
+        LOGERR() << "Error copying " << known << " to " << name << " errno: "
+                 << errno;
+        ++lost;
+        return false;
+    }
+    cache->Remember(digest, name);
+    LOGDEBUG() << "Recreated " << name << " from " << known;
+    return true;
+}
+
+bool SEDReader::handleFrame(const ReceivedFrame &frame)
+{
+    const FrameHeader &hdr = frame.hdr;
+    const std::string &name = frame.name;
+    const char *payload = frame.payload.data();
+
+    /* Names come from the other side of the device. Never leave folder. */
+    if (name.find('/') != std::string::npos || name == "." || name == "..") {
+        LOGERR() << "Rejecting file name " << name;
+        return false;
+    }
+
+    std::map<std::string, ReceivedFile>::iterator it = openFiles.find(name);
+    if (hdr.type == FRAME_TRAILER) {
+        if (it == openFiles.end()) {
+            LOGERR() << "Trailer for a file which is not open: " << name;
+            return false;
+        }
+        FrameTrailer trailer;
+        if (hdr.rawLen != sizeof trailer) {
+            LOGERR() << "Invalid trailer for " << name;
+            return closeFile(it, false);
+        }
+        memcpy(&trailer, payload, sizeof trailer);
+        if (it->second.received != hdr.fileSize ||
+            it->second.crc != trailer.fileChecksum) {
+            LOGERR() << "Verification failed for " << name << ", got "
+                     << it->second.received << " of " << hdr.fileSize
+                     << " bytes";
+            return closeFile(it, false);
+        }
+        LOGDEBUG() << "Received and verified " << name;
+        return closeFile(it, true);
+    }
+
+    if (hdr.flags & FRAME_FIRST) {
+        if (it != openFiles.end()) {
+            LOGERR() << "Restarted before finished: " << name;
+            closeFile(it, false);
+        }
+        std::string path = folder + "/" + name;
+        ReceivedFile file;
+        file.fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (file.fd == -1) {
+            LOGERR() << "Error creating " << path << " errno: " << errno;
+            return false;
+        }
+        file.crc = 0;
+        file.received = 0;
+        if (cache)
+            xxh64Init(file.hash, 0);
+        LOGDEBUG() << "Receiving " << name << " (" << hdr.fileSize << " bytes)";
+        it = openFiles.insert(std::make_pair(name, file)).first;
+    } else if (it == openFiles.end()) {
+        LOGERR() << "Frame for a file which is not open: " << name;
+        return false;
+    }
+
+    if (hdr.offset != it->second.received) {
+        LOGERR() << "Frame out of order for " << name << " at " << hdr.offset;
+        return closeFile(it, false);
+    }
+
+    const char *pos = payload;
+    size_t len = hdr.rawLen;
+    off_t offset = hdr.offset;
+    while (len > 0) {
+        ssize_t count = pwrite(it->second.fd, pos, len, offset);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            LOGERR() << "Error writing " << name << " errno: " << errno;
+            return closeFile(it, false);
+        }
+        pos += count;
+        len -= count;
+        offset += count;
+    }
+    it->second.crc = crc32cCombine(it->second.crc, frame.rawCrc,
+                                   hdr.rawLen);
+    it->second.received += hdr.rawLen;
+    if (cache)
+        xxh64Update(it->second.hash, payload, hdr.rawLen);
+    LOGTRACE("wrote {} bytes of {} at {}", hdr.rawLen, name, hdr.offset);
+
+    /* Single frame file, already verified by the frame checksum. */
+    if (hdr.flags & FRAME_LAST) {
+        LOGDEBUG() << "Received and verified " << name;
+        return closeFile(it, true);
+    }
+    return true;
+}
+
+/* Stores the raw payload of a frame, decompressing it if needed. Returns
+ * false if it can not be decoded.
+ */
+bool SEDReader::decodePayload(ReceivedFrame *frame, const char *body)
+{
+    const FrameHeader &hdr = frame->hdr;
+    if (!(hdr.flags & FRAME_COMPRESSED)) {
+        frame->payload.assign(body, body + hdr.rawLen);
+        return true;
+    }
+
+    /* The flag alone decides: a reader which opened the device after the
+     * writer never saw the hello of the stream.
+     */
+    frame->payload.resize(hdr.rawLen);
+    if (lz4Decompress(body, hdr.payloadLen, frame->payload.data(),
+                      hdr.rawLen) != static_cast<ssize_t>(hdr.rawLen)) {
+        LOGERR() << "Malformed compressed frame " << hdr.sequence;
+        return false;
+    }
+    return true;
+}
+
+/* Reads frames from one device. Decompression and checksums run here, so
+ * with several devices they run in parallel.
+ */
+void SEDReader::deviceLoop(size_t index)
+{
+    int sedFd = sedFds[index];
+    std::vector<char> body(FRAME_MAX_NAME + FRAME_MAX_PAYLOAD);
+    FrameHeader hdr;
+
+    while (readFully(sedFd, &hdr, sizeof hdr)) {
+        /* Without a valid header there is no way to find the next frame. */
+        if (!frameHeaderValid(hdr)) {
+            LOGERR() << "Invalid frame header, stream is out of sync";
+            break;
+        }
+        if (!readFully(sedFd, body.data(), hdr.nameLen + hdr.payloadLen)) {
+            LOGERR() << "Truncated frame";
+            break;
+        }
+
+        ReceivedFrame *frame = new ReceivedFrame;
+        frame->hdr = hdr;
+        frame->name.assign(body.data(), hdr.nameLen);
+        frame->valid = decodePayload(frame, body.data() + hdr.nameLen);
+        frame->rawCrc = crc32cUpdate(0, frame->payload.data(), hdr.rawLen);
+        if (frame->valid &&
+            frameChecksum(frame->rawCrc, body.data(), hdr.nameLen) !=
+            hdr.checksum) {
+            LOGERR() << "Checksum mismatch in frame " << hdr.sequence
+                     << " of " << frame->name;
+            frame->valid = false;
+        }
+        LOGTRACE("device {} read frame {} of {}, {} of {} bytes, valid {}",
+                 index, hdr.sequence, frame->name, hdr.payloadLen, hdr.rawLen,
+                 frame->valid);
+        pushFrame(index, frame);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    latest[index] = LLONG_MAX;
+    --running;
+    cond.notify_all();
+}
+
+void SEDReader::pushFrame(size_t index, ReceivedFrame *frame)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    int64_t sequence = frame->hdr.sequence;
+
+    /* Frames of a new writer replace what is left of the previous one;
+     * devices which still deliver the old stream catch up once they reach
+     * the new one, so its frames which arrived first are kept.
+     */
+    if (frame->hdr.stream != stream) {
+        if (!frame->valid || finished.count(frame->hdr.stream)) {
+            delete frame;
+            return;
+        }
+        if (stream) {
+            LOGDEBUG() << "Stream " << stream << " replaced by "
+                       << frame->hdr.stream;
+            finished.insert(stream);
+        }
+        std::map<uint32_t, ReceivedFrame *>::iterator it;
+        for (it = pending.begin(); it != pending.end(); ++it)
+            delete it->second;
+        pending.clear();
+        for (size_t i = 0; i < latest.size(); ++i)
+            if (latest[i] != LLONG_MAX)
+                latest[i] = -1;
+        stream = frame->hdr.stream;
+        next = 0;
+    }
+
+    if (sequence < next) {
+        LOGERR() << "Late frame " << sequence << ", expected " << next;
+        delete frame;
+        return;
+    }
+
+    /* Nothing older can arrive from this device any more. Then wait until
+     * the frame fits the window, the other devices are catching up.
+     */
+    latest[index] = sequence;
+    cond.notify_all();
+    const int64_t window = REORDER_WINDOW * sedFds.size();
+    while (frame->hdr.stream == stream && sequence - next >= window)
+        cond.wait(lock);
+    if (frame->hdr.stream != stream || sequence < next) {
+        delete frame;
+        return;
+    }
+    pending[frame->hdr.sequence] = frame;
+    cond.notify_all();
+}
+
+/* Returns frames in sequence order, NULL when all devices are done. */
+ReceivedFrame *SEDReader::popFrame()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (1) {
+        std::map<uint32_t, ReceivedFrame *>::iterator it = pending.find(next);
+        if (it != pending.end()) {
+            ReceivedFrame *frame = it->second;
+            pending.erase(it);
+            ++next;
+            cond.notify_all();
+            return frame;
+        }
+        if (running == 0 && pending.empty())
+            return NULL;
+
+        /* Devices deliver in order, so once every device is past next, the
+         * frames up to the lowest of them are lost.
+         */
+        int64_t low = LLONG_MAX;
+        for (size_t i = 0; i < latest.size(); ++i)
+            low = std::min(low, latest[i]);
+        if (!pending.empty())
+            low = std::min(low, static_cast<int64_t>(pending.begin()->first));
+        if (low > next && low != LLONG_MAX) {
+            LOGERR() << "Lost frames " << next << " to " << low - 1;
+            next = low;
+            cond.notify_all();
+            continue;
+        }
+        cond.wait(lock);
+    }
+}
+
+void SEDReader::handleHello(const ReceivedFrame &frame)
+{
+    StreamHello hello;
+    if (frame.hdr.rawLen < sizeof hello) {
+        LOGERR() << "Invalid stream hello";
+        return;
+    }
+    memcpy(&hello, frame.payload.data(), sizeof hello);
+    if (hello.features & ~STREAM_SUPPORTED) {
+        LOGERR() << "Unsupported stream features " << std::hex
+                 << (hello.features & ~STREAM_SUPPORTED);
+    }
+    features = hello.features & STREAM_SUPPORTED;
+    LOGDEBUG() << "New stream, features " << std::hex << features;
+}
+
+bool SEDReader::Run()
+{
+    if (sedFds.empty())
+        return false;
+
+    std::vector<std::thread> deviceThreads;
+    latest.assign(sedFds.size(), -1);
+    running = sedFds.size();
+    for (size_t i = 0; i < sedFds.size(); ++i)
+        deviceThreads.push_back(std::thread(&SEDReader::deviceLoop, this, i));
+
+    ReceivedFrame *frame;
+    uint16_t current = 0;
+    while ((frame = popFrame()) != NULL) {
+        /* The window only holds frames of the latest stream. */
+        if (frame->hdr.stream != current) {
+            dropOpenFiles();
+            current = frame->hdr.stream;
+        }
+        if (!frame->valid) {
+            std::map<std::string, ReceivedFile>::iterator it =
+                openFiles.find(frame->name);
+            if (it != openFiles.end())
+                closeFile(it, false);
+        } else if (frame->hdr.type == FRAME_HELLO) {
+            handleHello(*frame);
+        } else if (frame->hdr.type == FRAME_DIGEST) {
+            handleDigest(*frame);
+        } else if (frame->hdr.type == FRAME_DATA ||
+                   frame->hdr.type == FRAME_TRAILER) {
+            handleFrame(*frame);
+        }
+        delete frame;
+    }
+
+    for (size_t i = 0; i < deviceThreads.size(); ++i)
+        deviceThreads[i].join();
+    LOGDEBUG() << "End of stream";
+    if (lost) {
+        LOGERR() << lost << " files sent by digest could not be recreated";
+        return false;
+    }
+    return true;
+}
+
+int main( int argc, char **argv )
+{
+    int stripes = 0;
+    const char *cacheFile = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:s:")) != -1) {
+        switch (opt) {
+        case 'd':
+            cacheFile = optarg;
+            break;
+        case 's':
+            stripes = atoi(optarg);
+            if (stripes > 0)
+                break;
+        /* fall through */
+        default:
+            fprintf(stderr, "Usage: %s [-d cache] [-s devices] [device] "
+                    "[folder]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::string device = optind < argc ? argv[optind] : "/dev/scd";
+    std::string folder = optind + 1 < argc ? argv[optind + 1] : ".";
+
+    /* With -s N, device is a prefix: /dev/scd reads /dev/scd0..N-1. */
+    std::vector<std::string> devices;
+    if (stripes == 0)
+        devices.push_back(device);
+    for (int i = 0; i < stripes; ++i) {
+        std::ostringstream name;
+        name << device << i;
+        devices.push_back(name.str());
+    }
+
+    DedupCache *cache = NULL;
+    if (cacheFile) {
+        cache = new DedupCache(cacheFile);
+        if (!cache->Valid()) {
+            LOGERR() << "Error opening cache " << cacheFile;
+            return 1;
+        }
+    }
+
+    bool ret;
+    {
+        SEDReader sedReader(devices, folder, cache);
+        ret = sedReader.Run();
+    }
+    delete cache;
+    return ret ? 0 : 1;
+}
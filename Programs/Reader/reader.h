@@ -0,0 +1,96 @@
+/*
+ * reader.h -- Example program which reads from SimpleExchangeDevice
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+
+#include "../protocol.h"
+#include "../dedup.h"
+
+/* WINDOW frames past the next expected one may wait for reordering. */
+#define REORDER_WINDOW 64
+
+/* A frame as handed from a device thread to the main thread: payload
+ * already decompressed and checksum verified.
+ */
+struct ReceivedFrame {
+    FrameHeader hdr;
+    std::string name;
+    std::vector<char> payload;
+    uint32_t rawCrc;
+    bool valid;
+};
+
+/* One thread per device reads, decodes and verifies frames. The main thread
+ * takes them in sequence order, so frames striped over several devices are
+ * reassembled before they are written to files.
+ */
+class SEDReader
+{
+public:
+    SEDReader(const std::vector<std::string> &devices, std::string folder,
+              DedupCache *cache);
+    ~SEDReader();
+    bool Run();
+
+private:
+    struct ReceivedFile {
+        int fd;
+        uint32_t crc;       /* Running CRC32C of the data received so far. */
+        uint64_t received;  /* Next expected offset. */
+        Xxh64State hash;    /* Of the data received so far, with a cache. */
+    };
+
+    std::vector<int> sedFds;
+    std::string folder;
+    DedupCache *cache;      /* NULL unless deduplication is enabled. */
+    uint32_t features;      /* Accepted from the stream hello. */
+    size_t lost;            /* Files sent by digest and not recreated. */
+    /* Files which got their first frame but not yet the last one. */
+    std::map<std::string, ReceivedFile> openFiles;
+
+    /* Reorder buffer, shared with the device threads. */
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::map<uint32_t, ReceivedFrame *> pending;
+    std::vector<int64_t> latest;    /* Last sequence seen per device. */
+    uint32_t next;
+    uint16_t stream;                /* Of the frames in the window. */
+    std::set<uint16_t> finished;    /* Streams taken over by a new writer. */
+    size_t running;
+
+    void deviceLoop(size_t index);
+    bool decodePayload(ReceivedFrame *frame, const char *body);
+    void pushFrame(size_t index, ReceivedFrame *frame);
+    ReceivedFrame *popFrame();
+
+    void handleHello(const ReceivedFrame &frame);
+    bool handleFrame(const ReceivedFrame &frame);
+    bool handleDigest(const ReceivedFrame &frame);
+    bool closeFile(std::map<std::string, ReceivedFile>::iterator it,
+                   bool keep);
+    void dropOpenFiles();
+};
+
@@ -0,0 +1,299 @@
+/*
+ * tracedecode.cpp -- Renders binary trace files written by LOGTRACE
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/stat.h>
+
+#include "tracedecode.h"
+
+TraceDecoder::TraceDecoder() : hdr(NULL), mapSize(0), defines(NULL),
+    ring(NULL), skipped(0)
+{
+}
+
+TraceDecoder::~TraceDecoder()
+{
+    if (hdr)
+        munmap(const_cast<TraceFileHeader *>(hdr), mapSize);
+}
+
+bool TraceDecoder::Open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Error opening %s\n", path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 ||
+        static_cast<size_t>(st.st_size) < sizeof(TraceFileHeader)) {
+        fprintf(stderr, "%s is not a trace file\n", path);
+        close(fd);
+        return false;
+    }
+    mapSize = st.st_size;
+    void *map = mmap(NULL, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error mapping %s\n", path);
+        return false;
+    }
+    hdr = static_cast<const TraceFileHeader *>(map);
+
+    if (hdr->magic != TRACE_MAGIC || hdr->version != TRACE_VERSION) {
+        fprintf(stderr, "%s is not a trace file of version %d\n", path,
+                TRACE_VERSION);
+        return false;
+    }
+    if (hdr->chunkSize < sizeof(TraceRecord) || hdr->chunkSize % 8 ||
+        !hdr->capacity || hdr->capacity % hdr->chunkSize ||
+        mapSize - sizeof(TraceFileHeader) <
+        hdr->defineCapacity + hdr->capacity) {
+        fprintf(stderr, "%s is truncated or corrupted\n", path);
+        return false;
+    }
+    defines = reinterpret_cast<const char *>(hdr + 1);
+    ring = defines + hdr->defineCapacity;
+    collectSites();
+    collectRing();
+    return true;
+}
+
+/* Returns the record at offset from base, or NULL if there is no complete
+ * one before limit.
+ */
+const TraceRecord *TraceDecoder::recordAt(const char *base, uint64_t offset,
+        uint64_t limit)
+{
+    if (offset + sizeof(TraceRecord) > limit)
+        return NULL;
+    const TraceRecord *rec = reinterpret_cast<const TraceRecord *>(base +
+                             offset);
+    if (rec->size < sizeof(TraceRecord) || rec->size % 8 ||
+        offset + rec->size > limit)
+        return NULL;
+    return rec;
+}
+
+void TraceDecoder::collectSites()
+{
+    uint64_t used = std::min(hdr->defineTail.load(), hdr->defineCapacity);
+    const TraceRecord *rec;
+    for (uint64_t offset = 0; (rec = recordAt(defines, offset, used));
+         offset += rec->size) {
+        const char *body = reinterpret_cast<const char *>(rec + 1);
+        size_t len = rec->size - sizeof(TraceRecord);
+        if (rec->site != TRACE_SITE_DEFINE || len < sizeof(TraceDefine))
+            continue;
+        TraceDefine def;
+        memcpy(&def, body, sizeof def);
+        if (sizeof def + def.fileLen + def.formatLen > len)
+            continue;
+        Site &site = sites[def.id];
+        site.file.assign(body + sizeof def, def.fileLen);
+        site.line = def.line;
+        site.format.assign(body + sizeof def + def.fileLen, def.formatLen);
+    }
+}
+
+/* Walks the chunks of the ring from the oldest one which is still whole.
+ * Each starts with a sync record, which is where records can be found
+ * again after the part the writer overwrote.
+ */
+void TraceDecoder::collectRing()
+{
+    uint64_t chunk = hdr->chunkSize;
+    uint64_t tail = hdr->tail.load();
+    uint64_t first = 0;
+    if (tail > hdr->capacity)
+        first = (tail + chunk - 1) / chunk * chunk - hdr->capacity;
+
+    for (uint64_t start = first; start < tail; start += chunk) {
+        const char *base = ring + start % hdr->capacity;
+        uint64_t limit = std::min(chunk, tail - start);
+        const TraceRecord *rec = recordAt(base, 0, limit);
+        if (!rec || rec->site != TRACE_SITE_SYNC) {
+            ++skipped;
+            continue;
+        }
+        for (uint64_t offset = 0; (rec = recordAt(base, offset, limit));
+             offset += rec->size) {
+            const char *body = reinterpret_cast<const char *>(rec + 1);
+            if (rec->site == TRACE_SITE_PAD)
+                break;
+            if (rec->site != TRACE_SITE_SYNC) {
+                records.push_back(rec);
+            } else if (rec->size - sizeof(TraceRecord) >= sizeof(TraceSync)) {
+                TraceSync sync;
+                memcpy(&sync, body, sizeof sync);
+                Sync s = { rec->ticks, sync.realtime };
+                syncs.push_back(s);
+            }
+        }
+    }
+    /* Threads may store their syncs slightly out of tick order. */
+    std::sort(syncs.begin(), syncs.end(), earlier);
+}
+
+/* Interpolates between the two syncs around ticks, or extrapolates from the
+ * nearest two. With the monotonic clock one sync is enough.
+ */
+bool TraceDecoder::toRealtime(uint64_t ticks, int64_t &realtime) const
+{
+    if (syncs.empty())
+        return false;
+    if (hdr->clock == TRACE_CLOCK_MONOTONIC || syncs.size() == 1) {
+        if (hdr->clock != TRACE_CLOCK_MONOTONIC)
+            return false;
+        realtime = syncs[0].realtime + static_cast<int64_t>(ticks -
+                   syncs[0].ticks);
+        return true;
+    }
+
+    size_t i = 1;
+    while (i + 1 < syncs.size() && syncs[i].ticks < ticks)
+        ++i;
+    const Sync &a = syncs[i - 1];
+    const Sync &b = syncs[i];
+    if (b.ticks == a.ticks)
+        return false;
+    double rate = static_cast<double>(b.realtime - a.realtime) /
+                  static_cast<double>(b.ticks - a.ticks);
+    realtime = a.realtime + static_cast<int64_t>(
+                   (static_cast<double>(ticks) - static_cast<double>(a.ticks)) * rate);
+    return true;
+}
+
+std::string TraceDecoder::render(const Site &site, const TraceRecord *rec) const
+{
+    const char *p = reinterpret_cast<const char *>(rec + 1);
+    const char *end = reinterpret_cast<const char *>(rec) + rec->size;
+    std::string text;
+    char value[64];
+    uint32_t argc = rec->argc;
+
+    for (size_t i = 0; i < site.format.length(); ++i) {
+        if (site.format.compare(i, 2, "{}") != 0) {
+            text += site.format[i];
+            continue;
+        }
+        ++i;
+        if (!argc || p >= end) {
+            text += "{?}";
+            continue;
+        }
+        --argc;
+
+        uint8_t type = *p++;
+        uint64_t bits;
+        uint16_t len;
+        switch (type) {
+        case TRACE_ARG_INT:
+        case TRACE_ARG_UINT:
+        case TRACE_ARG_DOUBLE:
+            if (end - p < static_cast<ssize_t>(sizeof bits)) {
+                p = end;
+                text += "{?}";
+                continue;
+            }
+            memcpy(&bits, p, sizeof bits);
+            p += sizeof bits;
+            if (type == TRACE_ARG_INT) {
+                snprintf(value, sizeof value, "%lld",
+                         static_cast<long long>(bits));
+            } else if (type == TRACE_ARG_UINT) {
+                snprintf(value, sizeof value, "%llu",
+                         static_cast<unsigned long long>(bits));
+            } else {
+                double d;
+                memcpy(&d, &bits, sizeof d);
+                snprintf(value, sizeof value, "%g", d);
+            }
+            text += value;
+            break;
+        case TRACE_ARG_STRING:
+            if (end - p < static_cast<ssize_t>(sizeof len)) {
+                p = end;
+                text += "{?}";
+                continue;
+            }
+            memcpy(&len, p, sizeof len);
+            p += sizeof len;
+            len = std::min<size_t>(len, end - p);
+            text.append(p, len);
+            p += len;
+            break;
+        default:
+            p = end;
+            text += "{?}";
+            break;
+        }
+    }
+    return text;
+}
+
+void TraceDecoder::Decode(FILE *out)
+{
+    uint64_t rendered = 0;
+    uint64_t incomplete = 0;
+    for (size_t i = 0; i < records.size(); ++i) {
+        const TraceRecord *rec = records[i];
+        std::map<uint32_t, Site>::const_iterator it = sites.find(rec->site);
+        if (it == sites.end()) {
+            /* Reserved but never finished, e.g. the process died. */
+            ++incomplete;
+            continue;
+        }
+        ++rendered;
+
+        int64_t realtime;
+        if (toRealtime(rec->ticks, realtime))
+            fprintf(out, "%lld.%09lld",
+                    static_cast<long long>(realtime / 1000000000),
+                    static_cast<long long>(realtime % 1000000000));
+        else
+            fprintf(out, "%llu", static_cast<unsigned long long>(rec->ticks));
+        fprintf(out, " TRACE %u: [%s (%u)] %s\n", rec->thread,
+                it->second.file.c_str(), it->second.line,
+                render(it->second, rec).c_str());
+    }
+
+    uint64_t tail = hdr->tail.load();
+    fprintf(stderr, "%llu records, %llu incomplete, %llu dropped, "
+            "%llu bytes overwritten, %llu chunks skipped\n",
+            static_cast<unsigned long long>(rendered),
+            static_cast<unsigned long long>(incomplete),
+            static_cast<unsigned long long>(hdr->dropped.load()),
+            static_cast<unsigned long long>(tail > hdr->capacity ?
+                                            tail - hdr->capacity : 0),
+            static_cast<unsigned long long>(skipped));
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s trace-file\n", argv[0]);
+        return 1;
+    }
+
+    TraceDecoder decoder;
+    if (!decoder.Open(argv[1]))
+        return 1;
+    decoder.Decode(stdout);
+    return 0;
+}
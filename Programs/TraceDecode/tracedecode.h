@@ -0,0 +1,73 @@
+/*
+ * tracedecode.h -- Renders binary trace files written by LOGTRACE
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <map>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "../trace.h"
+
+/* Reads a trace file in two passes: the first collects call sites, clock
+ * syncs and the records which survived in the ring, oldest first, the
+ * second renders every record as a line of text.
+ */
+class TraceDecoder
+{
+public:
+    TraceDecoder();
+    ~TraceDecoder();
+    bool Open(const char *path);
+    void Decode(FILE *out);
+
+private:
+    struct Site {
+        std::string file;
+        uint32_t line;
+        std::string format;
+    };
+    struct Sync {
+        uint64_t ticks;
+        int64_t realtime;
+    };
+
+    const TraceFileHeader *hdr;
+    size_t mapSize;
+    const char *defines;
+    const char *ring;
+    std::map<uint32_t, Site> sites;
+    std::vector<Sync> syncs;
+    std::vector<const TraceRecord *> records;
+    uint64_t skipped;               /* Chunks which did not start right. */
+
+    static bool earlier(const Sync &a, const Sync &b)
+    {
+        return a.ticks < b.ticks;
+    }
+    static const TraceRecord *recordAt(const char *base, uint64_t offset,
+                                       uint64_t limit);
+    void collectSites();
+    void collectRing();
+    bool toRealtime(uint64_t ticks, int64_t &realtime) const;
+    std::string render(const Site &site, const TraceRecord *rec) const;
+
+    TraceDecoder(const TraceDecoder&);
+    TraceDecoder& operator =(const TraceDecoder&);
+};
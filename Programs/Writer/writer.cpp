@@ -24,102 +24,470 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/inotify.h>
+#include <sys/stat.h>
 #include <cstring>
+#include <sstream>
+#include <random>
 
 #include "writer.h"
+#include "../compress.h"
 #include "../log.h"
 
-SEDWriter::SEDWriter(std::string device)
+SEDWriter::SEDWriter(const std::vector<std::string> &devices, bool compress,
+                     DedupCache *cache)
+    : watch(-1), compress(compress), cache(cache), stream(0), sequence(0),
+      frames(FRAME_BUFFERS * devices.size()),
+      freeFrames(frames.size()), fullFrames(frames.size()), deviceError(false)
 {
     watchFd = inotify_init();
     memset(buffer, 0, sizeof buffer);
 
-    sedFd = open(device.c_str(), O_WRONLY);
-    if (sedFd == -1) {
-        LOGDEBUG() << "Error opening file " << device;
+    /* Lets the reader tell the frames of this writer from a previous one. */
+    std::random_device random;
+    do
+        stream = random();
+    while (stream == 0);
+
+    /* Devices stay open for the lifetime of the writer. Opening resets the
+     * ring, so every file is sent as frames over these descriptors.
+     */
+    bool opened = true;
+    for (size_t i = 0; i < devices.size(); ++i) {
+        int sedFd = open(devices[i].c_str(), O_WRONLY);
+        if (sedFd == -1) {
+            LOGERR() << "Error opening file " << devices[i];
+            opened = false;
+            continue;
+        }
+        sedFds.push_back(sedFd);
+    }
+    if (!opened) {
+        for (size_t i = 0; i < sedFds.size(); ++i)
+            close(sedFds[i]);
+        sedFds.clear();
     }
 
-    Log::LLevel() = DEBUG;
+    for (size_t i = 0; i < frames.size(); ++i) {
+        frames[i].content = NULL;
+        freeFrames.Push(&frames[i]);
+    }
+    for (size_t i = 0; i < sedFds.size(); ++i)
+        deviceThreads.push_back(std::thread(&SEDWriter::deviceLoop, this,
+                                            sedFds[i]));
+    if (!sedFds.empty())
+        sendHello();
 }
 
 SEDWriter::~SEDWriter()
 {
-    inotify_rm_watch(watchFd, watch);
+    /* Let the device threads drain frames which are already queued. */
+    fullFrames.Close();
+    for (size_t i = 0; i < deviceThreads.size(); ++i)
+        deviceThreads[i].join();
+    freeFrames.Close();
+
+    if (watch != -1)
+        inotify_rm_watch(watchFd, watch);
     close(watchFd);
-    close(sedFd);
+    for (size_t i = 0; i < sedFds.size(); ++i)
+        close(sedFds[i]);
+}
+
+void SEDWriter::deviceLoop(int sedFd)
+{
+    Frame *frame;
+    while (fullFrames.Pop(frame)) {
+        bool written = !deviceError;
+        if (written && !writeFully(sedFd, frame->data, frame->len)) {
+            LOGERR() << "Error writing to sed, errno: " << errno;
+            deviceError = true;
+            written = false;
+        }
+        LOGTRACE("device {} wrote {} bytes", sedFd, frame->len);
+        if (frame->content) {
+            contentWritten(frame->content, written);
+            frame->content = NULL;
+        }
+        freeFrames.Push(frame);
+    }
+}
+
+/* Drops one reference to content; the last one decides whether all of its
+ * frames made it to the devices.
+ */
+void SEDWriter::contentWritten(SendingContent *content, bool ok)
+{
+    if (!ok)
+        content->failed = true;
+    if (--content->pending != 0)
+        return;
+    if (!content->failed) {
+        std::lock_guard<std::mutex> lock(sentMutex);
+        if (holders.count(content->digest))
+            sent.insert(content->digest);
+    }
+    delete content;
+}
+
+/* Whether content of this size was sent, so a file may be worth digesting
+ * before it is sent.
+ */
+bool SEDWriter::sizeSent(uint64_t size)
+{
+    ContentDigest lowest;
+    lowest.size = size;
+    lowest.hash = 0;
+    lowest.crc = 0;
+    std::lock_guard<std::mutex> lock(sentMutex);
+    std::set<ContentDigest>::iterator it = sent.lower_bound(lowest);
+    return it != sent.end() && it->size == size;
+}
+
+/* Records that name now holds digest, or content without a digest. The
+ * content it held before is no longer sent once no other name holds it:
+ * the reader may have nowhere left to copy it from.
+ */
+void SEDWriter::nameSent(const std::string &name, const ContentDigest *digest)
+{
+    std::lock_guard<std::mutex> lock(sentMutex);
+    std::map<std::string, ContentDigest>::iterator it = sentNames.find(name);
+    if (it != sentNames.end()) {
+        std::map<ContentDigest, int>::iterator held =
+            holders.find(it->second);
+        if (--held->second == 0) {
+            sent.erase(held->first);
+            holders.erase(held);
+        }
+        sentNames.erase(it);
+    }
+    if (digest) {
+        sentNames[name] = *digest;
+        ++holders[*digest];
+    }
+}
+
+bool SEDWriter::contentSent(const ContentDigest &digest)
+{
+    std::lock_guard<std::mutex> lock(sentMutex);
+    return sent.count(digest) != 0;
+}
+
+char *SEDWriter::payloadOf(Frame *frame, const std::string &name)
+{
+    return frame->data + sizeof(FrameHeader) + name.length();
+}
+
+/* Fills in the header of a frame whose payload is already in place,
+ * compresses the payload if enabled and worth it, and queues the frame for
+ * the device thread.
+ */
+bool SEDWriter::sendFrame(Frame *frame, const std::string &name, uint8_t type,
+                          uint16_t flags, uint64_t fileSize, uint64_t offset,
+                          uint32_t rawLen, uint32_t *rawCrc)
+{
+    FrameHeader *hdr = reinterpret_cast<FrameHeader *>(frame->data);
+    char *namePos = frame->data + sizeof(FrameHeader);
+    char *payload = payloadOf(frame, name);
+    uint32_t payloadLen = rawLen;
+
+    /* Checksummed here while the payload is hot in cache. */
+    uint32_t crc = crc32cUpdate(0, payload, rawLen);
+    if (rawCrc)
+        *rawCrc = crc;
+
+    if (compress && type == FRAME_DATA && rawLen >= COMPRESS_MIN) {
+        size_t len = lz4Compress(payload, rawLen, scratch, rawLen - 1);
+        if (len) {
+            memcpy(payload, scratch, len);
+            payloadLen = len;
+            flags |= FRAME_COMPRESSED;
+        }
+    }
+
+    memset(hdr, 0, sizeof(FrameHeader));
+    hdr->magic = FRAME_MAGIC;
+    hdr->version = FRAME_VERSION;
+    hdr->type = type;
+    hdr->flags = flags;
+    hdr->sequence = sequence++;
+    hdr->nameLen = name.length();
+    hdr->stream = stream;
+    hdr->payloadLen = payloadLen;
+    hdr->rawLen = rawLen;
+    hdr->fileSize = fileSize;
+    hdr->offset = offset;
+    memcpy(namePos, name.c_str(), name.length());
+    hdr->checksum = frameChecksum(crc, namePos, name.length());
+    frame->len = sizeof(FrameHeader) + name.length() + payloadLen;
+    LOGTRACE("queued frame {} type {} of {} at {}, {} of {} bytes",
+             hdr->sequence, hdr->type, name, offset, payloadLen, rawLen);
+
+    if (deviceError || !fullFrames.Push(frame)) {
+        if (frame->content) {
+            contentWritten(frame->content, false);
+            frame->content = NULL;
+        }
+        freeFrames.Push(frame);
+        return false;
+    }
+    return true;
+}
+
+bool SEDWriter::sendHello()
+{
+    Frame *frame;
+    if (!freeFrames.Pop(frame))
+        return false;
+
+    StreamHello hello;
+    hello.features = compress ? STREAM_LZ4 : 0;
+    memcpy(payloadOf(frame, ""), &hello, sizeof hello);
+    return sendFrame(frame, "", FRAME_HELLO, 0, 0, 0, sizeof hello, NULL);
+}
+
+/* Tells the reader to recreate name from content it already received. */
+bool SEDWriter::sendDigest(const std::string &name,
+                           const ContentDigest &digest)
+{
+    Frame *frame;
+    if (!freeFrames.Pop(frame))
+        return false;
+
+    memcpy(payloadOf(frame, name), &digest, sizeof digest);
+    return sendFrame(frame, name, FRAME_DIGEST, FRAME_FIRST | FRAME_LAST,
+                     digest.size, 0, sizeof digest, NULL);
 }
 
-bool SEDWriter::copyFileToDevice(const char *source)
+bool SEDWriter::SendFile(std::string path, std::string name)
 {
-    LOGDEBUG() << "Copying from: " << source;
-    int readFd = open(source, O_RDONLY);
+    LOGDEBUG() << "Copying from: " << path;
+    if (name.empty() || name.length() > FRAME_MAX_NAME) {
+        LOGERR() << "Invalid file name " << name;
+        return false;
+    }
+
+    int readFd = open(path.c_str(), O_RDONLY);
     if (readFd == -1) {
-        LOGDEBUG() << "Error opening file " << source << "errno: " << errno;
+        LOGERR() << "Error opening file " << path << " errno: " << errno;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(readFd, &st) == -1) {
+        LOGERR() << "Error reading size of " << path << " errno: " << errno;
+        close(readFd);
         return false;
     }
 
+    /* Content which this writer already sent in full goes as its digest
+     * only. The digest is kept per path, size and mtime. A new file is
+     * digested while it is sent; it is read twice only if content of the
+     * same size was sent, as only then it may go as a digest.
+     */
+    ContentDigest digest;
+    bool haveDigest = false;
+    int64_t mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    if (cache) {
+        haveDigest = cache->Lookup(path, st.st_size, mtime, digest);
+        if (!haveDigest && sizeSent(st.st_size) && digestFile(path, digest)) {
+            cache->Store(path, st.st_size, mtime, digest);
+            haveDigest = true;
+        }
+        if (haveDigest && contentSent(digest)) {
+            LOGDEBUG() << "Already sent " << digestToString(digest) << ": "
+                       << name;
+            close(readFd);
+            nameSent(name, &digest);
+            return sendDigest(name, digest);
+        }
+    }
+
+    SendingContent *content = NULL;
+    Xxh64State hash;
+    if (cache) {
+        content = new SendingContent;
+        content->pending = 1;
+        content->failed = false;
+        if (!haveDigest)
+            xxh64Init(hash, 0);
+    }
+
     bool ret = true;
-    const int sz = 1024;
-    char data[sz];
-    ssize_t numRead = 0;
-    while ((numRead = read(readFd, data, sz)) > 0) {
-        int lenW = numRead;
-        ssize_t countW = 0;
-        char* currentPos = data;
-        while (1) {
-            countW = write(sedFd, currentPos, lenW);
-            if (countW < 0) {/* Error occured. */
+    uint64_t fileSize = st.st_size;
+    uint64_t offset = 0;
+    uint32_t fileCrc = 0;
+    uint16_t flags = FRAME_FIRST;
+    while (1) {
+        Frame *frame;
+        if (!freeFrames.Pop(frame)) {
+            ret = false;
+            break;
+        }
+        /* File data is read straight behind the name. */
+        char *payload = payloadOf(frame, name);
+
+        ssize_t numRead = read(readFd, payload, FRAME_MAX_PAYLOAD);
+        if (numRead < 0) {
+            LOGERR() << "Error reading " << path << " errno: " << errno;
+            freeFrames.Push(frame);
+            ret = false;
+            break;
+        }
+        /* Size is taken at open time; a short read ends the file. */
+        bool last = numRead == 0 || offset + numRead >= fileSize;
+        if (last)
+            fileSize = offset + numRead;
+        /* A single frame file is fully covered by the frame checksum. */
+        if (last && (flags & FRAME_FIRST))
+            flags |= FRAME_LAST;
+
+        /* Before compression replaces the payload. */
+        if (content && !haveDigest)
+            xxh64Update(hash, payload, numRead);
+
+        uint32_t rawCrc;
+        if (content) {
+            ++content->pending;
+            frame->content = content;
+        }
+        if (!sendFrame(frame, name, FRAME_DATA, flags, fileSize, offset,
+                       numRead, &rawCrc)) {
+            ret = false;
+            break;
+        }
+        fileCrc = crc32cCombine(fileCrc, rawCrc, numRead);
+        offset += numRead;
+        if (flags & FRAME_LAST)
+            break;
+        flags = 0;
+
+        if (last) {
+            if (!freeFrames.Pop(frame)) {
                 ret = false;
-                LOGDEBUG() << "Error writing to sed ";
-                break;
-            } else if (countW == lenW) /* Everything was written. */
                 break;
-            else { /* countW > 0 && countW < lenW.*/
-                lenW -= countW;
-                currentPos += countW;
             }
+            FrameTrailer trailer;
+            trailer.fileChecksum = fileCrc;
+            memcpy(payloadOf(frame, name), &trailer, sizeof trailer);
+            if (content) {
+                ++content->pending;
+                frame->content = content;
+            }
+            ret = sendFrame(frame, name, FRAME_TRAILER, FRAME_LAST, fileSize,
+                            fileSize, sizeof trailer, NULL);
+            break;
         }
     }
 
     close(readFd);
+
+    if (content && !haveDigest) {
+        digest.size = fileSize;
+        digest.hash = xxh64Digest(hash);
+        digest.crc = fileCrc;
+        if (ret && fileSize == static_cast<uint64_t>(st.st_size))
+            cache->Store(path, st.st_size, mtime, digest);
+    }
+    /* Only if what was sent is still the content the digest describes. */
+    if (content) {
+        content->digest = digest;
+        nameSent(name, &digest);
+        contentWritten(content, ret && fileSize == digest.size &&
+                       fileCrc == digest.crc);
+    }
     return ret;
 }
 
 bool SEDWriter::Watch(std::string folder)
 {
-    watch = inotify_add_watch(watchFd, folder.c_str(), IN_CREATE);
-    int length = read(watchFd, buffer, BUF_LEN);
-    if (length < 0) {
-        LOGERR() << "Error reading inotify. ";
+    if (sedFds.empty())
+        return false;
+
+    /* Files are picked up once their writer closes them (or they are moved
+     * in), so a file is never streamed while it is still being written.
+     */
+    watch = inotify_add_watch(watchFd, folder.c_str(),
+                              IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (watch == -1) {
+        LOGERR() << "Error watching " << folder << " errno: " << errno;
         return false;
     }
 
-    int i = 0;
-    while (i < length) {
-        struct inotify_event *event = ( struct inotify_event * ) &buffer[ i ];
-        if (event->len) {
-            if (event->mask & IN_CREATE) {
-                if (event->mask & IN_ISDIR) {
-                    LOGDEBUG() << "Directory created" << event->name;
-                } else {
-                    LOGDEBUG() << "File created" << event->name;
-                }
-                if (copyFileToDevice(event->name)) {
+    while (1) {
+        int length = read(watchFd, buffer, BUF_LEN);
+        if (length < 0) {
+            if (errno == EINTR)
+                continue;
+            LOGERR() << "Error reading inotify. ";
+            return false;
+        }
+
+        int i = 0;
+        while (i < length) {
+            struct inotify_event *event = ( struct inotify_event * ) &buffer[ i ];
+            if (event->len && !(event->mask & IN_ISDIR)) {
+                LOGDEBUG() << "File ready " << event->name;
+                if (SendFile(folder + "/" + event->name, event->name)) {
                     LOGDEBUG() << "Successfull copied from: " << event->name;
                 } else {
-                    LOGDEBUG() << "Error copying: " << event->name;
+                    LOGERR() << "Error copying: " << event->name;
                 }
-                break; /* Copy just one file and exit. */
             }
+            i += EVENT_SIZE + event->len;
         }
-        i += EVENT_SIZE + event->len;
     }
 }
 
 int main( int argc, char **argv )
 {
-    SEDWriter sedWriter("/dev/sed");;
-    sedWriter.Watch("./");
+    bool compress = false;
+    int stripes = 0;
+    const char *cacheFile = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "cd:s:")) != -1) {
+        switch (opt) {
+        case 'c':
+            compress = true;
+            break;
+        case 'd':
+            cacheFile = optarg;
+            break;
+        case 's':
+            stripes = atoi(optarg);
+            if (stripes > 0)
+                break;
+        /* fall through */
+        default:
+            fprintf(stderr, "Usage: %s [-c] [-d cache] [-s devices] "
+                    "[device] [folder]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::string device = optind < argc ? argv[optind] : "/dev/scd";
+    std::string folder = optind + 1 < argc ? argv[optind + 1] : ".";
+
+    /* With -s N, device is a prefix: /dev/scd stripes over /dev/scd0..N-1. */
+    std::vector<std::string> devices;
+    if (stripes == 0)
+        devices.push_back(device);
+    for (int i = 0; i < stripes; ++i) {
+        std::ostringstream name;
+        name << device << i;
+        devices.push_back(name.str());
+    }
+
+    DedupCache *cache = NULL;
+    if (cacheFile) {
+        cache = new DedupCache(cacheFile);
+        if (!cache->Valid()) {
+            LOGERR() << "Error opening cache " << cacheFile;
+            return 1;
+        }
+    }
 
-    return 0;
+    SEDWriter sedWriter(devices, compress, cache);
+    bool ret = sedWriter.Watch(folder);
+    delete cache;
+    return ret ? 0 : 1;
 }
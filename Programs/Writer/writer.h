@@ -18,23 +18,90 @@
  */
 
 #include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <map>
+#include <stdint.h>
+
+#include "../protocol.h"
+#include "../queue.h"
+#include "../dedup.h"
 
 #define EVENT_SIZE  ( sizeof (struct inotify_event) )
 #define BUF_LEN     ( 1024 * ( EVENT_SIZE + 16 ) )
+#define FRAME_BUFFERS 8 /* Frames in flight per device. */
+#define COMPRESS_MIN  64    /* Smaller payloads are never compressed. */
+
+/* Content of a file which goes out in full. It counts as sent once the
+ * device threads wrote all of its frames.
+ */
+struct SendingContent {
+    ContentDigest digest;
+    std::atomic<int> pending;   /* Frames queued, plus one while queueing. */
+    std::atomic<bool> failed;
+};
 
+/* One frame (header, name and payload), written with a single write(). */
+struct Frame {
+    size_t len;
+    SendingContent *content;    /* NULL unless the frame carries content. */
+    char data[sizeof(FrameHeader) + FRAME_MAX_NAME + FRAME_MAX_PAYLOAD];
+};
+
+/* Files are read and (optionally) compressed on the calling thread, while
+ * one thread per device writes finished frames. The stages are connected by
+ * bounded queues of recycled frame buffers. With several devices, each
+ * device thread takes the next frame whenever its device accepts data, so
+ * frames of one file are striped over all of them; the reader puts them
+ * back in order by sequence number.
+ */
 class SEDWriter
 {
 public:
-    SEDWriter(std::string device);
+    SEDWriter(const std::vector<std::string> &devices, bool compress,
+              DedupCache *cache);
     ~SEDWriter();
     bool Watch(std::string folder);
+    bool SendFile(std::string path, std::string name);
 
 private:
     int watchFd;
     char buffer[BUF_LEN];
     int watch;
-    int sedFd;
+    std::vector<int> sedFds;
+    bool compress;
+    DedupCache *cache;      /* NULL unless deduplication is enabled. */
+    uint16_t stream;
+    uint32_t sequence;
+    std::vector<Frame> frames;
+    BlockingQueue<Frame *> freeFrames, fullFrames;
+    std::atomic<bool> deviceError;
+    std::vector<std::thread> deviceThreads;
+    /* Content this writer sent in full, so the reader of this stream got
+     * it unless a frame was lost. Not kept across runs: a new writer starts
+     * a new stream, possibly to a new reader. Content only counts while a
+     * name it was last sent under still holds it; the reader recreates
+     * files from those names.
+     */
+    std::mutex sentMutex;
+    std::set<ContentDigest> sent;
+    std::map<std::string, ContentDigest> sentNames;
+    std::map<ContentDigest, int> holders;   /* Names per content. */
+    char scratch[FRAME_MAX_PAYLOAD];
 
-    bool copyFileToDevice(const char *source);
+    char *payloadOf(Frame *frame, const std::string &name);
+    bool sendFrame(Frame *frame, const std::string &name, uint8_t type,
+                   uint16_t flags, uint64_t fileSize, uint64_t offset,
+                   uint32_t rawLen, uint32_t *rawCrc);
+    bool sendHello();
+    bool sendDigest(const std::string &name, const ContentDigest &digest);
+    void contentWritten(SendingContent *content, bool ok);
+    bool contentSent(const ContentDigest &digest);
+    bool sizeSent(uint64_t size);
+    void nameSent(const std::string &name, const ContentDigest *digest);
+    void deviceLoop(int sedFd);
 };
 
@@ -0,0 +1,299 @@
+/*
+ * checksum.h -- Checksums for verifying data sent over SimpleExchangeDevice
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CHECKSUM_H__
+#define __CHECKSUM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78  /* Castagnoli, reflected. */
+
+/* Lookup table of the portable version. */
+struct Crc32cTable {
+    uint32_t entries[256];
+
+    Crc32cTable()
+    {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+            entries[i] = c;
+        }
+    }
+};
+
+/* Portable byte at a time version. The table is built by the first caller;
+ * the initialization of a local static is thread safe, other threads wait
+ * for it.
+ */
+inline uint32_t crc32cScalar(uint32_t crc, const void *data, size_t len)
+{
+    static const Crc32cTable table;
+
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+    while (len--)
+        crc = table.entries[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+/* SSE4.2 crc32 instruction, eight bytes per step. Only called when the
+ * CPU reports SSE4.2, the rest of the program is built without it.
+ */
+__attribute__((target("sse4.2")))
+inline uint32_t crc32cSse42(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+    while (len && (reinterpret_cast<uintptr_t>(p) & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        --len;
+    }
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof word);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+#endif
+    while (len >= 4) {
+        uint32_t word;
+        memcpy(&word, p, sizeof word);
+        crc = _mm_crc32_u32(crc, word);
+        p += 4;
+        len -= 4;
+    }
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return ~crc;
+}
+#endif
+
+/* CRC32C of data, continuing from crc (0 to start). Picks the hardware
+ * instruction when available.
+ */
+inline uint32_t crc32cUpdate(uint32_t crc, const void *data, size_t len)
+{
+#ifdef CRC32C_HAVE_SSE42
+    static const bool sse42 = __builtin_cpu_supports("sse4.2");
+    if (sse42)
+        return crc32cSse42(crc, data, len);
+#endif
+    return crc32cScalar(crc, data, len);
+}
+
+/* Combining CRCs without touching the data again (as zlib's crc32_combine).
+ * Applies len2 zero bytes to crc1 by squaring the one zero bit operator.
+ */
+inline uint32_t crc32cGf2Times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1)
+            sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+inline void crc32cGf2Square(uint32_t *square, const uint32_t *mat)
+{
+    for (int n = 0; n < 32; n++)
+        square[n] = crc32cGf2Times(mat, mat[n]);
+}
+
+/* Returns CRC32C of A followed by B, given crc1 = CRC(A), crc2 = CRC(B) and
+ * len2 = length of B.
+ */
+inline uint32_t crc32cCombine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+    uint32_t even[32];
+    uint32_t odd[32];
+
+    if (len2 == 0)
+        return crc1;
+
+    odd[0] = CRC32C_POLY;
+    uint32_t row = 1;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    crc32cGf2Square(even, odd);     /* Two zero bits. */
+    crc32cGf2Square(odd, even);     /* Four zero bits. */
+
+    do {
+        crc32cGf2Square(even, odd);
+        if (len2 & 1)
+            crc1 = crc32cGf2Times(even, crc1);
+        len2 >>= 1;
+        if (len2 == 0)
+            break;
+        crc32cGf2Square(odd, even);
+        if (len2 & 1)
+            crc1 = crc32cGf2Times(odd, crc1);
+        len2 >>= 1;
+    } while (len2 != 0);
+
+    return crc1 ^ crc2;
+}
+
+/* XXH64, streaming. Used as a content digest, where a 32 bit CRC is too
+ * short to tell files apart.
+ */
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+struct Xxh64State {
+    uint64_t v1, v2, v3, v4;
+    uint64_t total;
+    unsigned char mem[32];
+    size_t memSize;
+};
+
+inline uint64_t xxhRotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t xxhRead64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+inline uint64_t xxhRound(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_P2;
+    acc = xxhRotl(acc, 31);
+    return acc * XXH_P1;
+}
+
+inline uint64_t xxhMerge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxhRound(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+inline void xxh64Init(Xxh64State &state, uint64_t seed)
+{
+    state.v1 = seed + XXH_P1 + XXH_P2;
+    state.v2 = seed + XXH_P2;
+    state.v3 = seed;
+    state.v4 = seed - XXH_P1;
+    state.total = 0;
+    state.memSize = 0;
+}
+
+inline void xxh64Update(Xxh64State &state, const void *data, size_t len)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    state.total += len;
+
+    if (state.memSize + len < 32) {
+        memcpy(state.mem + state.memSize, p, len);
+        state.memSize += len;
+        return;
+    }
+    if (state.memSize) {
+        size_t fill = 32 - state.memSize;
+        memcpy(state.mem + state.memSize, p, fill);
+        state.v1 = xxhRound(state.v1, xxhRead64(state.mem));
+        state.v2 = xxhRound(state.v2, xxhRead64(state.mem + 8));
+        state.v3 = xxhRound(state.v3, xxhRead64(state.mem + 16));
+        state.v4 = xxhRound(state.v4, xxhRead64(state.mem + 24));
+        p += fill;
+        len -= fill;
+        state.memSize = 0;
+    }
+    while (len >= 32) {
+        state.v1 = xxhRound(state.v1, xxhRead64(p));
+        state.v2 = xxhRound(state.v2, xxhRead64(p + 8));
+        state.v3 = xxhRound(state.v3, xxhRead64(p + 16));
+        state.v4 = xxhRound(state.v4, xxhRead64(p + 24));
+        p += 32;
+        len -= 32;
+    }
+    memcpy(state.mem, p, len);
+    state.memSize = len;
+}
+
+inline uint64_t xxh64Digest(const Xxh64State &state)
+{
+    uint64_t h;
+    if (state.total >= 32) {
+        h = xxhRotl(state.v1, 1) + xxhRotl(state.v2, 7) +
+            xxhRotl(state.v3, 12) + xxhRotl(state.v4, 18);
+        h = xxhMerge(h, state.v1);
+        h = xxhMerge(h, state.v2);
+        h = xxhMerge(h, state.v3);
+        h = xxhMerge(h, state.v4);
+    } else {
+        h = state.v3 + XXH_P5;
+    }
+    h += state.total;
+
+    const unsigned char *p = state.mem;
+    size_t len = state.memSize;
+    while (len >= 8) {
+        h ^= xxhRound(0, xxhRead64(p));
+        h = xxhRotl(h, 27) * XXH_P1 + XXH_P4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        uint32_t v;
+        memcpy(&v, p, sizeof v);
+        h ^= static_cast<uint64_t>(v) * XXH_P1;
+        h = xxhRotl(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        len -= 4;
+    }
+    while (len--) {
+        h ^= (*p++) * XXH_P5;
+        h = xxhRotl(h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+#endif
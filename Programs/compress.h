@@ -0,0 +1,220 @@
+/*
+ * compress.h -- Block compression for frames sent over SimpleExchangeDevice
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* Compressed blocks use the LZ4 block format, so they can be inspected with
+ * standard tools, but no external library is needed. The compressor is a
+ * single pass greedy matcher, which is what makes LZ4 fast enough to keep up
+ * with the device.
+ */
+#define LZ4_MINMATCH     4
+#define LZ4_LASTLITERALS 5      /* Last bytes of a block are always literals. */
+#define LZ4_MFLIMIT      12     /* No match may start closer to the end. */
+#define LZ4_HASH_LOG     12
+#define LZ4_MAX_OFFSET   0xFFFF
+
+inline uint32_t lz4Read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+inline uint32_t lz4Hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/* Writes a length continuation (for lengths >= 15). */
+inline unsigned char *lz4PutLength(unsigned char *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = static_cast<unsigned char>(len);
+    return op;
+}
+
+/* Emits one sequence: literals followed by an optional match. Returns NULL
+ * if it does not fit in dst.
+ */
+inline unsigned char *lz4PutSequence(unsigned char *op, unsigned char *opEnd,
+                                     const unsigned char *literals,
+                                     size_t litLen, size_t offset,
+                                     size_t matchLen)
+{
+    if (static_cast<size_t>(opEnd - op) <
+        1 + litLen / 255 + 1 + litLen + 2 + matchLen / 255 + 1)
+        return NULL;
+
+    unsigned char *token = op++;
+    *token = static_cast<unsigned char>((litLen >= 15 ? 15 : litLen) << 4);
+    if (litLen >= 15)
+        op = lz4PutLength(op, litLen - 15);
+    memcpy(op, literals, litLen);
+    op += litLen;
+
+    if (matchLen) {
+        *op++ = static_cast<unsigned char>(offset);
+        *op++ = static_cast<unsigned char>(offset >> 8);
+        matchLen -= LZ4_MINMATCH;
+        *token |= matchLen >= 15 ? 15 : matchLen;
+        if (matchLen >= 15)
+            op = lz4PutLength(op, matchLen - 15);
+    }
+    return op;
+}
+
+/* Compresses src into dst. Returns the compressed length, or 0 if the result
+ * would not fit in dstCap (store the block raw in that case).
+ */
+inline size_t lz4Compress(const char *src, size_t srcLen, char *dst,
+                          size_t dstCap)
+{
+    const unsigned char *base = reinterpret_cast<const unsigned char *>(src);
+    unsigned char *op = reinterpret_cast<unsigned char *>(dst);
+    unsigned char *opEnd = op + dstCap;
+    uint32_t table[1 << LZ4_HASH_LOG];
+    size_t ip = 0;
+    size_t anchor = 0;
+
+    if (srcLen > LZ4_MFLIMIT) {
+        const size_t mfLimit = srcLen - LZ4_MFLIMIT;
+        const size_t matchLimit = srcLen - LZ4_LASTLITERALS;
+        memset(table, 0, sizeof table);
+
+        while (ip < mfLimit) {
+            uint32_t seq = lz4Read32(base + ip);
+            uint32_t h = lz4Hash(seq);
+            size_t ref = table[h];
+            table[h] = ip;
+
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET ||
+                lz4Read32(base + ref) != seq) {
+                /* Skip faster through data which does not compress. */
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            /* Extend backwards over literals, then forwards. */
+            while (ip > anchor && ref > 0 && base[ip - 1] == base[ref - 1]) {
+                --ip;
+                --ref;
+            }
+            size_t matchLen = LZ4_MINMATCH;
+            while (ip + matchLen < matchLimit &&
+                   base[ip + matchLen] == base[ref + matchLen])
+                ++matchLen;
+
+            op = lz4PutSequence(op, opEnd, base + anchor, ip - anchor,
+                                ip - ref, matchLen);
+            if (!op)
+                return 0;
+            ip += matchLen;
+            anchor = ip;
+            if (ip < mfLimit)
+                table[lz4Hash(lz4Read32(base + ip - 2))] = ip - 2;
+        }
+    }
+
+    op = lz4PutSequence(op, opEnd, base + anchor, srcLen - anchor, 0, 0);
+    if (!op)
+        return 0;
+    return op - reinterpret_cast<unsigned char *>(dst);
+}
+
+/* Reads a length continuation. Returns false on truncated input. */
+inline bool lz4GetLength(const unsigned char *&ip, const unsigned char *ipEnd,
+                         size_t &len)
+{
+    unsigned char b;
+    do {
+        if (ip >= ipEnd)
+            return false;
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+/* Decompresses src into dst. Every length and offset is checked, so
+ * corrupted input can not write outside dst. Returns the decompressed length
+ * or -1 on malformed input.
+ */
+inline ssize_t lz4Decompress(const char *src, size_t srcLen, char *dst,
+                             size_t dstCap)
+{
+    const unsigned char *ip = reinterpret_cast<const unsigned char *>(src);
+    const unsigned char *ipEnd = ip + srcLen;
+    unsigned char *op = reinterpret_cast<unsigned char *>(dst);
+    unsigned char *opStart = op;
+    unsigned char *opEnd = op + dstCap;
+
+    while (ip < ipEnd) {
+        unsigned char token = *ip++;
+
+        size_t litLen = token >> 4;
+        if (litLen == 15 && !lz4GetLength(ip, ipEnd, litLen))
+            return -1;
+        if (litLen > static_cast<size_t>(ipEnd - ip) ||
+            litLen > static_cast<size_t>(opEnd - op))
+            return -1;
+        memcpy(op, ip, litLen);
+        ip += litLen;
+        op += litLen;
+
+        if (ip == ipEnd)    /* The last sequence has no match. */
+            break;
+
+        if (ipEnd - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > static_cast<size_t>(op - opStart))
+            return -1;
+
+        size_t matchLen = token & 15;
+        if (matchLen == 15 && !lz4GetLength(ip, ipEnd, matchLen))
+            return -1;
+        matchLen += LZ4_MINMATCH;
+        if (matchLen > static_cast<size_t>(opEnd - op))
+            return -1;
+
+        /* Matches may overlap their own output. */
+        const unsigned char *match = op - offset;
+        if (offset >= matchLen) {
+            memcpy(op, match, matchLen);
+            op += matchLen;
+        } else {
+            while (matchLen--)
+                *op++ = *match++;
+        }
+    }
+    return op - opStart;
+}
+
+#endif
@@ -0,0 +1,286 @@
+/*
+ * dedup.h -- Content digest cache used to skip resending known files
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DEDUP_H__
+#define __DEDUP_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include "protocol.h"
+
+inline bool operator <(const ContentDigest &a, const ContentDigest &b)
+{
+    if (a.size != b.size)
+        return a.size < b.size;
+    if (a.hash != b.hash)
+        return a.hash < b.hash;
+    return a.crc < b.crc;
+}
+
+inline bool operator ==(const ContentDigest &a, const ContentDigest &b)
+{
+    return a.size == b.size && a.hash == b.hash && a.crc == b.crc;
+}
+
+inline std::string digestToString(const ContentDigest &digest)
+{
+    char str[64];
+    snprintf(str, sizeof str, "%016llx-%016llx-%08x",
+             static_cast<unsigned long long>(digest.size),
+             static_cast<unsigned long long>(digest.hash), digest.crc);
+    return str;
+}
+
+inline bool digestFromString(const char *str, ContentDigest &digest)
+{
+    unsigned long long size, hash;
+    unsigned int crc;
+    if (sscanf(str, "%16llx-%16llx-%8x", &size, &hash, &crc) != 3)
+        return false;
+    digest.size = size;
+    digest.hash = hash;
+    digest.crc = crc;
+    return true;
+}
+
+/* Digest of a file's content, read in one pass. */
+inline bool digestFile(const std::string &path, ContentDigest &digest)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    Xxh64State state;
+    xxh64Init(state, 0);
+    digest.size = 0;
+    digest.crc = 0;
+
+    std::vector<char> data(0x10000);
+    ssize_t count;
+    while ((count = read(fd, data.data(), data.size())) != 0) {
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return false;
+        }
+        xxh64Update(state, data.data(), count);
+        digest.crc = crc32cUpdate(digest.crc, data.data(), count);
+        digest.size += count;
+    }
+    digest.hash = xxh64Digest(state);
+    close(fd);
+    return true;
+}
+
+/* Append only text file, compacted when loaded, one record per line:
+ *   K <size> <mtime> <digest> <path>   writer: file seen with this digest
+ *   R <digest> <name>                  reader: content received as name
+ * Later records for a path or name override earlier ones when loaded.
+ * Which content was sent is not kept here: it only holds for the stream it
+ * was sent in.
+ */
+class DedupCache
+{
+public:
+    DedupCache(const std::string &file) : out(NULL)
+    {
+        size_t records = 0;
+        FILE *in = fopen(file.c_str(), "r");
+        if (in) {
+            char line[FRAME_MAX_NAME + PATH_MAX_LINE];
+            while (fgets(line, sizeof line, in)) {
+                load(line);
+                ++records;
+            }
+            fclose(in);
+        }
+        /* Files which are gone will not be sent again. */
+        std::map<std::string, Key>::iterator it = keys.begin();
+        while (it != keys.end()) {
+            if (access(it->first.c_str(), F_OK) != 0 && errno == ENOENT)
+                keys.erase(it++);
+            else
+                ++it;
+        }
+        if (records > keys.size() + receivedNames.size())
+            compact(file);
+        out = fopen(file.c_str(), "a");
+    }
+
+    ~DedupCache()
+    {
+        if (out)
+            fclose(out);
+    }
+
+    bool Valid() const
+    {
+        return out != NULL;
+    }
+
+    /* Digest of path, if it was seen with the same size and mtime. */
+    bool Lookup(const std::string &path, uint64_t size, int64_t mtime,
+                ContentDigest &digest) const
+    {
+        std::map<std::string, Key>::const_iterator it = keys.find(path);
+        if (it == keys.end() || it->second.size != size ||
+            it->second.mtime != mtime)
+            return false;
+        digest = it->second.digest;
+        return true;
+    }
+
+    void Store(const std::string &path, uint64_t size, int64_t mtime,
+               const ContentDigest &digest)
+    {
+        Key key = { size, mtime, digest };
+        keys[path] = key;
+        writeKey(out, path, key);
+        fflush(out);
+    }
+
+    /* Names of received files which had this content, latest first. Any
+     * of them may have been changed since.
+     */
+    bool Find(const ContentDigest &digest,
+              std::vector<std::string> &names) const
+    {
+        std::map<ContentDigest, std::vector<std::string> >::const_iterator
+        it = received.find(digest);
+        if (it == received.end())
+            return false;
+        names.assign(it->second.rbegin(), it->second.rend());
+        return true;
+    }
+
+    void Remember(const ContentDigest &digest, const std::string &name)
+    {
+        receive(digest, name);
+        writeReceived(out, digest, name);
+        fflush(out);
+    }
+
+private:
+    enum { PATH_MAX_LINE = 4096 };
+
+    struct Key {
+        uint64_t size;
+        int64_t mtime;
+        ContentDigest digest;
+    };
+
+    FILE *out;
+    std::map<std::string, Key> keys;
+    std::map<ContentDigest, std::vector<std::string> > received;
+    std::map<std::string, ContentDigest> receivedNames;
+
+    /* A name holds the content it was received with last. */
+    void receive(const ContentDigest &digest, const std::string &name)
+    {
+        std::map<std::string, ContentDigest>::iterator it =
+            receivedNames.find(name);
+        if (it != receivedNames.end()) {
+            std::vector<std::string> &names = received[it->second];
+            names.erase(std::find(names.begin(), names.end(), name));
+            if (names.empty())
+                received.erase(it->second);
+            it->second = digest;
+        } else {
+            receivedNames[name] = digest;
+        }
+        received[digest].push_back(name);
+    }
+
+    void writeKey(FILE *file, const std::string &path, const Key &key)
+    {
+        fprintf(file, "K %llu %lld %s %s\n",
+                static_cast<unsigned long long>(key.size),
+                static_cast<long long>(key.mtime),
+                digestToString(key.digest).c_str(), path.c_str());
+    }
+
+    void writeReceived(FILE *file, const ContentDigest &digest,
+                       const std::string &name)
+    {
+        fprintf(file, "R %s %s\n", digestToString(digest).c_str(),
+                name.c_str());
+    }
+
+    /* Records only get appended, so rewrite the file with the ones which
+     * are still in effect once some were overridden or dropped. The file is
+     * replaced by a rename and is left as it was on any error.
+     */
+    void compact(const std::string &file)
+    {
+        std::string tmp = file + ".tmp";
+        FILE *next = fopen(tmp.c_str(), "w");
+        if (!next)
+            return;
+        std::map<std::string, Key>::const_iterator kit;
+        for (kit = keys.begin(); kit != keys.end(); ++kit)
+            writeKey(next, kit->first, kit->second);
+        std::map<std::string, ContentDigest>::const_iterator rit;
+        for (rit = receivedNames.begin(); rit != receivedNames.end(); ++rit)
+            writeReceived(next, rit->second, rit->first);
+        bool ok = fflush(next) == 0 && fsync(fileno(next)) == 0;
+        ok = fclose(next) == 0 && ok;
+        if (!ok || rename(tmp.c_str(), file.c_str()) != 0)
+            unlink(tmp.c_str());
+    }
+
+    void load(char *line)
+    {
+        size_t len = strlen(line);
+        if (len && line[len - 1] == '\n')
+            line[--len] = '\0';
+
+        char digestStr[64];
+        int pos = 0;
+        ContentDigest digest;
+        if (line[0] == 'K') {
+            unsigned long long size;
+            long long mtime;
+            if (sscanf(line, "K %llu %lld %63s %n", &size, &mtime, digestStr,
+                       &pos) != 3 || !pos ||
+                !digestFromString(digestStr, digest))
+                return;
+            Key key = { size, mtime, digest };
+            keys[line + pos] = key;
+        } else if (line[0] == 'R') {
+            if (sscanf(line, "R %63s %n", digestStr, &pos) == 1 && pos &&
+                digestFromString(digestStr, digest))
+                receive(digest, line + pos);
+        }
+    }
+
+    DedupCache(const DedupCache&);
+    DedupCache& operator =(const DedupCache&);
+};
+
+#endif
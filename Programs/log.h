@@ -3,32 +3,346 @@
 #ifndef __LOG_H__
 #define __LOG_H__
 
-#include <sstream>
+#include <ostream>
+#include <algorithm>
+#include <streambuf>
 #include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <strings.h>
+#include <time.h>
+
+#include "trace.h"
 
 enum LogLevel {ERROR, DEBUG};
 
+/* Levels above LOG_MAX_LEVEL are compiled out, e.g. -DLOG_MAX_LEVEL=ERROR. */
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL DEBUG
+#endif
+
+#define LOG_RECORD_SIZE 256     /* Longer messages are truncated. */
+#define LOG_RING_SIZE   256     /* Records per thread, power of two. */
+#define LOG_RATE_LIMIT  10000   /* Records per second per thread. */
+#define LOG_RATE_BURST  1000
+#define LOG_FLUSH_MS    20      /* How long a batch collects records. */
+
+/* Logging only appends a record to a ring owned by the calling thread. A
+ * background thread formats the records and writes them in batches, so the
+ * caller never formats time or waits for stderr. It takes a lock only to
+ * wake the log thread, which sleeps while every ring is empty.
+ */
+struct LogRecord {
+    int64_t time;               /* CLOCK_REALTIME, ns. */
+    uint32_t level;
+    uint32_t len;
+    char text[LOG_RECORD_SIZE - 16];
+};
+
+/* Single producer (the owning thread), single consumer (the log thread). */
+struct LogRing {
+    std::atomic<uint64_t> head;         /* Next record to write. */
+    std::atomic<uint64_t> tail;         /* Next record to read. */
+    std::atomic<uint64_t> dropped;      /* Ring full or rate limited. */
+    std::atomic<bool> detached;         /* Owning thread has exited. */
+    LogRecord records[LOG_RING_SIZE];
+
+    LogRing() : head(0), tail(0), dropped(0), detached(false) {}
+};
+
+/* Lets threads wake the log thread. Shared with them, as they may outlive
+ * the backend.
+ */
+struct LogWake {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::atomic<bool> idle;             /* Log thread waits for a record. */
+
+    LogWake() : idle(false) {}
+
+    /* Called after a record was added to ring. Wakes the log thread if
+     * the ring was empty before, as the log thread may be sleeping then.
+     */
+    void Queued(LogRing *ring, uint64_t head)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (ring->tail.load(std::memory_order_relaxed) != head)
+            return;
+        if (idle.load(std::memory_order_relaxed) && idle.exchange(false)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            cond.notify_all();
+        }
+    }
+};
+
+class LogBackend
+{
+public:
+    static LogBackend& Instance()
+    {
+        static LogBackend backend;
+        return backend;
+    }
+
+    /* A ring is shared with its thread, which may still log after the
+     * backend is gone; its records are then lost.
+     */
+    std::shared_ptr<LogRing> Register()
+    {
+        std::shared_ptr<LogRing> ring(new LogRing);
+        std::lock_guard<std::mutex> lock(mutex);
+        rings.push_back(ring);
+        return ring;
+    }
+
+    std::shared_ptr<LogWake> Wake() const
+    {
+        return wake;
+    }
+
+    ~LogBackend()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+            wake->cond.notify_all();
+        }
+        thread.join();
+    }
+
+private:
+    std::shared_ptr<LogWake> wake;
+    std::mutex &mutex;
+    bool stop;
+    std::vector<std::shared_ptr<LogRing> > rings;
+    std::string batch;
+    std::thread thread;
+
+    LogBackend() : wake(new LogWake), mutex(wake->mutex), stop(false)
+    {
+        thread = std::thread(&LogBackend::run, this);
+    }
+
+    static const char *levelName(uint32_t level)
+    {
+        static const char *const names[] = {"ERROR", "DEBUG"};
+        return level <= DEBUG ? names[level] : "?";
+    }
+
+    /* Formats everything queued so far. Called with mutex held. */
+    void drain()
+    {
+        char line[LOG_RECORD_SIZE + 64];
+        for (size_t i = 0; i < rings.size(); ) {
+            LogRing *ring = rings[i].get();
+            uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            for (; tail != head; ++tail) {
+                const LogRecord &rec = ring->records[tail & (LOG_RING_SIZE - 1)];
+                int len = snprintf(line, sizeof line, "%lld.%06lld %s: %.*s\n",
+                                   static_cast<long long>(rec.time / 1000000000),
+                                   static_cast<long long>(rec.time % 1000000000 / 1000),
+                                   levelName(rec.level), static_cast<int>(rec.len),
+                                   rec.text);
+                batch.append(line, std::min<size_t>(len, sizeof line - 1));
+            }
+            ring->tail.store(tail, std::memory_order_release);
+
+            uint64_t dropped = ring->dropped.exchange(0);
+            if (dropped) {
+                int len = snprintf(line, sizeof line,
+                                   "%lld log records dropped\n",
+                                   static_cast<long long>(dropped));
+                batch.append(line, len);
+            }
+
+            /* Rings of exited threads go once they are empty. */
+            if (ring->detached && ring->head.load() == tail) {
+                rings.erase(rings.begin() + i);
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    /* Whether any ring holds records. Called with mutex held. */
+    bool queued() const
+    {
+        for (size_t i = 0; i < rings.size(); ++i)
+            if (rings[i]->head.load() != rings[i]->tail.load())
+                return true;
+        return false;
+    }
+
+    bool woken() const
+    {
+        return stop || !wake->idle;
+    }
+
+    bool stopped() const
+    {
+        return stop;
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (1) {
+            /* Sleep until some thread queues a record to an empty ring,
+             * then let the batch collect records for LOG_FLUSH_MS. Drops
+             * alone are reported along with the next record.
+             */
+            wake->idle = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!queued())
+                wake->cond.wait(lock, std::bind(&LogBackend::woken, this));
+            wake->idle = false;
+            wake->cond.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_MS),
+                          std::bind(&LogBackend::stopped, this));
+            drain();
+            if (!batch.empty()) {
+                fwrite(batch.data(), 1, batch.size(), stderr);
+                fflush(stderr);
+                batch.clear();
+            }
+            if (stop)
+                break;
+        }
+    }
+
+    LogBackend(const LogBackend&);
+    LogBackend& operator =(const LogBackend&);
+};
+
+/* Streams straight into the reserved record, truncating at its end. */
+class LogStreamBuf : public std::streambuf
+{
+public:
+    void Reset(char *begin, size_t size)
+    {
+        setp(begin, begin + size);
+    }
+    size_t Length() const
+    {
+        return pptr() - pbase();
+    }
+protected:
+    virtual int_type overflow(int_type c)
+    {
+        return traits_type::not_eof(c);
+    }
+};
+
+/* Per thread state, so the stream is constructed once per thread. */
+struct LogThread {
+    std::shared_ptr<LogRing> ring;
+    std::shared_ptr<LogWake> wake;
+    LogStreamBuf buf;
+    std::ostream os;
+    std::ios_base::fmtflags flags;
+    char discard[LOG_RECORD_SIZE];
+    int64_t tokens;
+    int64_t refilled;
+    /* Records being written, more than one when a log statement calls
+     * something which logs too. Those nested records go to the discard
+     * buffer through their own stream, so the outer one stays intact.
+     */
+    int depth;
+    LogStreamBuf nestedBuf;
+    std::ostream nested;
+
+    LogThread() : ring(LogBackend::Instance().Register()),
+        wake(LogBackend::Instance().Wake()), os(&buf),
+        flags(os.flags()), tokens(LOG_RATE_BURST), refilled(0), depth(0),
+        nested(&nestedBuf) {}
+    ~LogThread()
+    {
+        ring->detached = true;
+    }
+
+    static LogThread& Current()
+    {
+        static thread_local LogThread current;
+        return current;
+    }
+
+    /* Token bucket: LOG_RATE_LIMIT per second, bursts of LOG_RATE_BURST. */
+    bool Allow(int64_t now)
+    {
+        if (now - refilled >= 1000000) {
+            tokens += (now - refilled) / (1000000000 / LOG_RATE_LIMIT);
+            if (tokens > LOG_RATE_BURST)
+                tokens = LOG_RATE_BURST;
+            refilled = now;
+        }
+        if (tokens <= 0)
+            return false;
+        --tokens;
+        return true;
+    }
+};
+
 class Log
 {
 public:
-    Log() {}
+    Log() : thread(LogThread::Current()), record(NULL),
+        isNested(thread.depth++ > 0) {}
     virtual ~Log()
     {
-        os << std::endl;
-        fprintf(stderr, "%s", os.str().c_str());
-        fflush(stderr);
+        --thread.depth;
+        if (!record)
+            return;
+        record->len = thread.buf.Length();
+        thread.ring->head.store(head + 1, std::memory_order_release);
+        thread.wake->Queued(thread.ring.get(), head);
     }
-    std::ostringstream& Get(LogLevel level = DEBUG)
+    std::ostream& Get(LogLevel level = DEBUG)
     {
-        os << time(0);
-        os << " " << ToString(level) << ": ";
-        return os;
+        LogRing *ring = thread.ring.get();
+        if (isNested) {
+            ++ring->dropped;
+            thread.nestedBuf.Reset(thread.discard, sizeof thread.discard);
+            thread.nested.flags(thread.flags);
+            thread.nested.clear();
+            return thread.nested;
+        }
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        int64_t now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+        /* Manipulators of the previous record must not leak into this one. */
+        thread.os.flags(thread.flags);
+        thread.os.clear();
+
+        head = ring->head.load(std::memory_order_relaxed);
+        if (!thread.Allow(now) ||
+            head - ring->tail.load(std::memory_order_acquire) >= LOG_RING_SIZE) {
+            ++ring->dropped;
+            thread.buf.Reset(thread.discard, sizeof thread.discard);
+            return thread.os;
+        }
+
+        record = &ring->records[head & (LOG_RING_SIZE - 1)];
+        record->time = now;
+        record->level = level;
+        thread.buf.Reset(record->text, sizeof record->text);
+        return thread.os;
     }
 public:
+    /* Taken from SCD_LOG_LEVEL once, at the first use. */
     static LogLevel& LLevel()
     {
-        static LogLevel llevel = DEBUG;
+        static LogLevel llevel = initialLevel();
         return llevel;
     }
     static std::string ToString(LogLevel level)
@@ -36,20 +350,47 @@ public:
         static std::string const buffer[] = {"ERROR", "DEBUG"};
         return buffer[level];
     }
-    static LogLevel FromString(const std::string& level);
+    static LogLevel FromString(const std::string& level)
+    {
+        if (strcasecmp(level.c_str(), "ERROR") == 0)
+            return ERROR;
+        return DEBUG;
+    }
 protected:
-    std::ostringstream os;
+    LogThread &thread;
+    LogRecord *record;
+    uint64_t head;
+    bool isNested;
 private:
     Log(const Log&);
     Log& operator =(const Log&);
+
+    static LogLevel initialLevel()
+    {
+        const char *level = getenv("SCD_LOG_LEVEL");
+        return level ? FromString(level) : DEBUG;
+    }
 };
 
 #define LOGDEBUG() \
-    if (DEBUG > Log::LLevel()) ; \
+    if (DEBUG > LOG_MAX_LEVEL || DEBUG > Log::LLevel()) ; \
     else Log().Get(DEBUG) << "[" << __FILE__ << " (" << __LINE__ << ")] "
 
 #define LOGERR() \
-    if (ERROR > Log::LLevel()) ; \
+    if (ERROR > LOG_MAX_LEVEL || ERROR > Log::LLevel()) ; \
     else Log().Get(ERROR) << "[" << __FILE__ << " (" << __LINE__ << ")] "
 
+/* Binary tracing for hot paths, e.g. per chunk. Only active when SCD_TRACE
+ * names a trace file; the format uses {} for each argument and is rendered
+ * offline by tracedecode. Compiled out with the DEBUG level.
+ */
+#define LOGTRACE(format, ...) \
+    do { \
+        if (DEBUG <= LOG_MAX_LEVEL && Trace::Instance().Active()) { \
+            static const uint32_t scdTraceSite = \
+                Trace::Instance().Define(format, __FILE__, __LINE__); \
+            Trace::Instance().Write(scdTraceSite, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
 #endif
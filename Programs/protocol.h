@@ -0,0 +1,159 @@
+/*
+ * protocol.h -- Framing used by Writer and Reader over SimpleExchangeDevice
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "checksum.h"
+
+/* Every frame on the device is a FrameHeader followed by nameLen bytes of
+ * file name and payloadLen bytes of file data. Files are split into frames of
+ * at most FRAME_MAX_PAYLOAD bytes, so many files can share one open device.
+ * Integers are in host byte order as both ends live on the same machine.
+ */
+#define FRAME_MAGIC       0x46444353    /* "SCDF" */
+#define FRAME_VERSION     4
+#define FRAME_MAX_NAME    255
+#define FRAME_MAX_PAYLOAD 0x4000        /* Half of the default ring. */
+
+enum FrameType {
+    FRAME_DATA = 1,     /* File name plus a piece of file content. */
+    FRAME_TRAILER = 2,  /* File name plus FrameTrailer, ends a file. */
+    FRAME_HELLO = 3,    /* No name, StreamHello. Starts a stream. */
+    FRAME_DIGEST = 4    /* File name plus ContentDigest, instead of data. */
+};
+
+enum FrameFlags {
+    FRAME_FIRST = 0x0001,       /* First frame of a file: (re)create it. */
+    FRAME_LAST  = 0x0002,       /* Last frame of a file: close it. */
+    FRAME_COMPRESSED = 0x0004   /* Payload is an LZ4 block of rawLen bytes. */
+};
+
+/* Features the writer uses in this stream. The writer announces them once,
+ * when it opens the devices, so a reader which opens them later does not see
+ * it. Frames therefore carry what is needed to decode them in their flags;
+ * the hello only lets the reader warn about features it does not know.
+ */
+enum StreamFeatures {
+    STREAM_LZ4 = 0x00000001
+};
+
+#define STREAM_SUPPORTED (STREAM_LZ4)
+
+struct StreamHello {
+    uint32_t features;
+} __attribute__((packed));
+
+/* A file which fits in one frame is sent as FRAME_FIRST | FRAME_LAST and is
+ * covered by the frame checksum. Longer files end with a FRAME_TRAILER frame
+ * carrying the CRC32C of the whole file, verified by the reader on receipt.
+ */
+struct FrameTrailer {
+    uint32_t fileChecksum;
+} __attribute__((packed));
+
+/* Identifies file content for deduplication. A FRAME_DIGEST frame tells the
+ * reader it already has this content and should recreate the file from it.
+ */
+struct ContentDigest {
+    uint64_t size;
+    uint64_t hash;          /* XXH64 */
+    uint32_t crc;           /* CRC32C */
+} __attribute__((packed));
+
+struct FrameHeader {
+    uint32_t magic;
+    uint8_t  version;
+    uint8_t  type;
+    uint16_t flags;
+    uint32_t sequence;      /* Per stream frame counter, detects loss. */
+    uint16_t nameLen;
+    uint16_t stream;        /* Random per writer, never 0. */
+    uint32_t payloadLen;    /* Bytes on the device. */
+    uint32_t rawLen;        /* Bytes before compression. */
+    uint32_t checksum;      /* CRC32C of raw payload, then name. */
+    uint64_t fileSize;
+    uint64_t offset;        /* Offset of the payload within the file. */
+} __attribute__((packed));
+
+/* Checksum of a frame. The CRC of the raw payload is computed first so that
+ * the same value can be folded into the whole file CRC with crc32cCombine.
+ */
+inline uint32_t frameChecksum(uint32_t payloadCrc, const char *name,
+                              size_t nameLen)
+{
+    return crc32cUpdate(payloadCrc, name, nameLen);
+}
+
+inline bool frameHeaderValid(const FrameHeader &hdr)
+{
+    if (hdr.magic != FRAME_MAGIC || hdr.version != FRAME_VERSION ||
+        hdr.stream == 0)
+        return false;
+    if (hdr.nameLen > FRAME_MAX_NAME || hdr.payloadLen > FRAME_MAX_PAYLOAD ||
+        hdr.rawLen > FRAME_MAX_PAYLOAD)
+        return false;
+    if (!(hdr.flags & FRAME_COMPRESSED) && hdr.rawLen != hdr.payloadLen)
+        return false;
+    return hdr.type == FRAME_HELLO || hdr.nameLen > 0;
+}
+
+/* Device reads and writes may be partial. These loop until done.
+ * Return false on error or end of stream.
+ */
+inline bool writeFully(int fd, const void *data, size_t len)
+{
+    const char *pos = static_cast<const char *>(data);
+    while (len > 0) {
+        ssize_t count = write(fd, pos, len);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        len -= count;
+        pos += count;
+    }
+    return true;
+}
+
+inline bool readFully(int fd, void *data, size_t len)
+{
+    char *pos = static_cast<char *>(data);
+    while (len > 0) {
+        ssize_t count = read(fd, pos, len);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (count == 0)
+            return false;
+        len -= count;
+        pos += count;
+    }
+    return true;
+}
+
+#endif
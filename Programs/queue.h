@@ -0,0 +1,80 @@
+/*
+ * queue.h -- Bounded queue connecting pipeline stages of Writer and Reader
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+/* Push blocks while the queue is full, Pop blocks while it is empty. After
+ * Close, Push fails and Pop drains what is left, then fails.
+ */
+template <typename T>
+class BlockingQueue
+{
+public:
+    BlockingQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+    bool Push(const T &item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (items.size() >= capacity && !closed)
+            notFull.wait(lock);
+        if (closed)
+            return false;
+        items.push_back(item);
+        notEmpty.notify_one();
+        return true;
+    }
+
+    bool Pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (items.empty() && !closed)
+            notEmpty.wait(lock);
+        if (items.empty())
+            return false;
+        item = items.front();
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void Close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable notFull, notEmpty;
+
+    BlockingQueue(const BlockingQueue&);
+    BlockingQueue& operator =(const BlockingQueue&);
+};
+
+#endif
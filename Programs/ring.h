@@ -0,0 +1,196 @@
+/*
+ * ring.h -- Circular buffer with the semantics of SimpleCharacterDriver
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <new>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Ring<Capacity, Policy> is the circular buffer of scd_read, scd_write and
+ * freespace() in user space: read and write positions, one slot always
+ * kept empty, so Capacity - 1 bytes can be stored. It serves as the model
+ * the driver is checked against and as an in-process transport.
+ *
+ * Read and Write never block. They move as much as they can and return the
+ * number of bytes moved, 0 when the ring is empty or full. The policy says
+ * who may call them concurrently and how much one call moves:
+ *
+ * SpscLockFree    one writer and one reader thread, no locks. Like the
+ *                 driver, a call stops at the end of the buffer.
+ * MpmcLocked      any number of threads, serialized by a mutex as the
+ *                 driver does with its semaphore. Stops at the end too.
+ * TwoSegmentBulk  one writer and one reader thread, no locks, and a call
+ *                 continues over the wrap with a second copy.
+ */
+struct RingNoMutex {
+};
+
+struct RingNoLock {
+    explicit RingNoLock(RingNoMutex &) {}
+};
+
+struct SpscLockFree {
+    typedef RingNoMutex Mutex;
+    typedef RingNoLock Lock;
+    static const bool bulk = false;
+};
+
+struct MpmcLocked {
+    typedef std::mutex Mutex;
+    typedef std::lock_guard<std::mutex> Lock;
+    static const bool bulk = false;
+};
+
+struct TwoSegmentBulk {
+    typedef RingNoMutex Mutex;
+    typedef RingNoLock Lock;
+    static const bool bulk = true;
+};
+
+#define RING_CACHE_LINE 64
+
+template <size_t Capacity, typename Policy = SpscLockFree>
+class Ring
+{
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                  "Ring capacity must be a power of two");
+
+public:
+    static const size_t capacity = Capacity;
+
+    Ring() : read(0), write(0) {}
+
+    /* Before C++17 plain new ignores the cache line alignment of the
+     * members, so rings allocated on the heap get it here.
+     */
+    static void *operator new(size_t size)
+    {
+        void *p;
+        if (posix_memalign(&p, RING_CACHE_LINE, size) != 0)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    static void operator delete(void *p)
+    {
+        free(p);
+    }
+
+    /* Bytes which can be written now, as freespace() in the driver. */
+    size_t Free() const
+    {
+        typename Policy::Lock lock(mutex);
+        return freespace(read.load(std::memory_order_acquire),
+                         write.load(std::memory_order_acquire));
+    }
+
+    /* Bytes which can be read now. */
+    size_t Size() const
+    {
+        typename Policy::Lock lock(mutex);
+        return (write.load(std::memory_order_acquire) -
+                read.load(std::memory_order_acquire)) & mask;
+    }
+
+    bool Empty() const
+    {
+        return Size() == 0;
+    }
+
+    size_t Write(const void *data, size_t len)
+    {
+        typename Policy::Lock lock(mutex);
+        size_t r = read.load(std::memory_order_acquire);
+        size_t w = write.load(std::memory_order_relaxed);
+        const char *src = static_cast<const char *>(data);
+        size_t count;
+
+        if (Policy::bulk) {
+            count = std::min(len, freespace(r, w));
+            size_t first = std::min(count, Capacity - w);
+            memcpy(buffer + w, src, first);
+            memcpy(buffer, src + first, count - first);
+        } else {
+            /* As scd_write: up to the end of the buffer, or to one before
+             * it if read is at the beginning, or to one before read.
+             */
+            if (w >= r)
+                count = std::min(len, Capacity - w - (r == 0 ? 1 : 0));
+            else
+                count = std::min(len, r - w - 1);
+            memcpy(buffer + w, src, count);
+        }
+
+        write.store((w + count) & mask, std::memory_order_release);
+        return count;
+    }
+
+    size_t Read(void *data, size_t len)
+    {
+        typename Policy::Lock lock(mutex);
+        size_t w = write.load(std::memory_order_acquire);
+        size_t r = read.load(std::memory_order_relaxed);
+        char *dst = static_cast<char *>(data);
+        size_t count;
+
+        if (Policy::bulk) {
+            count = std::min(len, (w - r) & mask);
+            size_t first = std::min(count, Capacity - r);
+            memcpy(dst, buffer + r, first);
+            memcpy(dst + first, buffer, count - first);
+        } else {
+            /* As scd_read: up to write, or to the end if write wrapped. */
+            if (w >= r)
+                count = std::min(len, w - r);
+            else
+                count = std::min(len, Capacity - r);
+            memcpy(dst, buffer + r, count);
+        }
+
+        read.store((r + count) & mask, std::memory_order_release);
+        return count;
+    }
+
+private:
+    static const size_t mask = Capacity - 1;
+
+    /* Positions are written by one side only; keeping them on their own
+     * cache lines stops the two sides from invalidating each other.
+     */
+    alignas(RING_CACHE_LINE) std::atomic<size_t> read;
+    alignas(RING_CACHE_LINE) std::atomic<size_t> write;
+    alignas(RING_CACHE_LINE) mutable typename Policy::Mutex mutex;
+    alignas(RING_CACHE_LINE) char buffer[Capacity];
+
+    static size_t freespace(size_t r, size_t w)
+    {
+        return (r - w - 1) & mask;
+    }
+
+    Ring(const Ring&);
+    Ring& operator =(const Ring&);
+};
+
+#endif
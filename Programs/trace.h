@@ -0,0 +1,435 @@
+/*
+ * trace.h -- Binary trace log with deferred formatting
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <string>
+#include <atomic>
+#include <type_traits>
+#include <algorithm>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_HAVE_TSC 1
+#endif
+
+/* A trace file is a header, an area for the call site definitions and a
+ * ring of variable length records. Nothing is formatted when tracing: a
+ * record holds the id of its call site, a tick count and the raw arguments.
+ * The format strings are written once per call site, and tracedecode renders
+ * the text offline.
+ *
+ * The ring wraps and overwrites the oldest records, so a trace always holds
+ * the latest events. It is divided into chunks which records never cross,
+ * and every chunk starts with a sync record; tracedecode resyncs there after
+ * the partly overwritten chunk.
+ */
+#define TRACE_MAGIC        0x54444353  /* "SCDT" */
+#define TRACE_VERSION      2
+#define TRACE_DEFAULT_MB   64          /* Unless SCD_TRACE_MB says otherwise. */
+#define TRACE_DEFINE_SIZE  (256 << 10) /* Bytes for call site definitions. */
+#define TRACE_CHUNK_SIZE   (64 << 10)
+#define TRACE_MAX_STRING   64          /* Longer string arguments are cut. */
+#define TRACE_SYNC_TICKS   (1ULL << 28)
+
+/* Reserved site ids. Call sites are numbered from 1. */
+#define TRACE_SITE_NONE    0           /* Record not (fully) written. */
+#define TRACE_SITE_DEFINE  0xFFFFFFFF  /* TraceDefine, format and location. */
+#define TRACE_SITE_SYNC    0xFFFFFFFE  /* TraceSync, ticks to wall clock. */
+#define TRACE_SITE_PAD     0xFFFFFFFD  /* Unused rest of a chunk. */
+
+enum TraceClock {
+    TRACE_CLOCK_MONOTONIC = 0,  /* Ticks are nanoseconds. */
+    TRACE_CLOCK_TSC = 1,
+};
+
+enum TraceArgType {
+    TRACE_ARG_INT = 1,          /* int64_t */
+    TRACE_ARG_UINT = 2,         /* uint64_t */
+    TRACE_ARG_DOUBLE = 3,       /* double */
+    TRACE_ARG_STRING = 4,       /* uint16_t length, then the bytes */
+};
+
+struct TraceFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t clock;                     /* TraceClock */
+    uint32_t chunkSize;                 /* Records never cross a chunk. */
+    uint64_t defineCapacity;            /* Bytes for definitions. */
+    uint64_t capacity;                  /* Bytes of the ring, whole chunks. */
+    std::atomic<uint64_t> defineTail;   /* Definition bytes reserved. */
+    std::atomic<uint64_t> tail;         /* Ring bytes reserved, ever. */
+    std::atomic<uint64_t> dropped;      /* Records which did not fit. */
+};
+
+/* Records are 8 byte aligned. size is stored first and site last, so a
+ * record cut short by a crash can be skipped. A chunk ends early with a pad
+ * record, or with less than a record header left.
+ */
+struct TraceRecord {
+    std::atomic<uint32_t> site;
+    uint32_t size;                      /* Whole record, with arguments. */
+    uint64_t ticks;
+    uint32_t thread;
+    uint32_t argc;
+};
+
+struct TraceDefine {
+    uint32_t id;
+    uint32_t line;
+    uint16_t fileLen;
+    uint16_t formatLen;
+    /* Followed by file and format, not terminated. */
+};
+
+struct TraceSync {
+    int64_t realtime;                   /* CLOCK_REALTIME, ns, at ticks. */
+};
+
+inline uint64_t traceTicks()
+{
+#ifdef TRACE_HAVE_TSC
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/* Argument encoding: a type byte followed by the value. */
+inline size_t traceArgSize(const char *s)
+{
+    return 1 + sizeof(uint16_t) + std::min<size_t>(strlen(s), TRACE_MAX_STRING);
+}
+
+inline size_t traceArgSize(const std::string &s)
+{
+    return 1 + sizeof(uint16_t) + std::min<size_t>(s.length(), TRACE_MAX_STRING);
+}
+
+template <typename T>
+inline size_t traceArgSize(const T &)
+{
+    static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value,
+                  "LOGTRACE takes numbers and strings");
+    return 1 + sizeof(uint64_t);
+}
+
+inline char *traceArgPut(char *p, const char *s, size_t len)
+{
+    uint16_t n = std::min<size_t>(len, TRACE_MAX_STRING);
+    *p++ = TRACE_ARG_STRING;
+    memcpy(p, &n, sizeof n);
+    memcpy(p + sizeof n, s, n);
+    return p + sizeof n + n;
+}
+
+inline char *traceArgPut(char *p, const char *s)
+{
+    return traceArgPut(p, s, strlen(s));
+}
+
+inline char *traceArgPut(char *p, const std::string &s)
+{
+    return traceArgPut(p, s.data(), s.length());
+}
+
+inline char *traceArgPut(char *p, double v)
+{
+    *p++ = TRACE_ARG_DOUBLE;
+    memcpy(p, &v, sizeof v);
+    return p + sizeof v;
+}
+
+inline char *traceArgPut(char *p, float v)
+{
+    return traceArgPut(p, static_cast<double>(v));
+}
+
+template <typename T>
+inline char *traceArgPut(char *p, const T &v)
+{
+    uint64_t bits = static_cast<uint64_t>(v);
+    *p++ = std::is_signed<T>::value ? TRACE_ARG_INT : TRACE_ARG_UINT;
+    memcpy(p, &bits, sizeof bits);
+    return p + sizeof bits;
+}
+
+inline size_t traceArgsSize()
+{
+    return 0;
+}
+
+template <typename T, typename... Rest>
+inline size_t traceArgsSize(const T &v, const Rest &... rest)
+{
+    return traceArgSize(v) + traceArgsSize(rest...);
+}
+
+inline char *traceArgsPut(char *p)
+{
+    return p;
+}
+
+template <typename T, typename... Rest>
+inline char *traceArgsPut(char *p, const T &v, const Rest &... rest)
+{
+    return traceArgsPut(traceArgPut(p, v), rest...);
+}
+
+/* The trace file of this process, mapped once from SCD_TRACE. Records are
+ * appended by reserving space with a compare and swap on the ring tail, so
+ * any thread may trace without locks. Call sites whose definition does not
+ * fit, and records larger than a chunk, are dropped and counted.
+ */
+class Trace
+{
+public:
+    static Trace& Instance()
+    {
+        static Trace trace;
+        return trace;
+    }
+
+    bool Active() const
+    {
+        return hdr != NULL;
+    }
+
+    /* Registers a call site; called once per site. Returns TRACE_SITE_NONE
+     * if there is no room for the definition, and the site is not traced.
+     */
+    uint32_t Define(const char *format, const char *file, int line)
+    {
+        size_t fileLen = std::min<size_t>(strlen(file), 0xFFFF);
+        size_t formatLen = std::min<size_t>(strlen(format), 0xFFFF);
+        TraceRecord *rec = reserveDefine(sizeof(TraceDefine) + fileLen +
+                                         formatLen);
+        if (!rec)
+            return TRACE_SITE_NONE;
+        uint32_t id = nextSite++;
+        rec->ticks = traceTicks();
+        rec->thread = threadId();
+        rec->argc = 0;
+        TraceDefine def;
+        def.id = id;
+        def.line = line;
+        def.fileLen = fileLen;
+        def.formatLen = formatLen;
+        char *p = reinterpret_cast<char *>(rec + 1);
+        memcpy(p, &def, sizeof def);
+        memcpy(p + sizeof def, file, fileLen);
+        memcpy(p + sizeof def + fileLen, format, formatLen);
+        rec->site.store(TRACE_SITE_DEFINE, std::memory_order_release);
+        return id;
+    }
+
+    template <typename... Args>
+    void Write(uint32_t site, const Args &... args)
+    {
+        if (site == TRACE_SITE_NONE)
+            return;
+        /* One thread takes the turn to sync, even if the sync is dropped. */
+        uint64_t ticks = traceTicks();
+        uint64_t last = lastSync.load(std::memory_order_relaxed);
+        if (ticks - last > TRACE_SYNC_TICKS &&
+            lastSync.compare_exchange_strong(last, ticks,
+                                             std::memory_order_relaxed))
+            sync();
+        TraceRecord *rec = reserve(traceArgsSize(args...));
+        if (!rec)
+            return;
+        rec->ticks = ticks;
+        rec->thread = threadId();
+        rec->argc = sizeof...(args);
+        traceArgsPut(reinterpret_cast<char *>(rec + 1), args...);
+        rec->site.store(site, std::memory_order_release);
+    }
+
+    ~Trace()
+    {
+        if (!hdr)
+            return;
+        /* Final sync, so short traces can still be converted to time. The
+         * mapping stays, threads may still be tracing while exiting.
+         */
+        sync();
+    }
+
+private:
+    TraceFileHeader *hdr;
+    char *defines;
+    char *ring;
+    std::atomic<uint32_t> nextSite;
+    std::atomic<uint64_t> lastSync;
+
+    Trace() : hdr(NULL), defines(NULL), ring(NULL), nextSite(1), lastSync(0)
+    {
+        const char *path = getenv("SCD_TRACE");
+        if (!path || !*path)
+            return;
+        const char *mb = getenv("SCD_TRACE_MB");
+        uint64_t capacity = (mb ? atoll(mb) : TRACE_DEFAULT_MB) << 20;
+        capacity -= capacity % TRACE_CHUNK_SIZE;
+        if (!capacity)
+            return;
+
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1)
+            return;
+        size_t size = sizeof(TraceFileHeader) + TRACE_DEFINE_SIZE + capacity;
+        void *map = MAP_FAILED;
+        if (ftruncate(fd, size) == 0)
+            map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+            return;
+
+        hdr = static_cast<TraceFileHeader *>(map);
+        hdr->magic = TRACE_MAGIC;
+        hdr->version = TRACE_VERSION;
+#ifdef TRACE_HAVE_TSC
+        hdr->clock = TRACE_CLOCK_TSC;
+#else
+        hdr->clock = TRACE_CLOCK_MONOTONIC;
+#endif
+        hdr->chunkSize = TRACE_CHUNK_SIZE;
+        hdr->defineCapacity = TRACE_DEFINE_SIZE;
+        hdr->capacity = capacity;
+        hdr->defineTail = 0;
+        hdr->tail = 0;
+        hdr->dropped = 0;
+        defines = reinterpret_cast<char *>(hdr + 1);
+        ring = defines + TRACE_DEFINE_SIZE;
+        sync();
+    }
+
+    static uint32_t threadId()
+    {
+        static thread_local uint32_t tid = syscall(SYS_gettid);
+        return tid;
+    }
+
+    static uint32_t recordSize(size_t len)
+    {
+        return (sizeof(TraceRecord) + len + 7) & ~7U;
+    }
+
+    /* Reserves a definition with len bytes behind its record header. */
+    TraceRecord *reserveDefine(size_t len)
+    {
+        uint32_t size = recordSize(len);
+        uint64_t offset = hdr->defineTail.fetch_add(size,
+                                                    std::memory_order_relaxed);
+        if (offset + size > hdr->defineCapacity) {
+            hdr->dropped.fetch_add(1, std::memory_order_relaxed);
+            return NULL;
+        }
+        TraceRecord *rec = reinterpret_cast<TraceRecord *>(defines + offset);
+        rec->size = size;
+        return rec;
+    }
+
+    /* Reserves a record with len bytes behind its header in the ring. A
+     * record which does not fit in the rest of a chunk goes to the next one,
+     * and the first record of a chunk comes with the sync record in front.
+     */
+    TraceRecord *reserve(size_t len)
+    {
+        const uint64_t chunk = TRACE_CHUNK_SIZE;
+        uint32_t size = recordSize(len);
+        uint32_t syncSize = recordSize(sizeof(TraceSync));
+        if (size > chunk - syncSize) {
+            hdr->dropped.fetch_add(1, std::memory_order_relaxed);
+            return NULL;
+        }
+
+        uint64_t pos = hdr->tail.load(std::memory_order_relaxed);
+        uint64_t start, end;
+        do {
+            start = pos;
+            if (start % chunk + size > chunk)
+                start += chunk - start % chunk;
+            end = start + size;
+            if (start % chunk == 0)
+                end += syncSize;
+        } while (!hdr->tail.compare_exchange_weak(pos, end,
+                                                  std::memory_order_relaxed));
+
+        if (start - pos >= sizeof(TraceRecord))
+            ringRecord(pos, start - pos)->site.store(TRACE_SITE_PAD,
+                                                     std::memory_order_release);
+        if (start % chunk == 0) {
+            fillSync(ringRecord(start, syncSize));
+            start += syncSize;
+        }
+        return ringRecord(start, size);
+    }
+
+    /* The record at pos in the ring, marked unfinished until its site is
+     * stored, as it may still hold one which was overwritten.
+     */
+    TraceRecord *ringRecord(uint64_t pos, uint32_t size)
+    {
+        TraceRecord *rec = reinterpret_cast<TraceRecord *>(
+                               ring + pos % hdr->capacity);
+        rec->site.store(TRACE_SITE_NONE, std::memory_order_relaxed);
+        rec->size = size;
+        return rec;
+    }
+
+    /* Pairs the tick count with the wall clock. tracedecode interpolates
+     * between these to convert ticks.
+     */
+    void sync()
+    {
+        TraceRecord *rec = reserve(sizeof(TraceSync));
+        if (rec)
+            fillSync(rec);
+    }
+
+    void fillSync(TraceRecord *rec)
+    {
+        struct timespec ts;
+        rec->ticks = traceTicks();
+        clock_gettime(CLOCK_REALTIME, &ts);
+        lastSync.store(rec->ticks, std::memory_order_relaxed);
+        rec->thread = threadId();
+        rec->argc = 0;
+        TraceSync sync;
+        sync.realtime = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        memcpy(reinterpret_cast<char *>(rec + 1), &sync, sizeof sync);
+        rec->site.store(TRACE_SITE_SYNC, std::memory_order_release);
+    }
+
+    Trace(const Trace&);
+    Trace& operator =(const Trace&);
+};
+
+#endif
@@ -26,8 +26,17 @@
 #include <linux/ioctl.h>
 #include <linux/slab.h>		/* For memory usage (kmalloc). */
 #include <linux/sched.h>	/* For event waiting. */
+#include <linux/sched/signal.h>
+#include <linux/sched/clock.h>	/* For busy-polling. */
+#include <linux/ktime.h>
 #include <linux/cdev.h>		/* For Charater device handling. */
 #include <linux/semaphore.h>
+#include <linux/version.h>
+#include <linux/mm.h>		/* For pinning user pages. */
+#include <linux/highmem.h>
+#include <linux/file.h>		/* For spill files and files sent. */
+#include <linux/shrinker.h>	/* For freeing idle buffers. */
+#include <linux/magic.h>	/* For files which can not be sent. */
 
 #include "scd.h"		/* Local definitions. */
 
@@ -35,17 +44,57 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Nemanja Hirsl");
 MODULE_DESCRIPTION("Simple Exchange Driver");
 
-/* Structure which represents our device. */
-struct scd_device {
-	wait_queue_head_t in_queue, out_queue;	/* read and write queues */
+/* User pages lent by a writer with SCD_IOGIFT, read in place. */
+struct scd_pages {
+	struct page **pages;	/* pinned pages */
+	int npages;
+	size_t offset;		/* of the data in the first page */
+	size_t len, done;	/* bytes lent, bytes read */
+};
+
+/* A file sent with SCD_IOSENDFD, at a position of the stream of a lane. */
+struct scd_ref {
+	struct file *file;
+	u64 pos;		/* bytes of the lane before it */
+	u64 offset, len;	/* passed on to the reader */
+};
+
+/* Circular buffer. Each lane of a device has one. */
+struct scd_ring {
 	char *begin, *end;	/* begin of buffer, end of buffer */
 	char *read, *write;	/* where to read, where to write */
 	int buffersize;		/* size of the buffer */
+	struct scd_pages *gift;	/* read after the buffer, blocks writes */
+	struct file *spill;	/* overflow, read after the buffer */
+	loff_t spill_read, spill_write;	/* where to read, where to write */
+	loff_t spill_limit;	/* most bytes in the file, 0 no limit */
+	int spill_mark;		/* bytes in the buffer before spilling */
+	u64 spilled;		/* bytes spilled since set */
+	u64 in, out;		/* bytes written to and read from the lane */
+	struct scd_ref refs[SCD_FD_MAX];	/* files sent, in a circle */
+	int ref_head, nrefs;	/* first file, number of files */
+};
+
+/* Structure which represents our device. */
+struct scd_device {
+	wait_queue_head_t in_queue, out_queue;	/* read and write queues */
+	struct scd_ring lanes[SCD_LANES];	/* lane 0 is read first */
 	int nreaders, nwriters;	/* number of openings for read and write */
+	int nbusy;		/* number of busy-polling openings */
+	unsigned long reclaimed;	/* buffers freed under memory pressure */
+	u64 last_write;		/* time of the last write, ns */
+	s64 write_gap;		/* average time between writes, ns */
 	struct semaphore sem;	/* mutual exclusion semaphore */
 	struct cdev cdev;	/* char device structure */
 };
 
+/* Structure which represents an opening of the device. */
+struct scd_file {
+	struct scd_device *dev;
+	int lane;		/* lane to use or SCD_LANE_ALL */
+	int busy;		/* busy-poll budget in us, 0 to sleep at once */
+};
+
 /* SCD specific globals. */
 static struct scd_device *scd_devices;
 static int scd_major = SCD_MAJOR;
@@ -55,12 +104,45 @@ static int scd_buff_sz = SCD_BUFFER_SIZE;
 
 /* Forward declarations of helper functions. */
 static void scd_setup_cdev(struct scd_device *dev, int next);
-static int freespace(const struct scd_device *dev);
+static int freespace(const struct scd_ring *ring);
+static int scd_readable(const struct scd_ring *ring);
+static int scd_writable(const struct scd_ring *ring);
+static int scd_used(const struct scd_ring *ring);
+static int scd_spill_mark(const struct scd_ring *ring);
+static int scd_spilling(const struct scd_ring *ring);
+static ssize_t scd_read_spill(struct scd_ring *ring, char __user * buf,
+			      size_t count);
+static ssize_t scd_write_spill(struct scd_ring *ring, const char __user * buf,
+			       size_t count);
+static void scd_set_spill(struct scd_ring *ring, struct file *spill,
+			  const struct scd_spill *req);
+static long scd_ioctl_spill(struct scd_ring *ring,
+			    struct scd_spill __user * arg);
+static long scd_get_stats(struct scd_device *dev,
+			  struct scd_stats __user * arg);
+static long scd_send_fd(struct file *filp, struct scd_fd __user * arg);
+static long scd_recv_fd(struct scd_device *dev, struct scd_file *file,
+			struct scd_fd __user * arg);
+static int scd_can_send(const struct scd_ring *ring);
+static struct scd_ref *scd_next_ref(struct scd_ring *ring);
+static void scd_drop_refs(struct scd_ring *ring);
+static long scd_gift(struct file *filp, struct scd_gift __user * arg);
+static ssize_t scd_read_gift(struct scd_ring *ring, char __user * buf,
+			     size_t count);
+static struct scd_ring *scd_read_lane(struct scd_device *dev, int lane);
+static struct scd_ring *scd_write_lane(struct scd_device *dev, int lane);
+static void scd_free_lanes(struct scd_device *dev);
+static int scd_alloc_ring(struct scd_ring *ring);
+static void scd_free_ring(struct scd_ring *ring);
+static int scd_register_shrinker(void);
+static void scd_unregister_shrinker(void);
+static void scd_note_write(struct scd_device *dev);
+static int scd_busy_poll(struct scd_device *dev, struct scd_file *file);
 
 /* Module parameters assignable at load time. */
 module_param(scd_major, int, S_IRUGO);
 module_param(scd_minor, int, S_IRUGO);
-/*module_param(scd_dev_n, int, S_IRUGO);  TODO. For now, keep it 1 by default. */
+module_param(scd_dev_n, int, S_IRUGO);
 
 /* Initialization and deinitialization. */
 static int __init scd_init_module(void)
@@ -68,8 +150,14 @@ static int __init scd_init_module(void)
 	int err, i;
 	dev_t dev = 0;
 
-	printk(KERN_DEBUG "scd_init_module. Major: %d, minor: %d\n", scd_major,
-	       scd_minor);
+	printk(KERN_DEBUG "scd_init_module. Major: %d, minor: %d, devices: %d\n",
+	       scd_major, scd_minor, scd_dev_n);
+
+	if (scd_dev_n < 1) {
+		printk(KERN_WARNING "scd_init_module: invalid number of devices: %d\n",
+		       scd_dev_n);
+		return -EINVAL;
+	}
 
 	/* Create dynamic major unless set differnetly at load time. */
 	if (scd_major) {
@@ -106,6 +194,12 @@ static int __init scd_init_module(void)
 		scd_setup_cdev(scd_devices + i, i);
 	}
 
+	/* Without a shrinker idle buffers are kept, which is not fatal. */
+	err = scd_register_shrinker();
+	if (err)
+		printk(KERN_WARNING
+		       "scd_init_module: error registering shrinker: %d\n", err);
+
 	return 0;
 }
 
@@ -123,10 +217,12 @@ static void __exit scd_exit_module(void)
 		return;
 	}
 
+	scd_unregister_shrinker();
+
 	/* Deallocate memory dor each device. */
 	for (i = 0; i < scd_dev_n; ++i) {
 		cdev_del(&scd_devices[i].cdev);
-		kfree(scd_devices[i].begin);
+		scd_free_lanes(scd_devices + i);
 	}
 	kfree(scd_devices);
 	scd_devices = NULL;
@@ -143,58 +239,74 @@ module_exit(scd_exit_module);
 static int scd_open(struct inode *inode, struct file *filp)
 {
 	struct scd_device *dev;
+	struct scd_file *file;
+	struct scd_ring *ring;
+	int i;
 
-	/* Find and save device data (scd_device) for future use. */
+	/* Find device data (scd_device) and save it with the state of this
+	 * opening for future use.
+	 */
 	dev = container_of(inode->i_cdev, struct scd_device, cdev);
-	filp->private_data = dev;
+	file = kmalloc(sizeof(struct scd_file), GFP_KERNEL);
+	if (!file)
+		return -ENOMEM;
+	file->dev = dev;
+	file->lane = SCD_LANE_ALL;
+	file->busy = 0;
+	filp->private_data = file;
 
-	if (down_interruptible(&dev->sem))
+	if (down_interruptible(&dev->sem)) {
+		kfree(file);
 		return -ERESTARTSYS;
-
-	/* Allocate memory for buffer. */
-	if (!dev->begin) {
-		dev->begin = kmalloc(scd_buff_sz, GFP_KERNEL);
-		if (!dev->begin) {
-			printk(KERN_WARNING
-			       "scd_open. Can't allocate memory for buffer.\n");
-			up(&dev->sem);
-			return -ENOMEM;
-		}
 	}
 
-	/* Set values for scd_device. */
-	dev->buffersize = scd_buff_sz;
-	dev->end = dev->begin + dev->buffersize;
-	dev->read = dev->write = dev->begin;
+	/* Reset each lane. Buffers are allocated by the first write, see
+	 * scd_alloc_ring; one of another size than scd_buff_sz goes now.
+	 */
+	for (i = 0; i < SCD_LANES; ++i) {
+		ring = &dev->lanes[i];
+		if (ring->begin && ring->buffersize != scd_buff_sz)
+			scd_free_ring(ring);
+		ring->buffersize = scd_buff_sz;
+		ring->read = ring->write = ring->begin;
+		ring->spill_read = ring->spill_write = 0;
+		ring->in = ring->out = 0;
+		scd_drop_refs(ring);
+		/* Lent pages go with the stream, their writer is woken. */
+		ring->gift = NULL;
+	}
 	if (filp->f_mode & FMODE_READ)
 		++dev->nreaders;
 	if (filp->f_mode & FMODE_WRITE)
 		++dev->nwriters;
 
 	up(&dev->sem);
+	wake_up_interruptible(&dev->out_queue);
 
 	return nonseekable_open(inode, filp);
 }
 
 static int scd_release(struct inode *inode, struct file *filp)
 {
-	struct scd_device *dev = filp->private_data;
+	struct scd_file *file = filp->private_data;
+	struct scd_device *dev = file->dev;
 
-	if (down_interruptible(&dev->sem))
-		return -ERESTARTSYS;
+	/* Release can not be restarted, the opening would stay counted. */
+	down(&dev->sem);
 
 	/* Free allocated space on release. */
 	if (filp->f_mode & FMODE_READ)
 		--dev->nreaders;
 	if (filp->f_mode & FMODE_WRITE)
 		--dev->nwriters;
-	if (dev->nreaders == 0 && dev->nwriters == 0) {
-		kfree(dev->begin);
-		dev->begin = NULL;
-	}
+	if (file->busy)
+		--dev->nbusy;
+	if (dev->nreaders == 0 && dev->nwriters == 0)
+		scd_free_lanes(dev);
 
 	up(&dev->sem);
 
+	kfree(file);
 	return 0;
 }
 
@@ -202,7 +314,10 @@ static int scd_release(struct inode *inode, struct file *filp)
 static ssize_t scd_read(struct file *filp, char __user * buf, size_t count,
 			loff_t * f_pos)
 {
-	struct scd_device *dev = filp->private_data;
+	struct scd_file *file = filp->private_data;
+	struct scd_device *dev = file->dev;
+	struct scd_ring *ring;
+	struct scd_ref *ref;
 
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
@@ -210,35 +325,65 @@ static ssize_t scd_read(struct file *filp, char __user * buf, size_t count,
 	/* If there is nothing to read release mutex and handle non-blocking case.
 	 * For blocking case: Block (wait) for data to become available for read and
 	 * obtain semaphore before checking condition again.
+	 * A read returns data of one lane only, from the first lane which has any.
+	 * A busy-polling opening spins for a while first, see scd_busy_poll.
 	 */
-	while (dev->read == dev->write) {
+	while (!(ring = scd_read_lane(dev, file->lane))) {
 		printk(KERN_DEBUG "scd_read. Nothing to read.\n");
 		up(&dev->sem);
 		if (filp->f_flags & O_NONBLOCK)
 			return -EAGAIN;
-		if (wait_event_interruptible
-		    (dev->in_queue, (dev->read != dev->write)))
+		if (!scd_busy_poll(dev, file) &&
+		    wait_event_interruptible(dev->in_queue,
+					     scd_read_lane(dev, file->lane)))
 			return -ERESTARTSYS;
 		if (down_interruptible(&dev->sem))
 			return -ERESTARTSYS;
 	}
 
+	/* A file sent ends the data before it. Once that was read, reads fail
+	 * until the file is taken with SCD_IORECVFD.
+	 */
+	ref = scd_next_ref(ring);
+	if (ref) {
+		if (ref->pos == ring->out) {
+			up(&dev->sem);
+			return -ENOMSG;
+		}
+		count = min_t(u64, count, ref->pos - ring->out);
+	}
+
+	/* Spilled data follows the buffer. Lent pages are only queued on an
+	 * empty lane, so they come next otherwise.
+	 */
+	if (ring->read == ring->write) {
+		ssize_t ret = ring->gift ? scd_read_gift(ring, buf, count) :
+		    scd_read_spill(ring, buf, count);
+
+		if (ret > 0)
+			ring->out += ret;
+		up(&dev->sem);
+		wake_up_interruptible(&dev->out_queue);
+		return ret;
+	}
+
 	/* There is data available to read and we hold mutex. */
-	if (dev->write > dev->read)	/* Write ahead of read. We can read at most up to write pointer. */
-		count = min(count, (size_t) (dev->write - dev->read));
+	if (ring->write > ring->read)	/* Write ahead of read. We can read at most up to write pointer. */
+		count = min(count, (size_t) (ring->write - ring->read));
 	else			/* Write has wrapped. Return data up to the end of buffer. */
-		count = min(count, (size_t) (dev->end - dev->read));
+		count = min(count, (size_t) (ring->end - ring->read));
 
 	/* Copy data to user space. */
-	if (copy_to_user(buf, dev->read, count)) {	/* Returns number of bytes that could not be copied. On success, zero. */
+	if (copy_to_user(buf, ring->read, count)) {	/* Returns number of bytes that could not be copied. On success, zero. */
 		up(&dev->sem);
 		return -EFAULT;
 	}
 
 	/* Adjust read pointer to reflect read data. */
-	dev->read += count;
-	if (dev->read == dev->end)
-		dev->read = dev->begin;
+	ring->read += count;
+	if (ring->read == ring->end)
+		ring->read = ring->begin;
+	ring->out += count;
 
 	up(&dev->sem);
 
@@ -250,7 +395,9 @@ static ssize_t scd_read(struct file *filp, char __user * buf, size_t count,
 static ssize_t scd_write(struct file *filp, const char __user * buf,
 			 size_t count, loff_t * f_pos)
 {
-	struct scd_device *dev = filp->private_data;
+	struct scd_file *file = filp->private_data;
+	struct scd_device *dev = file->dev;
+	struct scd_ring *ring = scd_write_lane(dev, file->lane);
 
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
@@ -259,38 +406,64 @@ static ssize_t scd_write(struct file *filp, const char __user * buf,
 	 * For blocking case: Block (wait) for free space to become available and
 	 * obtain semaphore before checking condition again.
 	 * The buffer is full if Write is just behind of Read.
+	 * Lent pages which were not read yet come first, so block behind them too.
 	 */
-	while (!freespace(dev)) {
+	while (!scd_writable(ring)) {
 		printk(KERN_DEBUG
 		       "scd_write. No freespace available for writting.\n");
 		up(&dev->sem);
 		if (filp->f_flags & O_NONBLOCK)
 			return -EAGAIN;
-		if (wait_event_interruptible(dev->out_queue, freespace(dev)))
+		if (wait_event_interruptible(dev->out_queue, scd_writable(ring)))
 			return -ERESTARTSYS;
 		if (down_interruptible(&dev->sem))
 			return -ERESTARTSYS;
 	}
 
-	/* There is space available for writting. */
-	if (dev->write >= dev->read) {	/* Write is ahead of read. */
-		if (dev->read == dev->begin)	/* If Read is at the beggining, do not wrap write pointer. */
+	/* Past the watermark, or behind spilled data, go to the spill file. */
+	if (scd_spilling(ring)) {
+		ssize_t ret = scd_write_spill(ring, buf, count);
+
+		if (ret > 0)
+			ring->in += ret;
+		if (ret > 0 && dev->nbusy)
+			scd_note_write(dev);
+		up(&dev->sem);
+		wake_up_interruptible(&dev->in_queue);
+		return ret;
+	}
+
+	/* There is space available for writting, in a buffer freed while idle
+	 * possibly.
+	 */
+	if (scd_alloc_ring(ring)) {
+		up(&dev->sem);
+		return -ENOMEM;
+	}
+	if (ring->write >= ring->read) {	/* Write is ahead of read. */
+		if (ring->read == ring->begin)	/* If Read is at the beggining, do not wrap write pointer. */
 			count =
-			    min(count, (size_t) (dev->end - dev->write - 1));
+			    min(count, (size_t) (ring->end - ring->write - 1));
 		else		/* Write to the end of buffer (and wrap). */
-			count = min(count, (size_t) (dev->end - dev->write));
+			count = min(count, (size_t) (ring->end - ring->write));
 	} else			/* Write has wrapped. Write up to the read pointer (-1). */
-		count = min(count, (size_t) (dev->read - dev->write - 1));
+		count = min(count, (size_t) (ring->read - ring->write - 1));
+	if (ring->spill)	/* With a spill file, fill only up to the watermark. */
+		count = min(count,
+			    (size_t) (scd_spill_mark(ring) - scd_used(ring)));
 
-	if (copy_from_user(dev->write, buf, count)) {	/* Returns number of bytes that could not be copied. On success, zero. */
+	if (copy_from_user(ring->write, buf, count)) {	/* Returns number of bytes that could not be copied. On success, zero. */
 		up(&dev->sem);
 		return -EFAULT;
 	}
 
 	/* Adjust write pointer to reflect written data. */
-	dev->write += count;
-	if (dev->write == dev->end)
-		dev->write = dev->begin;
+	ring->write += count;
+	if (ring->write == ring->end)
+		ring->write = ring->begin;
+	ring->in += count;
+	if (dev->nbusy)
+		scd_note_write(dev);
 	up(&dev->sem);
 
 	/* Wake up any readers. */
@@ -301,9 +474,18 @@ static ssize_t scd_write(struct file *filp, const char __user * buf,
 /* Poll and Ioctl. */
 static unsigned int scd_poll(struct file *filp, poll_table * wait)
 {
-	struct scd_device *dev = filp->private_data;
+	struct scd_file *file = filp->private_data;
+	struct scd_device *dev = file->dev;
+	struct scd_ring *ring;
+	struct scd_ref *ref;
 	unsigned int mask = 0;
 
+	/* Spin before the caller would sleep. Once an earlier descriptor of
+	 * the same poll is ready, it no longer waits and nothing spins.
+	 */
+	if (!poll_does_not_wait(wait) && (poll_requested_events(wait) & POLLIN))
+		scd_busy_poll(dev, file);
+
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
 
@@ -313,11 +495,21 @@ static unsigned int scd_poll(struct file *filp, poll_table * wait)
 
 	/* Set mask to reflect inner state: 
 	 * if there is anything to read or space available for writting. 
+	 * POLLPRI and POLLWRBAND report the same for the high lane, POLLMSG
+	 * a file sent which is next to read.
 	 */
-	if (dev->read != dev->write)
+	ring = scd_read_lane(dev, file->lane);
+	if (ring)
 		mask |= POLLIN | POLLRDNORM;
-	if (freespace(dev))
+	ref = ring ? scd_next_ref(ring) : NULL;
+	if (ref && ref->pos == ring->out)
+		mask |= POLLMSG;
+	if (ring == &dev->lanes[SCD_LANE_HIGH])
+		mask |= POLLPRI;
+	if (scd_writable(scd_write_lane(dev, file->lane)))
 		mask |= POLLOUT | POLLWRNORM;
+	if (scd_writable(&dev->lanes[SCD_LANE_HIGH]))
+		mask |= POLLWRBAND;
 
 	up(&dev->sem);
 	return mask;
@@ -326,8 +518,9 @@ static unsigned int scd_poll(struct file *filp, poll_table * wait)
 static long scd_unlocked_ioctl(struct file *filp, unsigned int cmd,
 			       unsigned long arg)
 {
-	struct scd_device *dev = filp->private_data;
-	int err = 0;
+	struct scd_file *file = filp->private_data;
+	struct scd_device *dev = file->dev;
+	int err = 0, lane, busy;
 
 	/* Don't act on wrong cmds. 
 	 * Return EINVAL (invalid argument). May return ENOTTY (inappropriate ioctl) instead.
@@ -337,6 +530,13 @@ static long scd_unlocked_ioctl(struct file *filp, unsigned int cmd,
 	if (_IOC_NR(cmd) > SCD_IOMAX)
 		return -EINVAL;
 
+	/* Gifts wait for readers, without holding the semaphore. */
+	if (cmd == SCD_IOGIFT)
+		return scd_gift(filp, (struct scd_gift __user *)arg);
+	/* Sent files wait for room like writes. */
+	if (cmd == SCD_IOSENDFD)
+		return scd_send_fd(filp, (struct scd_fd __user *)arg);
+
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
 
@@ -365,12 +565,209 @@ static long scd_unlocked_ioctl(struct file *filp, unsigned int cmd,
 			       "scd_unlocked_ioctl. Error %d on get_user\n",
 			       err);
 		break;
+		/* Set lane of this opening. */
+	case SCD_IOSLANE:
+		if ((err = get_user(lane, (int __user *)arg)) != 0)
+			printk(KERN_WARNING
+			       "scd_unlocked_ioctl. Error %d on get_user\n",
+			       err);
+		else if (lane != SCD_LANE_ALL && (lane < 0 || lane >= SCD_LANES))
+			err = -EINVAL;
+		else
+			file->lane = lane;
+		break;
+		/* Get lane of this opening. */
+	case SCD_IOGLANE:
+		if ((err = put_user(file->lane, (int __user *)arg)) != 0)
+			printk(KERN_WARNING
+			       "scd_unlocked_ioctl. Error %d on put_user\n",
+			       err);
+		break;
+		/* Set busy-poll budget of this opening. */
+	case SCD_IOSBUSY:
+		if ((err = get_user(busy, (int __user *)arg)) != 0)
+			printk(KERN_WARNING
+			       "scd_unlocked_ioctl. Error %d on get_user\n",
+			       err);
+		else if (busy < 0 || busy > SCD_BUSY_MAX)
+			err = -EINVAL;
+		else {
+			/* Start timing writes afresh for the first one. */
+			if (busy && !file->busy && !dev->nbusy++)
+				dev->last_write = dev->write_gap = 0;
+			if (!busy && file->busy)
+				--dev->nbusy;
+			file->busy = busy;
+		}
+		break;
+		/* Get busy-poll budget of this opening. */
+	case SCD_IOGBUSY:
+		if ((err = put_user(file->busy, (int __user *)arg)) != 0)
+			printk(KERN_WARNING
+			       "scd_unlocked_ioctl. Error %d on put_user\n",
+			       err);
+		break;
+		/* Set spill file of the write lane of this opening. */
+	case SCD_IOSSPILL:
+		err = scd_ioctl_spill(scd_write_lane(dev, file->lane),
+				      (struct scd_spill __user *)arg);
+		if (!err)
+			wake_up_interruptible(&dev->out_queue);
+		break;
+		/* Get memory and occupancy of each lane. */
+	case SCD_IOGSTATS:
+		err = scd_get_stats(dev, (struct scd_stats __user *)arg);
+		break;
+		/* Take the file sent which is next to read. */
+	case SCD_IORECVFD:
+		if (!(filp->f_mode & FMODE_READ))
+			err = -EBADF;
+		else
+			err = scd_recv_fd(dev, file,
+					  (struct scd_fd __user *)arg);
+		if (!err)
+			wake_up_interruptible(&dev->out_queue);
+		break;
 	}
 
 	up(&dev->sem);
 	return err;
 }
 
+/* Page gifting. Instead of copying a large write into the buffer, the
+ * writer's pages are pinned and queued behind the data in the buffer, and
+ * readers copy straight from them. This saves one copy of every byte. The
+ * call returns once everything was read, so the writer may reuse its memory
+ * afterwards. O_NONBLOCK only applies to waiting for the lane to drain.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+static long scd_gift(struct file *filp, struct scd_gift __user * arg)
+{
+	struct scd_file *file = filp->private_data;
+	struct scd_device *dev = file->dev;
+	struct scd_ring *ring = scd_write_lane(dev, file->lane);
+	struct scd_gift req;
+	struct scd_pages gift;
+	unsigned long addr;
+	long ret;
+	int pinned;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+	if (!req.len)
+		return 0;
+	addr = req.addr;
+	gift.len = min_t(unsigned long long, req.len, SCD_GIFT_MAX);
+	gift.done = 0;
+	gift.offset = offset_in_page(addr);
+	gift.npages = DIV_ROUND_UP(gift.offset + gift.len, PAGE_SIZE);
+	gift.pages = kvmalloc_array(gift.npages, sizeof(struct page *),
+				    GFP_KERNEL);
+	if (!gift.pages)
+		return -ENOMEM;
+
+	/* Readers only read the pages. */
+	pinned = pin_user_pages_fast(addr & PAGE_MASK, gift.npages, 0,
+				     gift.pages);
+	if (pinned != gift.npages) {
+		if (pinned > 0)
+			unpin_user_pages(gift.pages, pinned);
+		kvfree(gift.pages);
+		return pinned < 0 ? pinned : -EFAULT;
+	}
+
+	/* Queue the pages once earlier data has been read. */
+	if (down_interruptible(&dev->sem)) {
+		ret = -ERESTARTSYS;
+		goto out;
+	}
+	while (scd_readable(ring)) {
+		up(&dev->sem);
+		if (filp->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto out;
+		}
+		if (wait_event_interruptible
+		    (dev->out_queue, !scd_readable(ring))) {
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+		if (down_interruptible(&dev->sem)) {
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+	}
+	ring->gift = &gift;
+	ring->in += gift.len;
+	if (dev->nbusy)
+		scd_note_write(dev);
+	up(&dev->sem);
+	wake_up_interruptible(&dev->in_queue);
+
+	/* The last reader dequeues the pages, or an open drops them with the
+	 * rest of the stream. If a signal comes first, take them back. Either
+	 * way, report what was read so far.
+	 */
+	wait_event_interruptible(dev->out_queue, READ_ONCE(ring->gift) != &gift);
+	down(&dev->sem);
+	if (ring->gift == &gift) {
+		ring->gift = NULL;
+		ring->in -= gift.len - gift.done;
+		ret = -ERESTARTSYS;
+	} else {
+		ret = -EPIPE;
+	}
+	if (gift.done)
+		ret = gift.done;
+	up(&dev->sem);
+	wake_up_interruptible(&dev->out_queue);
+
+out:
+	unpin_user_pages(gift.pages, gift.npages);
+	kvfree(gift.pages);
+	return ret;
+}
+
+/* Copies lent pages to a reader. Called with the semaphore held. */
+static ssize_t scd_read_gift(struct scd_ring *ring, char __user * buf,
+			     size_t count)
+{
+	struct scd_pages *gift = ring->gift;
+	size_t pos, off, n, copied = 0;
+	unsigned long left;
+	char *src;
+
+	count = min(count, gift->len - gift->done);
+	while (copied < count) {
+		pos = gift->offset + gift->done;
+		off = offset_in_page(pos);
+		n = min(count - copied, (size_t) PAGE_SIZE - off);
+		src = kmap_local_page(gift->pages[pos >> PAGE_SHIFT]);
+		left = copy_to_user(buf + copied, src + off, n);
+		kunmap_local(src);
+		gift->done += n - left;
+		copied += n - left;
+		if (left)
+			break;
+	}
+
+	if (gift->done == gift->len)
+		ring->gift = NULL;
+	return copied ? copied : -EFAULT;
+}
+#else
+static long scd_gift(struct file *filp, struct scd_gift __user * arg)
+{
+	return -ENOTTY;
+}
+
+static ssize_t scd_read_gift(struct scd_ring *ring, char __user * buf,
+			     size_t count)
+{
+	return -EFAULT;
+}
+#endif
+
 /* The file operations for the device. */
 static struct file_operations scd_pipe_fops = {
 	.owner = THIS_MODULE,
@@ -380,9 +777,138 @@ static struct file_operations scd_pipe_fops = {
 	.unlocked_ioctl = scd_unlocked_ioctl,
 	.open = scd_open,
 	.release = scd_release,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 0)
 	.llseek = no_llseek,
+#endif
 };
 
+/* Sockets carry descriptors in flight, epoll and io_uring instances keep
+ * the files they watch or use. Queued on a lane, such a file could hold
+ * the device open in turn, and the lane and the file would keep each other
+ * alive for good. The last two are told by the name of their anon inode.
+ */
+static bool scd_holds_files(struct file *file)
+{
+	struct inode *inode = file_inode(file);
+	const char *name = (const char *)file->f_path.dentry->d_name.name;
+
+	if (S_ISSOCK(inode->i_mode))
+		return true;
+	if (inode->i_sb->s_magic != ANON_INODE_FS_MAGIC)
+		return false;
+	return !strcmp(name, "[eventpoll]") || !strcmp(name, "[io_uring]");
+}
+
+/* File passing. Instead of its bytes, a writer queues a reference to an
+ * open file on the write lane, and the reader which gets to it receives a
+ * descriptor of the very same file. This takes the same time and memory
+ * whatever the size of the blob. A memfd sealed by the writer stays
+ * sealed, the reader checks the seals with F_GET_SEALS. Openings of the
+ * device can not be sent: a lane holding its own device open would never
+ * be released. Neither can files which hold other files, see
+ * scd_holds_files.
+ */
+static long scd_send_fd(struct file *filp, struct scd_fd __user * arg)
+{
+	struct scd_file *file = filp->private_data;
+	struct scd_device *dev = file->dev;
+	struct scd_ring *ring = scd_write_lane(dev, file->lane);
+	struct scd_fd req;
+	struct scd_ref *ref;
+	struct file *sent;
+	long ret;
+
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+	if (req.offset + req.len < req.offset)
+		return -EINVAL;
+	sent = fget(req.fd);
+	if (!sent)
+		return -EBADF;
+	if (sent->f_op == &scd_pipe_fops || scd_holds_files(sent)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* Wait behind lent pages and for room among the files queued. */
+	if (down_interruptible(&dev->sem)) {
+		ret = -ERESTARTSYS;
+		goto out;
+	}
+	while (!scd_can_send(ring)) {
+		up(&dev->sem);
+		if (filp->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto out;
+		}
+		if (wait_event_interruptible
+		    (dev->out_queue, scd_can_send(ring))) {
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+		if (down_interruptible(&dev->sem)) {
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+	}
+
+	/* The lane takes over the reference to the file. */
+	ref = &ring->refs[(ring->ref_head + ring->nrefs) % SCD_FD_MAX];
+	ref->file = sent;
+	ref->pos = ring->in;
+	ref->offset = req.offset;
+	ref->len = req.len;
+	++ring->nrefs;
+	if (dev->nbusy)
+		scd_note_write(dev);
+	up(&dev->sem);
+	wake_up_interruptible(&dev->in_queue);
+	return 0;
+
+out:
+	fput(sent);
+	return ret;
+}
+
+/* Installs the file sent which is next to read as a new descriptor of the
+ * reader. Should be called with decremented semaphore.
+ */
+static long scd_recv_fd(struct scd_device *dev, struct scd_file *file,
+			struct scd_fd __user * arg)
+{
+	struct scd_ring *ring = scd_read_lane(dev, file->lane);
+	struct scd_ref *ref = ring ? scd_next_ref(ring) : NULL;
+	struct scd_fd req;
+	int fd;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+	if (req.flags & ~O_CLOEXEC)
+		return -EINVAL;
+	/* Data comes first, or there is nothing at all. */
+	if (!ref || ref->pos != ring->out)
+		return -ENODATA;
+
+	fd = get_unused_fd_flags(req.flags);
+	if (fd < 0)
+		return fd;
+	req.fd = fd;
+	req.offset = ref->offset;
+	req.len = ref->len;
+	if (copy_to_user(arg, &req, sizeof(req))) {
+		put_unused_fd(fd);
+		return -EFAULT;
+	}
+	fd_install(fd, ref->file);
+
+	ref->file = NULL;
+	ring->ref_head = (ring->ref_head + 1) % SCD_FD_MAX;
+	--ring->nrefs;
+	return 0;
+}
+
 /* Helper functions. */
 /* Set up cdev entry. */
 static void scd_setup_cdev(struct scd_device *dev, int next)
@@ -399,7 +925,7 @@ static void scd_setup_cdev(struct scd_device *dev, int next)
 }
 
 /* Returns avail free space. Should be called with decremented semaphore. */
-static int freespace(const struct scd_device *dev)
+static int freespace(const struct scd_ring *ring)
 {
 	int space = 0;
 
@@ -409,12 +935,458 @@ static int freespace(const struct scd_device *dev)
 	 * 2. Read is ahead of Write. Available space is just up to the read pointer.
 	 * 3. Write is ahead of Read. Available space is everything except non read part.
 	 */
-	if (dev->read == dev->write)
-		space = dev->buffersize - 1;
-	else if (dev->read > dev->write)
-		space = dev->read - dev->write - 1;
-	else			/* dev->write > dev->read */
-		space = dev->buffersize - (dev->write - dev->read) - 1;
+	if (ring->read == ring->write)
+		space = ring->buffersize - 1;
+	else if (ring->read > ring->write)
+		space = ring->read - ring->write - 1;
+	else			/* ring->write > ring->read */
+		space = ring->buffersize - (ring->write - ring->read) - 1;
 
 	return space;
 }
+
+/* Returns whether there is data, spilled data, lent pages or a file sent
+ * to read.
+ */
+static int scd_readable(const struct scd_ring *ring)
+{
+	return ring->read != ring->write || ring->gift ||
+	    ring->spill_read != ring->spill_write || ring->nrefs;
+}
+
+/* Returns whether data can be written now, to the buffer or spilled. */
+static int scd_writable(const struct scd_ring *ring)
+{
+	if (ring->gift)
+		return 0;
+	if (scd_spilling(ring))
+		return !ring->spill_limit ||
+		    ring->spill_write - ring->spill_read < ring->spill_limit;
+	return freespace(ring);
+}
+
+/* Returns the number of bytes in the buffer. */
+static int scd_used(const struct scd_ring *ring)
+{
+	return ring->buffersize - 1 - freespace(ring);
+}
+
+/* Returns how many bytes the buffer holds before writes are spilled. */
+static int scd_spill_mark(const struct scd_ring *ring)
+{
+	int full = ring->buffersize - 1;
+
+	return ring->spill_mark ? min(ring->spill_mark, full) : full;
+}
+
+/* Returns whether writes go to the spill file: once the buffer reached the
+ * watermark, and for as long as spilled data is left to keep the order.
+ */
+static int scd_spilling(const struct scd_ring *ring)
+{
+	return ring->spill && (ring->spill_read != ring->spill_write ||
+			       scd_used(ring) >= scd_spill_mark(ring));
+}
+
+/* Returns the ring to read from next: the first lane with data, or the
+ * given lane if it has data. NULL if there is nothing to read.
+ */
+static struct scd_ring *scd_read_lane(struct scd_device *dev, int lane)
+{
+	int i;
+
+	if (lane != SCD_LANE_ALL)
+		return scd_readable(&dev->lanes[lane]) ? &dev->lanes[lane] : NULL;
+
+	for (i = 0; i < SCD_LANES; ++i)
+		if (scd_readable(&dev->lanes[i]))
+			return &dev->lanes[i];
+	return NULL;
+}
+
+/* Returns the ring written by an opening with the given lane. */
+static struct scd_ring *scd_write_lane(struct scd_device *dev, int lane)
+{
+	return &dev->lanes[lane == SCD_LANE_ALL ? SCD_LANE_BULK : lane];
+}
+
+/* Frees buffers of all lanes and drops their spill files and files sent. */
+static void scd_free_lanes(struct scd_device *dev)
+{
+	int i;
+
+	for (i = 0; i < SCD_LANES; ++i) {
+		scd_free_ring(&dev->lanes[i]);
+		scd_set_spill(&dev->lanes[i], NULL, NULL);
+		scd_drop_refs(&dev->lanes[i]);
+	}
+}
+
+/* Returns whether a file can be sent on a lane now. Like writes, it waits
+ * behind lent pages.
+ */
+static int scd_can_send(const struct scd_ring *ring)
+{
+	return !ring->gift && ring->nrefs < SCD_FD_MAX;
+}
+
+/* Returns the first file sent on a lane, NULL if there is none. */
+static struct scd_ref *scd_next_ref(struct scd_ring *ring)
+{
+	return ring->nrefs ? &ring->refs[ring->ref_head] : NULL;
+}
+
+/* Drops the files sent on a lane which were not taken. */
+static void scd_drop_refs(struct scd_ring *ring)
+{
+	struct scd_ref *ref;
+
+	while ((ref = scd_next_ref(ring))) {
+		fput(ref->file);
+		ref->file = NULL;
+		ring->ref_head = (ring->ref_head + 1) % SCD_FD_MAX;
+		--ring->nrefs;
+	}
+	ring->ref_head = 0;
+}
+
+/* Allocates the buffer of a lane if it has none. An empty lane may have
+ * none: from the open until the first write, and after the shrinker took
+ * it. Should be called with decremented semaphore.
+ */
+static int scd_alloc_ring(struct scd_ring *ring)
+{
+	if (ring->begin)
+		return 0;
+	ring->begin = kmalloc(ring->buffersize, GFP_KERNEL);
+	if (!ring->begin) {
+		printk(KERN_WARNING
+		       "scd_alloc_ring. Can't allocate memory for buffer.\n");
+		return -ENOMEM;
+	}
+	ring->end = ring->begin + ring->buffersize;
+	ring->read = ring->write = ring->begin;
+	return 0;
+}
+
+/* Frees the buffer of a lane, whatever it holds. */
+static void scd_free_ring(struct scd_ring *ring)
+{
+	kfree(ring->begin);
+	ring->begin = ring->end = ring->read = ring->write = NULL;
+}
+
+/* Returns whether the buffer of a lane can be freed: it has one and
+ * nothing is left in it. Lent pages and spilled data do not need it.
+ */
+static int scd_idle_ring(const struct scd_ring *ring)
+{
+	return ring->begin && ring->read == ring->write;
+}
+
+/* Returns the bytes of buffers a device holds. */
+static unsigned long scd_memory(const struct scd_device *dev)
+{
+	unsigned long bytes = 0;
+	int i;
+
+	for (i = 0; i < SCD_LANES; ++i)
+		if (dev->lanes[i].begin)
+			bytes += dev->lanes[i].buffersize;
+	return bytes;
+}
+
+/* Frees up to nr idle buffers of a device. Skips a device in use rather
+ * than waiting for it. Returns how many were freed.
+ */
+static unsigned long scd_reclaim(struct scd_device *dev, unsigned long nr)
+{
+	unsigned long freed = 0;
+	int i;
+
+	if (down_trylock(&dev->sem))
+		return 0;
+	for (i = 0; i < SCD_LANES && freed < nr; ++i) {
+		if (scd_idle_ring(&dev->lanes[i])) {
+			scd_free_ring(&dev->lanes[i]);
+			++freed;
+		}
+	}
+	dev->reclaimed += freed;
+	up(&dev->sem);
+	return freed;
+}
+
+/* Shrinker. Idle buffers are the objects; a buffer of the default size is
+ * eight pages, so they are worth freeing before page cache. They come back
+ * with the next write.
+ */
+static unsigned long scd_shrink_count(struct shrinker *shrink,
+				      struct shrink_control *sc)
+{
+	unsigned long count = 0;
+	int i, j;
+
+	/* Racy, which is good enough for an estimate. */
+	for (i = 0; i < scd_dev_n; ++i)
+		for (j = 0; j < SCD_LANES; ++j)
+			if (scd_idle_ring(&scd_devices[i].lanes[j]))
+				++count;
+	return count;
+}
+
+static unsigned long scd_shrink_scan(struct shrinker *shrink,
+				     struct shrink_control *sc)
+{
+	unsigned long freed = 0;
+	int i;
+
+	for (i = 0; i < scd_dev_n && freed < sc->nr_to_scan; ++i)
+		freed += scd_reclaim(&scd_devices[i], sc->nr_to_scan - freed);
+	return freed ? freed : SHRINK_STOP;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct shrinker *scd_shrinker;
+
+static int scd_register_shrinker(void)
+{
+	scd_shrinker = shrinker_alloc(0, "scd");
+	if (!scd_shrinker)
+		return -ENOMEM;
+	scd_shrinker->count_objects = scd_shrink_count;
+	scd_shrinker->scan_objects = scd_shrink_scan;
+	scd_shrinker->seeks = DEFAULT_SEEKS;
+	shrinker_register(scd_shrinker);
+	return 0;
+}
+
+static void scd_unregister_shrinker(void)
+{
+	if (scd_shrinker)
+		shrinker_free(scd_shrinker);
+	scd_shrinker = NULL;
+}
+#else
+static struct shrinker scd_shrinker = {
+	.count_objects = scd_shrink_count,
+	.scan_objects = scd_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+static int scd_shrinker_registered;
+
+static int scd_register_shrinker(void)
+{
+	int err;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	err = register_shrinker(&scd_shrinker, "scd");
+#else
+	err = register_shrinker(&scd_shrinker);
+#endif
+	scd_shrinker_registered = !err;
+	return err;
+}
+
+static void scd_unregister_shrinker(void)
+{
+	if (scd_shrinker_registered)
+		unregister_shrinker(&scd_shrinker);
+	scd_shrinker_registered = 0;
+}
+#endif
+
+/* Spilling. Data goes to the spill file through a bounce buffer, at most
+ * SCD_SPILL_CHUNK bytes per call. The file is written from offset 0 on and
+ * starts over once everything was read back, so it only grows while a
+ * reader lags behind.
+ */
+static ssize_t scd_write_spill(struct scd_ring *ring, const char __user * buf,
+			       size_t count)
+{
+	loff_t pos = ring->spill_write;
+	ssize_t ret;
+	char *bounce;
+
+	if (ring->spill_limit)
+		count = min_t(loff_t, count, ring->spill_limit -
+			      (ring->spill_write - ring->spill_read));
+	count = min_t(size_t, count, SCD_SPILL_CHUNK);
+	if (!count)
+		return 0;
+	bounce = kvmalloc(count, GFP_KERNEL);
+	if (!bounce)
+		return -ENOMEM;
+	if (copy_from_user(bounce, buf, count))
+		ret = -EFAULT;
+	else
+		ret = kernel_write(ring->spill, bounce, count, &pos);
+	kvfree(bounce);
+
+	if (ret > 0) {
+		ring->spill_write = pos;
+		ring->spilled += ret;
+	}
+	return ret ? ret : -EIO;
+}
+
+/* Reads spilled data. Called with the semaphore held and the buffer empty. */
+static ssize_t scd_read_spill(struct scd_ring *ring, char __user * buf,
+			      size_t count)
+{
+	loff_t pos = ring->spill_read;
+	ssize_t ret;
+	char *bounce;
+
+	count = min_t(loff_t, count, ring->spill_write - ring->spill_read);
+	count = min_t(size_t, count, SCD_SPILL_CHUNK);
+	if (!count)
+		return 0;
+	bounce = kvmalloc(count, GFP_KERNEL);
+	if (!bounce)
+		return -ENOMEM;
+	ret = kernel_read(ring->spill, bounce, count, &pos);
+	if (ret > 0 && copy_to_user(buf, bounce, ret))
+		ret = -EFAULT;
+	kvfree(bounce);
+
+	if (ret > 0) {
+		ring->spill_read = pos;
+		if (ring->spill_read == ring->spill_write)
+			ring->spill_read = ring->spill_write = 0;
+	}
+	return ret ? ret : -EIO;	/* Truncated behind our back. */
+}
+
+/* Sets or, with a NULL file, drops the spill file of a lane. The lane
+ * takes over the reference to the file. Should be called with decremented
+ * semaphore.
+ */
+static void scd_set_spill(struct scd_ring *ring, struct file *spill,
+			  const struct scd_spill *req)
+{
+	if (ring->spill)
+		fput(ring->spill);
+	ring->spill = spill;
+	ring->spill_read = ring->spill_write = 0;
+	ring->spill_mark = req ? req->watermark : 0;
+	ring->spill_limit = req ? req->limit : 0;
+	ring->spilled = 0;
+}
+
+static long scd_ioctl_spill(struct scd_ring *ring,
+			    struct scd_spill __user * arg)
+{
+	struct scd_spill req;
+	struct file *spill = NULL;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+	if (req.watermark < 0 || (long long)req.limit < 0)
+		return -EINVAL;
+	/* Spilled data has to be read from the file it went to. */
+	if (ring->spill_read != ring->spill_write)
+		return -EBUSY;
+
+	if (req.fd >= 0) {
+		spill = fget(req.fd);
+		if (!spill)
+			return -EBADF;
+		/* Positions are kept here, appending would break them. */
+		if (!S_ISREG(file_inode(spill)->i_mode) ||
+		    !(spill->f_mode & FMODE_READ) ||
+		    !(spill->f_mode & FMODE_WRITE) ||
+		    (spill->f_flags & O_APPEND)) {
+			fput(spill);
+			return -EINVAL;
+		}
+	}
+	scd_set_spill(ring, spill, &req);
+	return 0;
+}
+
+static long scd_get_stats(struct scd_device *dev,
+			  struct scd_stats __user * arg)
+{
+	struct scd_stats stats;
+	struct scd_ring *ring;
+	int i;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.memory = scd_memory(dev);
+	stats.reclaimed = dev->reclaimed;
+	for (i = 0; i < SCD_LANES; ++i) {
+		ring = &dev->lanes[i];
+		stats.lanes[i].size = ring->buffersize;
+		stats.lanes[i].used = scd_used(ring);
+		stats.lanes[i].spill_used = ring->spill_write - ring->spill_read;
+		stats.lanes[i].spilled = ring->spilled;
+	}
+	return copy_to_user(arg, &stats, sizeof(stats)) ? -EFAULT : 0;
+}
+
+/* Keeps the average time between writes for busy-polling readers, an
+ * EWMA with weight 1/8 like the TCP round trip estimate. A long pause
+ * counts as twice the largest budget, so that the average recovers after
+ * a few quick writes. Should be called with decremented semaphore.
+ */
+static void scd_note_write(struct scd_device *dev)
+{
+	u64 now = ktime_get_ns();
+	s64 gap;
+
+	if (dev->last_write) {
+		gap = min_t(u64, now - dev->last_write,
+			    2ULL * SCD_BUSY_MAX * NSEC_PER_USEC);
+		if (dev->write_gap)
+			dev->write_gap += (gap - dev->write_gap) / 8;
+		else
+			dev->write_gap = gap;
+	}
+	dev->last_write = now;
+}
+
+/* Returns how long an opening spins before sleeping, in ns. Spinning pays
+ * only if the next write likely comes within the budget: then spin twice
+ * the average gap, at most the budget. Otherwise go to sleep at once.
+ */
+static u64 scd_busy_budget(const struct scd_device *dev,
+			   const struct scd_file *file)
+{
+	u64 budget = (u64) file->busy * NSEC_PER_USEC;
+	s64 gap = READ_ONCE(dev->write_gap);
+
+	if (!gap)		/* No writes timed yet. */
+		return budget;
+	if (gap > budget)
+		return 0;
+	return min_t(u64, 2 * gap, budget);
+}
+
+/* Spins until there is something to read, the budget is spent or the CPU
+ * is wanted elsewhere, saving the wake up of a sleeping reader. Called
+ * without the semaphore, so the caller checks again. Returns whether
+ * there is something to read.
+ */
+static int scd_busy_poll(struct scd_device *dev, struct scd_file *file)
+{
+	u64 budget, start;
+
+	if (!file->busy)
+		return 0;
+	budget = scd_busy_budget(dev, file);
+	start = local_clock();
+	while (local_clock() - start < budget) {
+		if (scd_read_lane(dev, file->lane))
+			return 1;
+		if (signal_pending(current) || need_resched())
+			break;
+		cpu_relax();
+	}
+	return 0;
+}
+
+/* KUnit suites, see scd_test.c. */
+#if IS_ENABLED(CONFIG_SCD_KUNIT_TEST)
+#include "scd_test.c"
+#endif
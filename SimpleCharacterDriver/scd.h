@@ -33,8 +33,77 @@
 #define SCD_BUFFER_SIZE 0x8000	/* Circular buffer size. 32K by default. */
 #endif
 
+#ifndef SCD_LANES
+#define SCD_LANES 2		/* Circular buffers per device, lane 0 is read first. */
+#endif
+
+#define SCD_LANE_HIGH 0		/* Control messages, heartbeats. */
+#define SCD_LANE_BULK (SCD_LANES - 1)
+#define SCD_LANE_ALL (-1)	/* Default: write to bulk, read from all lanes in order. */
+
 #define SCD_IOMAGIC 0xDE
 #define SCD_IORBSIZE _IO(SCD_IOMAGIC, 0)
 #define SCD_IOGBSIZE _IO(SCD_IOMAGIC, 1)
 #define SCD_IOSBSIZE _IO(SCD_IOMAGIC, 2)
-#define SCD_IOMAX 2
+#define SCD_IOSLANE _IO(SCD_IOMAGIC, 3)	/* Lane of this open file. */
+#define SCD_IOGLANE _IO(SCD_IOMAGIC, 4)
+#define SCD_IOGIFT _IO(SCD_IOMAGIC, 5)	/* Lend pages, struct scd_gift. */
+#define SCD_IOSBUSY _IO(SCD_IOMAGIC, 6)	/* Busy-poll budget in us, 0 to sleep. */
+#define SCD_IOGBUSY _IO(SCD_IOMAGIC, 7)
+#define SCD_IOSSPILL _IO(SCD_IOMAGIC, 8)	/* Spill file, struct scd_spill. */
+#define SCD_IOGSTATS _IO(SCD_IOMAGIC, 9)	/* Usage, struct scd_stats. */
+#define SCD_IOSENDFD _IO(SCD_IOMAGIC, 10)	/* Queue a file, struct scd_fd. */
+#define SCD_IORECVFD _IO(SCD_IOMAGIC, 11)	/* Take the file a read stopped at. */
+#define SCD_IOMAX 11
+
+#define SCD_BUSY_MAX 10000	/* Largest busy-poll budget, in us. */
+#define SCD_SPILL_CHUNK 0x10000	/* Most bytes spilled or read back per call. */
+
+#define SCD_GIFT_MAX (64 << 20)	/* Largest gift, longer ones are cut. */
+#define SCD_FD_MAX 16		/* Most files queued on a lane. */
+
+/* Argument of SCD_IOGIFT: the bytes at addr are read straight from the
+ * pinned pages of the writer.
+ */
+struct scd_gift {
+	unsigned long long addr;
+	unsigned long long len;
+};
+
+/* Argument of SCD_IOSSPILL, for the write lane of the opening. Once the
+ * lane holds watermark bytes (0: once it is full), writes go on at the end
+ * of the file open at fd, and reads take them from there after the buffer.
+ * fd -1 stops spilling.
+ */
+struct scd_spill {
+	int fd;
+	int watermark;
+	unsigned long long limit;	/* most bytes in the file, 0 no limit */
+};
+
+/* Argument of SCD_IOSENDFD and SCD_IORECVFD. A file sent on the write lane
+ * of the opening sits between the bytes written before and after it. Reads
+ * stop in front of it and fail with ENOMSG until a reader takes it, as a
+ * new descriptor in fd. offset and len are handed over as they are, to
+ * tell which part of the file is meant.
+ */
+struct scd_fd {
+	int fd;
+	int flags;		/* O_CLOEXEC for the received descriptor */
+	unsigned long long offset;
+	unsigned long long len;
+};
+
+/* Argument of SCD_IOGSTATS. */
+struct scd_lane_stats {
+	unsigned int size;	/* of the buffer */
+	unsigned int used;	/* bytes in the buffer */
+	unsigned long long spill_used;	/* bytes in the spill file */
+	unsigned long long spilled;	/* bytes spilled since it was set */
+};
+
+struct scd_stats {
+	unsigned long long memory;	/* bytes of buffers held */
+	unsigned long long reclaimed;	/* buffers freed while idle */
+	struct scd_lane_stats lanes[SCD_LANES];
+};
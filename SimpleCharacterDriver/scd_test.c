@@ -0,0 +1,1333 @@
+/*
+ * scd_test.c -- KUnit tests and microbenchmarks for the char module
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file is included at the end of scd.c when CONFIG_SCD_KUNIT_TEST is
+ * set, so the tests call the static file operations directly. Devices,
+ * inodes and files are set up by hand; nothing is registered. User buffers
+ * come from kunit_vm_mmap, so copy_to_user and copy_from_user run as they
+ * would for a process. Run with scripts/scd_kunit.sh under User-Mode Linux.
+ */
+
+#include <kunit/test.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mman.h>
+#include <linux/shmem_fs.h>
+#include <linux/fdtable.h>
+#include <linux/net.h>
+#include <linux/anon_inodes.h>
+#include <net/net_namespace.h>
+#include <linux/version.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+#error "The scd KUnit tests need kunit_vm_mmap (Linux 6.10)"
+#endif
+
+#define SCD_TEST_DEV_N 2
+#define SCD_TEST_BUFFER_SIZE 64	/* Small, so tests wrap quickly. */
+#define SCD_TEST_CHUNK_MAX 0x4000
+#define SCD_TEST_UBUF_SIZE (2 * SCD_TEST_CHUNK_MAX)	/* Test, then peer. */
+#define SCD_TEST_GIFT_OFFSET 100	/* Lent data starts within a page. */
+#define SCD_TEST_GIFT_MAX (SCD_TEST_CHUNK_MAX - SCD_TEST_GIFT_OFFSET)
+
+struct scd_test_ctx {
+	struct scd_device dev[SCD_TEST_DEV_N];
+	struct inode inode[SCD_TEST_DEV_N];
+	struct file filp[SCD_TEST_DEV_N];
+	char __user *ubuf;	/* Used by the test thread. */
+	char __user *peer_ubuf;	/* Used by the peer thread. */
+	struct mm_struct *mm;
+	int saved_buff_sz;
+};
+
+/* Open each device read and write, with buffers of size bytes. */
+static int scd_test_setup(struct kunit *test, int size)
+{
+	struct scd_test_ctx *ctx;
+	unsigned long addr;
+	int i;
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx);
+	test->priv = ctx;
+
+	addr = kunit_vm_mmap(test, NULL, 0, SCD_TEST_UBUF_SIZE,
+			     PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE,
+			     0);
+	KUNIT_ASSERT_NE_MSG(test, addr, 0UL, "Could not map user memory");
+	ctx->ubuf = (char __user *)addr;
+	ctx->peer_ubuf = ctx->ubuf + SCD_TEST_CHUNK_MAX;
+	ctx->mm = current->mm;
+
+	ctx->saved_buff_sz = scd_buff_sz;
+	scd_buff_sz = size;
+
+	for (i = 0; i < SCD_TEST_DEV_N; ++i) {
+		init_waitqueue_head(&ctx->dev[i].in_queue);
+		init_waitqueue_head(&ctx->dev[i].out_queue);
+		sema_init(&ctx->dev[i].sem, 1);
+		ctx->inode[i].i_cdev = &ctx->dev[i].cdev;
+		ctx->filp[i].f_mode = FMODE_READ | FMODE_WRITE;
+		ctx->filp[i].f_flags = O_RDWR | O_NONBLOCK;
+		KUNIT_ASSERT_EQ(test, scd_open(&ctx->inode[i], &ctx->filp[i]),
+				0);
+	}
+
+	return 0;
+}
+
+static int scd_test_init(struct kunit *test)
+{
+	return scd_test_setup(test, SCD_TEST_BUFFER_SIZE);
+}
+
+static int scd_bench_init(struct kunit *test)
+{
+	return scd_test_setup(test, SCD_BUFFER_SIZE);
+}
+
+static void scd_test_exit(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	int i;
+
+	if (!ctx)
+		return;
+	for (i = 0; i < SCD_TEST_DEV_N; ++i)
+		if (ctx->filp[i].private_data)
+			scd_release(&ctx->inode[i], &ctx->filp[i]);
+	scd_buff_sz = ctx->saved_buff_sz;
+}
+
+/* Write and read kernel data through a user buffer. */
+static ssize_t scd_test_write(struct file *filp, char __user *ubuf,
+			      const void *data, size_t len)
+{
+	if (copy_to_user(ubuf, data, len))
+		return -EFAULT;
+	return scd_write(filp, ubuf, len, NULL);
+}
+
+static ssize_t scd_test_read(struct file *filp, char __user *ubuf,
+			     void *data, size_t len)
+{
+	ssize_t n = scd_read(filp, ubuf, len, NULL);
+
+	if (n > 0 && copy_from_user(data, ubuf, n))
+		return -EFAULT;
+	return n;
+}
+
+/* Lends data with SCD_IOGIFT. The request and the data share ubuf. */
+static long scd_test_gift(struct file *filp, char __user *ubuf,
+			  const void *data, size_t len)
+{
+	char __user *src = ubuf + SCD_TEST_GIFT_OFFSET;
+	struct scd_gift req;
+
+	if (copy_to_user(src, data, len))
+		return -EFAULT;
+	req.addr = (unsigned long)src;
+	req.len = len;
+	if (copy_to_user(ubuf, &req, sizeof(req)))
+		return -EFAULT;
+	return scd_unlocked_ioctl(filp, SCD_IOGIFT, (unsigned long)ubuf);
+}
+
+static void scd_test_blocking(struct file *filp, bool blocking)
+{
+	if (blocking)
+		filp->f_flags &= ~O_NONBLOCK;
+	else
+		filp->f_flags |= O_NONBLOCK;
+}
+
+static void scd_test_pattern(char *data, size_t len, int seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		data[i] = (char)(seed + i);
+}
+
+/* A second thread blocking on a device. It borrows the test's mm, so the
+ * user buffers are valid in it too.
+ */
+enum scd_peer_op {
+	SCD_PEER_READ,		/* One read of len bytes from dev 0. */
+	SCD_PEER_WRITE,		/* One write of len bytes to dev 0. */
+	SCD_PEER_ECHO,		/* rounds times: read dev 0, write it to dev 1. */
+	SCD_PEER_GIFT,		/* rounds times: lend len bytes to dev 0. */
+};
+
+struct scd_test_peer {
+	struct scd_test_ctx *ctx;
+	enum scd_peer_op op;
+	char *data;
+	size_t len;
+	int rounds;
+	ssize_t result;
+	struct completion done;
+};
+
+static int scd_test_peer_fn(void *arg)
+{
+	struct scd_test_peer *peer = arg;
+	struct scd_test_ctx *ctx = peer->ctx;
+	ssize_t n = 0;
+	int i;
+
+	kthread_use_mm(ctx->mm);
+	switch (peer->op) {
+	case SCD_PEER_READ:
+		n = scd_test_read(&ctx->filp[0], ctx->peer_ubuf, peer->data,
+				  peer->len);
+		break;
+	case SCD_PEER_WRITE:
+		n = scd_test_write(&ctx->filp[0], ctx->peer_ubuf, peer->data,
+				   peer->len);
+		break;
+	case SCD_PEER_ECHO:
+		for (i = 0; i < peer->rounds; ++i) {
+			n = scd_read(&ctx->filp[0], ctx->peer_ubuf, peer->len,
+				     NULL);
+			if (n <= 0)
+				break;
+			n = scd_write(&ctx->filp[1], ctx->peer_ubuf, n, NULL);
+			if (n <= 0)
+				break;
+		}
+		break;
+	case SCD_PEER_GIFT:
+		for (i = 0; i < peer->rounds; ++i) {
+			n = scd_test_gift(&ctx->filp[0], ctx->peer_ubuf,
+					  peer->data, peer->len);
+			if (n != (ssize_t)peer->len)
+				break;
+		}
+		break;
+	}
+	kthread_unuse_mm(ctx->mm);
+
+	peer->result = n;
+	complete(&peer->done);
+	return 0;
+}
+
+static struct scd_test_peer *scd_test_start_peer(struct kunit *test,
+						 enum scd_peer_op op,
+						 size_t len, int rounds)
+{
+	struct scd_test_peer *peer;
+	struct task_struct *task;
+
+	peer = kunit_kzalloc(test, sizeof(*peer), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, peer);
+	peer->data = kunit_kzalloc(test, len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, peer->data);
+	scd_test_pattern(peer->data, len, 5);
+	peer->ctx = test->priv;
+	peer->op = op;
+	peer->len = len;
+	peer->rounds = rounds;
+	init_completion(&peer->done);
+
+	task = kthread_run(scd_test_peer_fn, peer, "scd_test_peer");
+	KUNIT_ASSERT_FALSE(test, IS_ERR(task));
+	return peer;
+}
+
+/* Ring. */
+static void scd_test_empty_read(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	char data[8];
+
+	KUNIT_EXPECT_EQ(test, scd_test_read(&ctx->filp[0], ctx->ubuf, data,
+					    sizeof(data)), (ssize_t)-EAGAIN);
+}
+
+static void scd_test_write_read(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	char in[16], out[16];
+
+	scd_test_pattern(in, sizeof(in), 1);
+	KUNIT_ASSERT_EQ(test, scd_test_write(&ctx->filp[0], ctx->ubuf, in,
+					     sizeof(in)), (ssize_t)sizeof(in));
+	KUNIT_ASSERT_EQ(test, scd_test_read(&ctx->filp[0], ctx->ubuf, out,
+					    sizeof(out)), (ssize_t)sizeof(out));
+	KUNIT_EXPECT_MEMEQ(test, in, out, sizeof(in));
+
+	/* Devices do not share buffers. */
+	KUNIT_EXPECT_EQ(test, scd_test_read(&ctx->filp[1], ctx->ubuf, out,
+					    sizeof(out)), (ssize_t)-EAGAIN);
+}
+
+static void scd_test_freespace(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct scd_ring *ring = &ctx->dev[0].lanes[SCD_LANE_BULK];
+
+	KUNIT_ASSERT_EQ(test, scd_alloc_ring(ring), 0);
+	ring->read = ring->write = ring->begin + 10;
+	KUNIT_EXPECT_EQ(test, freespace(ring), SCD_TEST_BUFFER_SIZE - 1);
+	ring->write = ring->begin + 20;
+	KUNIT_EXPECT_EQ(test, freespace(ring), SCD_TEST_BUFFER_SIZE - 11);
+	ring->read = ring->begin + 30;
+	KUNIT_EXPECT_EQ(test, freespace(ring), 9);
+	ring->read = ring->begin + 21;
+	KUNIT_EXPECT_EQ(test, freespace(ring), 0);
+	ring->read = ring->begin;
+	ring->write = ring->end - 1;
+	KUNIT_EXPECT_EQ(test, freespace(ring), 0);
+}
+
+/* One slot stays empty: a full buffer holds buffersize - 1 bytes. */
+static void scd_test_full(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct scd_ring *ring = &ctx->dev[0].lanes[SCD_LANE_BULK];
+	struct file *filp = &ctx->filp[0];
+	char data[2 * SCD_TEST_BUFFER_SIZE];
+
+	scd_test_pattern(data, sizeof(data), 0);
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, data,
+					     sizeof(data)),
+			(ssize_t)SCD_TEST_BUFFER_SIZE - 1);
+	KUNIT_EXPECT_EQ(test, scd_test_write(filp, ctx->ubuf, data, 1),
+			(ssize_t)-EAGAIN);
+
+	/* Freeing one byte at the beginning lets write wrap onto the end. */
+	KUNIT_ASSERT_EQ(test, scd_test_read(filp, ctx->ubuf, data, 1),
+			(ssize_t)1);
+	KUNIT_EXPECT_EQ(test, scd_test_write(filp, ctx->ubuf, data,
+					     sizeof(data)), (ssize_t)1);
+	KUNIT_EXPECT_PTR_EQ(test, ring->write, ring->begin);
+	KUNIT_EXPECT_EQ(test, scd_test_write(filp, ctx->ubuf, data, 1),
+			(ssize_t)-EAGAIN);
+}
+
+/* Reads and writes stop at the end of the buffer; the rest follows in the
+ * next call, in order.
+ */
+static void scd_test_wrap(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct scd_ring *ring = &ctx->dev[0].lanes[SCD_LANE_BULK];
+	struct file *filp = &ctx->filp[0];
+	char in[60], out[60];
+	size_t head = SCD_TEST_BUFFER_SIZE - 40;
+
+	scd_test_pattern(in, 40, 0);
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, in, 40),
+			(ssize_t)40);
+	KUNIT_ASSERT_EQ(test, scd_test_read(filp, ctx->ubuf, out, 40),
+			(ssize_t)40);
+
+	scd_test_pattern(in, sizeof(in), 7);
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, in, sizeof(in)),
+			(ssize_t)head);
+	KUNIT_EXPECT_PTR_EQ(test, ring->write, ring->begin);
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, in + head,
+					     sizeof(in) - head),
+			(ssize_t)(sizeof(in) - head));
+
+	KUNIT_ASSERT_EQ(test, scd_test_read(filp, ctx->ubuf, out, sizeof(out)),
+			(ssize_t)head);
+	KUNIT_EXPECT_PTR_EQ(test, ring->read, ring->begin);
+	KUNIT_ASSERT_EQ(test, scd_test_read(filp, ctx->ubuf, out + head,
+					    sizeof(out)),
+			(ssize_t)(sizeof(out) - head));
+	KUNIT_EXPECT_MEMEQ(test, in, out, sizeof(in));
+	KUNIT_EXPECT_EQ(test, freespace(ring), SCD_TEST_BUFFER_SIZE - 1);
+}
+
+static void scd_test_bad_address(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct scd_ring *ring = &ctx->dev[0].lanes[SCD_LANE_BULK];
+	char data[4] = { };
+
+	KUNIT_EXPECT_EQ(test, scd_write(&ctx->filp[0], NULL, 4, NULL),
+			(ssize_t)-EFAULT);
+	KUNIT_EXPECT_PTR_EQ(test, ring->write, ring->begin);
+
+	KUNIT_ASSERT_EQ(test, scd_test_write(&ctx->filp[0], ctx->ubuf, data,
+					     sizeof(data)), (ssize_t)4);
+	KUNIT_EXPECT_EQ(test, scd_read(&ctx->filp[0], NULL, 4, NULL),
+			(ssize_t)-EFAULT);
+	KUNIT_EXPECT_PTR_EQ(test, ring->read, ring->begin);
+}
+
+/* Poll and ioctl. */
+static void scd_test_poll(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp[0];
+	char data[SCD_TEST_BUFFER_SIZE] = { };
+
+	KUNIT_EXPECT_EQ(test, scd_poll(filp, NULL),
+			(unsigned int)(POLLOUT | POLLWRNORM | POLLWRBAND));
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, data, 1),
+			(ssize_t)1);
+	KUNIT_EXPECT_EQ(test, scd_poll(filp, NULL),
+			(unsigned int)(POLLIN | POLLRDNORM | POLLOUT |
+				       POLLWRNORM | POLLWRBAND));
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, data,
+					     sizeof(data)),
+			(ssize_t)SCD_TEST_BUFFER_SIZE - 2);
+	KUNIT_EXPECT_EQ(test, scd_poll(filp, NULL),
+			(unsigned int)(POLLIN | POLLRDNORM | POLLWRBAND));
+}
+
+static void scd_test_ioctl(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp[0];
+	int __user *arg = (int __user *)ctx->ubuf;
+	int size = 0;
+
+	KUNIT_ASSERT_EQ(test, scd_unlocked_ioctl(filp, SCD_IOGBSIZE,
+						 (unsigned long)arg), 0L);
+	KUNIT_ASSERT_EQ(test, get_user(size, arg), 0);
+	KUNIT_EXPECT_EQ(test, size, SCD_TEST_BUFFER_SIZE);
+
+	KUNIT_ASSERT_EQ(test, put_user(128, arg), 0);
+	KUNIT_EXPECT_EQ(test, scd_unlocked_ioctl(filp, SCD_IOSBSIZE,
+						 (unsigned long)arg), 0L);
+	KUNIT_EXPECT_EQ(test, scd_buff_sz, 128);
+	KUNIT_EXPECT_EQ(test, scd_unlocked_ioctl(filp, SCD_IORBSIZE, 0), 0L);
+	KUNIT_EXPECT_EQ(test, scd_buff_sz, SCD_BUFFER_SIZE);
+
+	KUNIT_EXPECT_EQ(test, scd_unlocked_ioctl(filp, SCD_IOGBSIZE, 0),
+			(long)-EFAULT);
+	KUNIT_EXPECT_EQ(test, scd_unlocked_ioctl(filp, _IO('x', 0), 0),
+			(long)-EINVAL);
+	KUNIT_EXPECT_EQ(test, scd_unlocked_ioctl(filp,
+						 _IO(SCD_IOMAGIC,
+						     SCD_IOMAX + 1), 0),
+			(long)-EINVAL);
+}
+
+/* Lanes. */
+static long scd_test_set_lane(struct file *filp, int __user *arg, int lane)
+{
+	if (put_user(lane, arg))
+		return -EFAULT;
+	return scd_unlocked_ioctl(filp, SCD_IOSLANE, (unsigned long)arg);
+}
+
+static void scd_test_lane_ioctl(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp[0];
+	int __user *arg = (int __user *)ctx->ubuf;
+	int lane = 0;
+
+	KUNIT_ASSERT_EQ(test, scd_unlocked_ioctl(filp, SCD_IOGLANE,
+						 (unsigned long)arg), 0L);
+	KUNIT_ASSERT_EQ(test, get_user(lane, arg), 0);
+	KUNIT_EXPECT_EQ(test, lane, SCD_LANE_ALL);
+
+	KUNIT_EXPECT_EQ(test, scd_test_set_lane(filp, arg, SCD_LANE_HIGH), 0L);
+	KUNIT_ASSERT_EQ(test, scd_unlocked_ioctl(filp, SCD_IOGLANE,
+						 (unsigned long)arg), 0L);
+	KUNIT_ASSERT_EQ(test, get_user(lane, arg), 0);
+	KUNIT_EXPECT_EQ(test, lane, SCD_LANE_HIGH);
+
+	KUNIT_EXPECT_EQ(test, scd_test_set_lane(filp, arg, SCD_LANES),
+			(long)-EINVAL);
+	KUNIT_EXPECT_EQ(test, scd_test_set_lane(filp, arg, -2), (long)-EINVAL);
+	KUNIT_EXPECT_EQ(test, ((struct scd_file *)filp->private_data)->lane,
+			SCD_LANE_HIGH);
+}
+
+/* Data of a higher lane is read first, even if written later, and one read
+ * returns data of one lane only.
+ */
+static void scd_test_lane_order(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp[0];
+	int __user *arg = (int __user *)(ctx->ubuf + SCD_TEST_CHUNK_MAX - 4);
+	char out[16] = { };
+
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, "bulk", 4),
+			(ssize_t)4);
+	KUNIT_ASSERT_EQ(test, scd_test_set_lane(filp, arg, SCD_LANE_HIGH), 0L);
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, "high", 4),
+			(ssize_t)4);
+	KUNIT_ASSERT_EQ(test, scd_test_set_lane(filp, arg, SCD_LANE_ALL), 0L);
+
+	KUNIT_EXPECT_EQ(test, scd_poll(filp, NULL) & POLLPRI,
+			(unsigned int)POLLPRI);
+	KUNIT_ASSERT_EQ(test, scd_test_read(filp, ctx->ubuf, out, sizeof(out)),
+			(ssize_t)4);
+	KUNIT_EXPECT_MEMEQ(test, out, "high", 4);
+	KUNIT_EXPECT_EQ(test, scd_poll(filp, NULL) & POLLPRI, 0U);
+	KUNIT_ASSERT_EQ(test, scd_test_read(filp, ctx->ubuf, out, sizeof(out)),
+			(ssize_t)4);
+	KUNIT_EXPECT_MEMEQ(test, out, "bulk", 4);
+}
+
+/* An opening set to one lane reads and writes that lane only. */
+static void scd_test_lane_reader(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp[0];
+	int __user *arg = (int __user *)(ctx->ubuf + SCD_TEST_CHUNK_MAX - 4);
+	struct file control = { };
+	char out[16] = { };
+
+	control.f_mode = FMODE_READ | FMODE_WRITE;
+	control.f_flags = O_RDWR | O_NONBLOCK;
+	KUNIT_ASSERT_EQ(test, scd_open(&ctx->inode[0], &control), 0);
+	KUNIT_EXPECT_EQ(test, scd_test_set_lane(&control, arg, SCD_LANE_HIGH),
+			0L);
+	KUNIT_EXPECT_EQ(test, scd_test_set_lane(filp, arg, SCD_LANE_BULK), 0L);
+
+	KUNIT_EXPECT_EQ(test, scd_test_write(&control, ctx->ubuf, "ping", 4),
+			(ssize_t)4);
+	KUNIT_EXPECT_EQ(test, scd_test_read(filp, ctx->ubuf, out, sizeof(out)),
+			(ssize_t)-EAGAIN);
+	KUNIT_EXPECT_EQ(test, scd_poll(filp, NULL) & (POLLIN | POLLPRI), 0U);
+	KUNIT_EXPECT_EQ(test, scd_test_read(&control, ctx->ubuf, out,
+					    sizeof(out)), (ssize_t)4);
+	KUNIT_EXPECT_MEMEQ(test, out, "ping", 4);
+
+	KUNIT_EXPECT_EQ(test, scd_test_write(filp, ctx->ubuf, "data", 4),
+			(ssize_t)4);
+	KUNIT_EXPECT_EQ(test, scd_test_read(&control, ctx->ubuf, out,
+					    sizeof(out)), (ssize_t)-EAGAIN);
+
+	scd_release(&ctx->inode[0], &control);
+}
+
+/* Busy-polling. */
+static long scd_test_set_busy(struct file *filp, int __user *arg, int busy)
+{
+	if (put_user(busy, arg))
+		return -EFAULT;
+	return scd_unlocked_ioctl(filp, SCD_IOSBUSY, (unsigned long)arg);
+}
+
+static void scd_test_busy_ioctl(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct scd_device *dev = &ctx->dev[0];
+	struct file *filp = &ctx->filp[0];
+	int __user *arg = (int __user *)ctx->ubuf;
+	struct file other = { };
+	int busy = -1;
+
+	KUNIT_ASSERT_EQ(test, scd_unlocked_ioctl(filp, SCD_IOGBUSY,
+						 (unsigned long)arg), 0L);
+	KUNIT_ASSERT_EQ(test, get_user(busy, arg), 0);
+	KUNIT_EXPECT_EQ(test, busy, 0);
+
+	KUNIT_EXPECT_EQ(test, scd_test_set_busy(filp, arg, 50), 0L);
+	KUNIT_ASSERT_EQ(test, scd_unlocked_ioctl(filp, SCD_IOGBUSY,
+						 (unsigned long)arg), 0L);
+	KUNIT_ASSERT_EQ(test, get_user(busy, arg), 0);
+	KUNIT_EXPECT_EQ(test, busy, 50);
+	KUNIT_EXPECT_EQ(test, scd_test_set_busy(filp, arg, -1), (long)-EINVAL);
+	KUNIT_EXPECT_EQ(test, scd_test_set_busy(filp, arg, SCD_BUSY_MAX + 1),
+			(long)-EINVAL);
+
+	/* Writes are timed while any opening busy-polls. */
+	KUNIT_EXPECT_EQ(test, scd_test_set_busy(filp, arg, 10), 0L);
+	KUNIT_EXPECT_EQ(test, dev->nbusy, 1);
+	other.f_mode = FMODE_READ;
+	other.f_flags = O_RDONLY;
+	KUNIT_ASSERT_EQ(test, scd_open(&ctx->inode[0], &other), 0);
+	KUNIT_EXPECT_EQ(test, scd_test_set_busy(&other, arg, 10), 0L);
+	KUNIT_EXPECT_EQ(test, dev->nbusy, 2);
+	KUNIT_EXPECT_EQ(test, scd_release(&ctx->inode[0], &other), 0);
+	KUNIT_EXPECT_EQ(test, dev->nbusy, 1);
+	KUNIT_EXPECT_EQ(test, scd_test_set_busy(filp, arg, 0), 0L);
+	KUNIT_EXPECT_EQ(test, dev->nbusy, 0);
+}
+
+/* The budget follows the average gap between writes. */
+static void scd_test_busy_budget(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct scd_device *dev = &ctx->dev[0];
+	struct scd_file *file = ctx->filp[0].private_data;
+	int __user *arg = (int __user *)(ctx->ubuf + SCD_TEST_CHUNK_MAX - 4);
+	char data[4] = { };
+
+	KUNIT_EXPECT_EQ(test, scd_busy_budget(dev, file), 0ULL);
+	KUNIT_ASSERT_EQ(test, scd_test_set_busy(&ctx->filp[0], arg, 100), 0L);
+	KUNIT_EXPECT_EQ(test, scd_busy_budget(dev, file), 100000ULL);
+	dev->write_gap = 20000;
+	KUNIT_EXPECT_EQ(test, scd_busy_budget(dev, file), 40000ULL);
+	dev->write_gap = 80000;
+	KUNIT_EXPECT_EQ(test, scd_busy_budget(dev, file), 100000ULL);
+	dev->write_gap = 200000;
+	KUNIT_EXPECT_EQ(test, scd_busy_budget(dev, file), 0ULL);
+
+	/* A pause weighs no more than twice the largest budget. */
+	dev->write_gap = 0;
+	dev->last_write = 0;
+	KUNIT_ASSERT_EQ(test, scd_test_write(&ctx->filp[0], ctx->ubuf, data, 1),
+			(ssize_t)1);
+	KUNIT_EXPECT_NE(test, dev->last_write, 0ULL);
+	KUNIT_EXPECT_EQ(test, dev->write_gap, 0LL);
+	dev->last_write -= NSEC_PER_SEC;
+	KUNIT_ASSERT_EQ(test, scd_test_write(&ctx->filp[0], ctx->ubuf, data, 1),
+			(ssize_t)1);
+	KUNIT_EXPECT_EQ(test, dev->write_gap,
+			2LL * SCD_BUSY_MAX * NSEC_PER_USEC);
+	msleep(1);
+	KUNIT_ASSERT_EQ(test, scd_test_write(&ctx->filp[0], ctx->ubuf, data, 1),
+			(ssize_t)1);
+	KUNIT_EXPECT_LT(test, dev->write_gap,
+			2LL * SCD_BUSY_MAX * NSEC_PER_USEC);
+}
+
+/* A busy-polling read still sleeps once the budget is spent. */
+static void scd_test_busy_read(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	int __user *arg = (int __user *)(ctx->ubuf + SCD_TEST_CHUNK_MAX - 4);
+	struct scd_test_peer *peer;
+	char in[16];
+
+	KUNIT_ASSERT_EQ(test, scd_test_set_busy(&ctx->filp[0], arg,
+						SCD_BUSY_MAX), 0L);
+	scd_test_blocking(&ctx->filp[0], true);
+	peer = scd_test_start_peer(test, SCD_PEER_READ, sizeof(in), 1);
+
+	msleep(50);
+	KUNIT_EXPECT_FALSE_MSG(test, completion_done(&peer->done),
+			       "Read returned from an empty device");
+
+	scd_test_pattern(in, sizeof(in), 3);
+	KUNIT_ASSERT_EQ(test, scd_test_write(&ctx->filp[0], ctx->ubuf, in,
+					     sizeof(in)), (ssize_t)sizeof(in));
+	wait_for_completion(&peer->done);
+	KUNIT_EXPECT_EQ(test, peer->result, (ssize_t)sizeof(in));
+	KUNIT_EXPECT_MEMEQ(test, peer->data, in, sizeof(in));
+}
+
+/* Spilling. */
+static void scd_test_stats(struct kunit *test, struct file *filp,
+			   struct scd_stats *stats)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	void __user *arg = ctx->ubuf + SCD_TEST_CHUNK_MAX - sizeof(*stats);
+
+	KUNIT_ASSERT_EQ(test, scd_unlocked_ioctl(filp, SCD_IOGSTATS,
+						 (unsigned long)arg), 0L);
+	KUNIT_ASSERT_EQ(test, copy_from_user(stats, arg, sizeof(*stats)), 0UL);
+}
+
+/* Sets a shmem spill file on the bulk lane of device 0. */
+static void scd_test_set_spill(struct kunit *test, int watermark, int limit)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct scd_spill req = { -1, watermark, limit };
+	struct file *spill;
+
+	spill = shmem_file_setup("scd_test_spill", 0, 0);
+	KUNIT_ASSERT_FALSE(test, IS_ERR(spill));
+	scd_set_spill(&ctx->dev[0].lanes[SCD_LANE_BULK], spill, &req);
+}
+
+/* Past the watermark writes go to the file, up to its limit, and are read
+ * back after the buffer, in order.
+ */
+static void scd_test_spill(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct scd_ring *ring = &ctx->dev[0].lanes[SCD_LANE_BULK];
+	struct file *filp = &ctx->filp[0];
+	struct scd_stats stats;
+	char in[120], out[120];
+	size_t done;
+	ssize_t n;
+
+	scd_test_set_spill(test, 16, 100);
+	scd_test_pattern(in, sizeof(in), 9);
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, in, 40),
+			(ssize_t)16);
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, in + 16, 24),
+			(ssize_t)24);
+
+	scd_test_stats(test, filp, &stats);
+	KUNIT_EXPECT_EQ(test, stats.lanes[SCD_LANE_BULK].size,
+			(unsigned int)SCD_TEST_BUFFER_SIZE);
+	KUNIT_EXPECT_EQ(test, stats.lanes[SCD_LANE_BULK].used, 16U);
+	KUNIT_EXPECT_EQ(test, stats.lanes[SCD_LANE_BULK].spill_used, 24ULL);
+	KUNIT_EXPECT_EQ(test, stats.lanes[SCD_LANE_BULK].spilled, 24ULL);
+
+	/* Reading from the buffer does not let writes jump the spilled data. */
+	KUNIT_ASSERT_EQ(test, scd_test_read(filp, ctx->ubuf, out, 8),
+			(ssize_t)8);
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, in + 40,
+					     sizeof(in) - 40), (ssize_t)76);
+	KUNIT_EXPECT_EQ(test, scd_test_write(filp, ctx->ubuf, in, 1),
+			(ssize_t)-EAGAIN);
+	KUNIT_EXPECT_EQ(test, scd_poll(filp, NULL) & POLLOUT, 0U);
+
+	for (done = 8; done < 116; done += n) {
+		n = scd_test_read(filp, ctx->ubuf, out + done,
+				  sizeof(out) - done);
+		KUNIT_ASSERT_GT(test, n, (ssize_t)0);
+	}
+	KUNIT_EXPECT_EQ(test, done, (size_t)116);
+	KUNIT_EXPECT_MEMEQ(test, in, out, 116);
+	KUNIT_EXPECT_EQ(test, scd_test_read(filp, ctx->ubuf, out, 1),
+			(ssize_t)-EAGAIN);
+
+	/* Drained, the file starts over and writes go to the buffer again. */
+	KUNIT_EXPECT_EQ(test, ring->spill_write, (loff_t)0);
+	KUNIT_EXPECT_EQ(test, scd_test_write(filp, ctx->ubuf, in, 4),
+			(ssize_t)4);
+	KUNIT_EXPECT_EQ(test, ring->spill_write, (loff_t)0);
+}
+
+static void scd_test_spill_ioctl(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp[0];
+	struct scd_spill __user *arg = (struct scd_spill __user *)ctx->ubuf;
+	struct scd_spill req = { -1, 0, 0 };
+	char data[SCD_TEST_BUFFER_SIZE] = { };
+
+	KUNIT_ASSERT_EQ(test, copy_to_user(arg, &req, sizeof(req)), 0UL);
+	KUNIT_EXPECT_EQ(test, scd_unlocked_ioctl(filp, SCD_IOSSPILL,
+						 (unsigned long)arg), 0L);
+	req.fd = INT_MAX;
+	KUNIT_ASSERT_EQ(test, copy_to_user(arg, &req, sizeof(req)), 0UL);
+	KUNIT_EXPECT_EQ(test, scd_unlocked_ioctl(filp, SCD_IOSSPILL,
+						 (unsigned long)arg),
+			(long)-EBADF);
+	req.fd = -1;
+	req.watermark = -1;
+	KUNIT_ASSERT_EQ(test, copy_to_user(arg, &req, sizeof(req)), 0UL);
+	KUNIT_EXPECT_EQ(test, scd_unlocked_ioctl(filp, SCD_IOSSPILL,
+						 (unsigned long)arg),
+			(long)-EINVAL);
+
+	/* Spilled data keeps its file. */
+	scd_test_set_spill(test, 0, 0);
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->peer_ubuf, data,
+					     sizeof(data)),
+			(ssize_t)SCD_TEST_BUFFER_SIZE - 1);
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->peer_ubuf, data, 1),
+			(ssize_t)1);
+	req.watermark = 0;
+	KUNIT_ASSERT_EQ(test, copy_to_user(arg, &req, sizeof(req)), 0UL);
+	KUNIT_EXPECT_EQ(test, scd_unlocked_ioctl(filp, SCD_IOSSPILL,
+						 (unsigned long)arg),
+			(long)-EBUSY);
+	KUNIT_EXPECT_EQ(test, scd_unlocked_ioctl(filp, SCD_IOGSTATS, 0),
+			(long)-EFAULT);
+}
+
+/* Memory. */
+/* Buffers are allocated by the first write, in the size of the last open. */
+static void scd_test_lazy_alloc(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct scd_ring *ring = &ctx->dev[0].lanes[SCD_LANE_BULK];
+	struct file *filp = &ctx->filp[0];
+	struct scd_stats stats;
+	struct file other = { };
+	char data[SCD_TEST_BUFFER_SIZE * 2] = { };
+	int i;
+
+	for (i = 0; i < SCD_LANES; ++i)
+		KUNIT_EXPECT_NULL(test, ctx->dev[0].lanes[i].begin);
+	scd_test_stats(test, filp, &stats);
+	KUNIT_EXPECT_EQ(test, stats.memory, 0ULL);
+
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, data, 1),
+			(ssize_t)1);
+	KUNIT_EXPECT_NOT_NULL(test, ring->begin);
+	KUNIT_EXPECT_NULL(test, ctx->dev[0].lanes[SCD_LANE_HIGH].begin);
+	scd_test_stats(test, filp, &stats);
+	KUNIT_EXPECT_EQ(test, stats.memory, (u64)SCD_TEST_BUFFER_SIZE);
+
+	/* An open with another size replaces the buffer. */
+	scd_buff_sz = SCD_TEST_BUFFER_SIZE * 2;
+	other.f_mode = FMODE_READ | FMODE_WRITE;
+	other.f_flags = O_RDWR | O_NONBLOCK;
+	KUNIT_ASSERT_EQ(test, scd_open(&ctx->inode[0], &other), 0);
+	KUNIT_EXPECT_NULL(test, ring->begin);
+	KUNIT_EXPECT_EQ(test, scd_test_write(&other, ctx->ubuf, data,
+					     sizeof(data)),
+			(ssize_t)SCD_TEST_BUFFER_SIZE * 2 - 1);
+	scd_test_stats(test, filp, &stats);
+	KUNIT_EXPECT_EQ(test, stats.memory, (u64)SCD_TEST_BUFFER_SIZE * 2);
+	KUNIT_EXPECT_EQ(test, stats.lanes[SCD_LANE_BULK].used,
+			(unsigned int)SCD_TEST_BUFFER_SIZE * 2 - 1);
+	scd_release(&ctx->inode[0], &other);
+}
+
+/* Idle buffers are freed under pressure and come back with a write. */
+static void scd_test_reclaim(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct scd_device *dev = &ctx->dev[0];
+	struct file *filp = &ctx->filp[0];
+	int __user *arg = (int __user *)(ctx->ubuf + SCD_TEST_CHUNK_MAX - 4);
+	struct scd_stats stats;
+	char out[8] = { };
+
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, "idle", 4),
+			(ssize_t)4);
+	KUNIT_ASSERT_EQ(test, scd_test_read(filp, ctx->ubuf, out, sizeof(out)),
+			(ssize_t)4);
+	KUNIT_ASSERT_EQ(test, scd_test_set_lane(filp, arg, SCD_LANE_HIGH), 0L);
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, "busy", 4),
+			(ssize_t)4);
+
+	KUNIT_EXPECT_EQ(test, scd_reclaim(dev, 16), 1UL);
+	KUNIT_EXPECT_NULL(test, dev->lanes[SCD_LANE_BULK].begin);
+	KUNIT_EXPECT_NOT_NULL(test, dev->lanes[SCD_LANE_HIGH].begin);
+	KUNIT_EXPECT_EQ(test, scd_reclaim(dev, 16), 0UL);
+	scd_test_stats(test, filp, &stats);
+	KUNIT_EXPECT_EQ(test, stats.memory, (u64)SCD_TEST_BUFFER_SIZE);
+	KUNIT_EXPECT_EQ(test, stats.reclaimed, 1ULL);
+
+	/* A device in use is skipped. */
+	KUNIT_ASSERT_EQ(test, down_interruptible(&dev->sem), 0);
+	KUNIT_EXPECT_EQ(test, scd_reclaim(dev, 16), 0UL);
+	up(&dev->sem);
+
+	KUNIT_ASSERT_EQ(test, scd_test_set_lane(filp, arg, SCD_LANE_ALL), 0L);
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, "back", 4),
+			(ssize_t)4);
+	KUNIT_EXPECT_NOT_NULL(test, dev->lanes[SCD_LANE_BULK].begin);
+	KUNIT_ASSERT_EQ(test, scd_test_read(filp, ctx->ubuf, out, sizeof(out)),
+			(ssize_t)4);
+	KUNIT_EXPECT_MEMEQ(test, out, "busy", 4);
+	KUNIT_ASSERT_EQ(test, scd_test_read(filp, ctx->ubuf, out, sizeof(out)),
+			(ssize_t)4);
+	KUNIT_EXPECT_MEMEQ(test, out, "back", 4);
+}
+
+/* Open and release. */
+static void scd_test_release(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct scd_ring *ring = &ctx->dev[0].lanes[SCD_LANE_BULK];
+	struct file reader = { };
+	char data[4] = { };
+
+	KUNIT_ASSERT_EQ(test, scd_test_write(&ctx->filp[0], ctx->ubuf, data,
+					     sizeof(data)), (ssize_t)4);
+	reader.f_mode = FMODE_READ;
+	reader.f_flags = O_RDONLY;
+	KUNIT_ASSERT_EQ(test, scd_open(&ctx->inode[0], &reader), 0);
+	KUNIT_EXPECT_EQ(test, ctx->dev[0].nreaders, 2);
+	KUNIT_EXPECT_EQ(test, ctx->dev[0].nwriters, 1);
+
+	/* The buffer goes with the last opening only. */
+	KUNIT_EXPECT_EQ(test, scd_release(&ctx->inode[0], &reader), 0);
+	KUNIT_EXPECT_NOT_NULL(test, ring->begin);
+	KUNIT_EXPECT_EQ(test, scd_release(&ctx->inode[0], &ctx->filp[0]), 0);
+	KUNIT_EXPECT_NULL(test, ring->begin);
+	ctx->filp[0].private_data = NULL;
+}
+
+/* Wait and wake. */
+static void scd_test_read_blocks(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct scd_test_peer *peer;
+	char in[16];
+
+	scd_test_blocking(&ctx->filp[0], true);
+	peer = scd_test_start_peer(test, SCD_PEER_READ, sizeof(in), 1);
+
+	msleep(20);
+	KUNIT_EXPECT_FALSE_MSG(test, completion_done(&peer->done),
+			       "Read returned from an empty device");
+
+	scd_test_pattern(in, sizeof(in), 3);
+	KUNIT_ASSERT_EQ(test, scd_test_write(&ctx->filp[0], ctx->ubuf, in,
+					     sizeof(in)), (ssize_t)sizeof(in));
+	wait_for_completion(&peer->done);
+	KUNIT_EXPECT_EQ(test, peer->result, (ssize_t)sizeof(in));
+	KUNIT_EXPECT_MEMEQ(test, peer->data, in, sizeof(in));
+}
+
+static void scd_test_write_blocks(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct scd_test_peer *peer;
+	char data[SCD_TEST_BUFFER_SIZE] = { };
+
+	KUNIT_ASSERT_EQ(test, scd_test_write(&ctx->filp[0], ctx->ubuf, data,
+					     sizeof(data)),
+			(ssize_t)SCD_TEST_BUFFER_SIZE - 1);
+
+	scd_test_blocking(&ctx->filp[0], true);
+	peer = scd_test_start_peer(test, SCD_PEER_WRITE, 8, 1);
+
+	msleep(20);
+	KUNIT_EXPECT_FALSE_MSG(test, completion_done(&peer->done),
+			       "Write returned on a full device");
+
+	KUNIT_ASSERT_EQ(test, scd_test_read(&ctx->filp[0], ctx->ubuf, data, 8),
+			(ssize_t)8);
+	wait_for_completion(&peer->done);
+	KUNIT_EXPECT_GT(test, peer->result, (ssize_t)0);
+}
+
+/* Lent pages are read after the data written before them, in place. */
+static void scd_test_gift_order(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp[0];
+	struct scd_test_peer *peer;
+	size_t len = 10000, done;
+	char *out;
+	ssize_t n;
+
+	out = kunit_kzalloc(test, len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, out);
+
+	scd_test_blocking(filp, true);
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, "head", 4),
+			(ssize_t)4);
+	peer = scd_test_start_peer(test, SCD_PEER_GIFT, len, 1);
+
+	msleep(20);
+	KUNIT_EXPECT_FALSE(test, completion_done(&peer->done));
+	KUNIT_ASSERT_EQ(test, scd_test_read(filp, ctx->ubuf, out, len),
+			(ssize_t)4);
+	KUNIT_EXPECT_MEMEQ(test, out, "head", 4);
+
+	/* Once the pages are queued, writes wait behind them. */
+	KUNIT_ASSERT_EQ(test, scd_test_read(filp, ctx->ubuf, out, 1),
+			(ssize_t)1);
+	scd_test_blocking(filp, false);
+	KUNIT_EXPECT_EQ(test, scd_test_write(filp, ctx->ubuf, "tail", 4),
+			(ssize_t)-EAGAIN);
+	KUNIT_EXPECT_EQ(test, scd_poll(filp, NULL) & POLLOUT, 0U);
+
+	for (done = 1; done < len; done += n) {
+		n = scd_test_read(filp, ctx->ubuf, out + done, len - done);
+		KUNIT_ASSERT_GT(test, n, (ssize_t)0);
+	}
+	wait_for_completion(&peer->done);
+	KUNIT_EXPECT_EQ(test, peer->result, (ssize_t)len);
+	KUNIT_EXPECT_MEMEQ(test, out, peer->data, len);
+	KUNIT_EXPECT_NULL(test, ctx->dev[0].lanes[SCD_LANE_BULK].gift);
+	KUNIT_EXPECT_EQ(test, scd_test_write(filp, ctx->ubuf, "tail", 4),
+			(ssize_t)4);
+}
+
+static void scd_test_gift_nonblock(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp[0];
+
+	/* Nothing to wait for while earlier data is unread. */
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, "head", 4),
+			(ssize_t)4);
+	KUNIT_EXPECT_EQ(test, scd_test_gift(filp, ctx->peer_ubuf, "gift", 4),
+			(long)-EAGAIN);
+	KUNIT_EXPECT_EQ(test, scd_unlocked_ioctl(filp, SCD_IOGIFT, 0),
+			(long)-EFAULT);
+}
+
+/* Opening the device resets the stream, pages lent included. Their writer
+ * returns what was read, and the positions of the lane start over.
+ */
+static void scd_test_gift_reopen(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct scd_ring *ring = &ctx->dev[0].lanes[SCD_LANE_BULK];
+	struct file *filp = &ctx->filp[0];
+	struct scd_test_peer *peer;
+	struct file *reopened;
+	char out[8];
+
+	reopened = kunit_kzalloc(test, sizeof(*reopened), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, reopened);
+	reopened->f_mode = FMODE_READ;
+	reopened->f_flags = O_RDONLY | O_NONBLOCK;
+
+	peer = scd_test_start_peer(test, SCD_PEER_GIFT, 1000, 1);
+	msleep(20);
+	KUNIT_ASSERT_EQ(test, scd_test_read(filp, ctx->ubuf, out, 1),
+			(ssize_t)1);
+	KUNIT_EXPECT_FALSE(test, completion_done(&peer->done));
+
+	KUNIT_ASSERT_EQ(test, scd_open(&ctx->inode[0], reopened), 0);
+	wait_for_completion(&peer->done);
+	KUNIT_EXPECT_EQ(test, peer->result, (ssize_t)1);
+	KUNIT_EXPECT_NULL(test, ring->gift);
+	KUNIT_EXPECT_EQ(test, ring->in, 0ULL);
+
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, "tail", 4),
+			(ssize_t)4);
+	KUNIT_EXPECT_EQ(test, scd_test_read(reopened, ctx->ubuf, out,
+					    sizeof(out)), (ssize_t)4);
+	KUNIT_EXPECT_MEMEQ(test, out, "tail", 4);
+	KUNIT_EXPECT_EQ(test, ring->in, ring->out);
+	KUNIT_EXPECT_EQ(test, scd_release(&ctx->inode[0], reopened), 0);
+}
+
+/* File passing. The test thread sends and receives through descriptors of
+ * its own table.
+ */
+static long scd_test_fd_ioctl(struct kunit *test, struct file *filp,
+			      unsigned int cmd, struct scd_fd *req)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct scd_fd __user *arg = (struct scd_fd __user *)ctx->peer_ubuf;
+	long err;
+
+	KUNIT_ASSERT_EQ(test, copy_to_user(arg, req, sizeof(*req)), 0UL);
+	err = scd_unlocked_ioctl(filp, cmd, (unsigned long)arg);
+	KUNIT_ASSERT_EQ(test, copy_from_user(req, arg, sizeof(*req)), 0UL);
+	return err;
+}
+
+/* Sends file through a new descriptor, which is closed afterwards. */
+static void scd_test_send_file(struct kunit *test, struct file *filp,
+			       struct file *sent, long expect)
+{
+	struct scd_fd req = { -1, 0, 7, 42 };
+
+	req.fd = get_unused_fd_flags(O_CLOEXEC);
+	KUNIT_ASSERT_GE(test, req.fd, 0);
+	fd_install(req.fd, sent);
+	KUNIT_EXPECT_EQ(test, scd_test_fd_ioctl(test, filp, SCD_IOSENDFD,
+						&req), expect);
+	close_fd(req.fd);
+}
+
+/* Sends a new shmem file, which only the lane holds afterwards. */
+static struct file *scd_test_send(struct kunit *test, struct file *filp,
+				  long expect)
+{
+	struct file *sent;
+
+	sent = shmem_file_setup("scd_test_blob", 0, 0);
+	KUNIT_ASSERT_FALSE(test, IS_ERR(sent));
+	scd_test_send_file(test, filp, sent, expect);
+	return sent;
+}
+
+/* A file sent is received between the data written before and after it. */
+static void scd_test_fd_order(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp[0];
+	struct scd_fd req = { -1, O_CLOEXEC, 0, 0 };
+	struct file *sent, *received;
+	char out[8];
+
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, "head", 4),
+			(ssize_t)4);
+	sent = scd_test_send(test, filp, 0L);
+	KUNIT_ASSERT_EQ(test, scd_test_write(filp, ctx->ubuf, "tail", 4),
+			(ssize_t)4);
+	KUNIT_EXPECT_EQ(test, scd_poll(filp, NULL) & POLLMSG, 0U);
+	KUNIT_EXPECT_EQ(test, scd_test_fd_ioctl(test, filp, SCD_IORECVFD,
+						&req), (long)-ENODATA);
+
+	KUNIT_ASSERT_EQ(test, scd_test_read(filp, ctx->ubuf, out, sizeof(out)),
+			(ssize_t)4);
+	KUNIT_EXPECT_MEMEQ(test, out, "head", 4);
+	KUNIT_EXPECT_EQ(test, scd_poll(filp, NULL) & (POLLIN | POLLMSG),
+			(unsigned int)(POLLIN | POLLMSG));
+	KUNIT_EXPECT_EQ(test, scd_test_read(filp, ctx->ubuf, out, sizeof(out)),
+			(ssize_t)-ENOMSG);
+
+	req.flags = O_CLOEXEC;
+	KUNIT_ASSERT_EQ(test, scd_test_fd_ioctl(test, filp, SCD_IORECVFD,
+						&req), 0L);
+	KUNIT_EXPECT_EQ(test, req.offset, 7ULL);
+	KUNIT_EXPECT_EQ(test, req.len, 42ULL);
+	received = fget(req.fd);
+	KUNIT_EXPECT_PTR_EQ(test, received, sent);
+	if (received)
+		fput(received);
+	close_fd(req.fd);
+
+	KUNIT_ASSERT_EQ(test, scd_test_read(filp, ctx->ubuf, out, sizeof(out)),
+			(ssize_t)4);
+	KUNIT_EXPECT_MEMEQ(test, out, "tail", 4);
+	KUNIT_EXPECT_EQ(test, scd_test_fd_ioctl(test, filp, SCD_IORECVFD,
+						&req), (long)-ENODATA);
+}
+
+static const struct file_operations scd_test_anon_fops = {
+	.owner = THIS_MODULE,
+};
+
+/* Files which can hold the device open themselves are refused. An anon
+ * inode named as epoll names its instances stands in for one.
+ */
+static void scd_test_fd_refused(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct scd_ring *ring = &ctx->dev[0].lanes[SCD_LANE_BULK];
+	struct file *filp = &ctx->filp[0];
+	struct socket *sock;
+	struct file *sent;
+
+	KUNIT_ASSERT_EQ(test, sock_create_kern(&init_net, AF_UNIX, SOCK_STREAM,
+					       0, &sock), 0);
+	sent = sock_alloc_file(sock, 0, NULL);
+	KUNIT_ASSERT_FALSE(test, IS_ERR(sent));
+	scd_test_send_file(test, filp, sent, (long)-EINVAL);
+
+	sent = anon_inode_getfile("[eventpoll]", &scd_test_anon_fops, NULL,
+				  O_RDWR);
+	KUNIT_ASSERT_FALSE(test, IS_ERR(sent));
+	scd_test_send_file(test, filp, sent, (long)-EINVAL);
+
+	sent = anon_inode_getfile("scd_test", &scd_test_anon_fops, NULL,
+				  O_RDWR);
+	KUNIT_ASSERT_FALSE(test, IS_ERR(sent));
+	scd_test_send_file(test, filp, sent, 0L);
+	KUNIT_EXPECT_EQ(test, ring->nrefs, 1);
+}
+
+/* Bad requests fail, a full lane waits, and files left go with the lanes. */
+static void scd_test_fd_limits(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct scd_ring *ring = &ctx->dev[0].lanes[SCD_LANE_BULK];
+	struct file *filp = &ctx->filp[0];
+	struct scd_fd req = { INT_MAX, 0, 0, 0 };
+	int i;
+
+	KUNIT_EXPECT_EQ(test, scd_test_fd_ioctl(test, filp, SCD_IOSENDFD,
+						&req), (long)-EBADF);
+	req.fd = 0;
+	req.offset = ULLONG_MAX;
+	req.len = 2;
+	KUNIT_EXPECT_EQ(test, scd_test_fd_ioctl(test, filp, SCD_IOSENDFD,
+						&req), (long)-EINVAL);
+	req.flags = O_NONBLOCK;
+	KUNIT_EXPECT_EQ(test, scd_test_fd_ioctl(test, filp, SCD_IORECVFD,
+						&req), (long)-EINVAL);
+
+	for (i = 0; i < SCD_FD_MAX; ++i)
+		scd_test_send(test, filp, 0L);
+	scd_test_send(test, filp, (long)-EAGAIN);
+	KUNIT_EXPECT_EQ(test, ring->nrefs, SCD_FD_MAX);
+
+	KUNIT_EXPECT_EQ(test, scd_release(&ctx->inode[0], filp), 0);
+	KUNIT_EXPECT_EQ(test, ring->nrefs, 0);
+	filp->private_data = NULL;
+}
+
+static struct kunit_case scd_test_cases[] = {
+	KUNIT_CASE(scd_test_empty_read),
+	KUNIT_CASE(scd_test_write_read),
+	KUNIT_CASE(scd_test_freespace),
+	KUNIT_CASE(scd_test_full),
+	KUNIT_CASE(scd_test_wrap),
+	KUNIT_CASE(scd_test_bad_address),
+	KUNIT_CASE(scd_test_poll),
+	KUNIT_CASE(scd_test_ioctl),
+	KUNIT_CASE(scd_test_lane_ioctl),
+	KUNIT_CASE(scd_test_lane_order),
+	KUNIT_CASE(scd_test_lane_reader),
+	KUNIT_CASE(scd_test_busy_ioctl),
+	KUNIT_CASE(scd_test_busy_budget),
+	KUNIT_CASE(scd_test_busy_read),
+	KUNIT_CASE(scd_test_spill),
+	KUNIT_CASE(scd_test_spill_ioctl),
+	KUNIT_CASE(scd_test_lazy_alloc),
+	KUNIT_CASE(scd_test_reclaim),
+	KUNIT_CASE(scd_test_release),
+	KUNIT_CASE(scd_test_read_blocks),
+	KUNIT_CASE(scd_test_write_blocks),
+	KUNIT_CASE(scd_test_gift_order),
+	KUNIT_CASE(scd_test_gift_nonblock),
+	KUNIT_CASE(scd_test_gift_reopen),
+	KUNIT_CASE(scd_test_fd_order),
+	KUNIT_CASE(scd_test_fd_limits),
+	KUNIT_CASE(scd_test_fd_refused),
+	{ }
+};
+
+static struct kunit_suite scd_test_suite = {
+	.name = "scd",
+	.init = scd_test_init,
+	.exit = scd_test_exit,
+	.test_cases = scd_test_cases,
+};
+
+/* Microbenchmarks. They report through kunit_info and only fail if the
+ * driver does. Under User-Mode Linux absolute numbers mean little; compare
+ * runs of two builds on the same machine.
+ */
+#define SCD_BENCH_COPY_OPS 2000
+#define SCD_BENCH_LOCK_OPS 100000
+#define SCD_BENCH_PINGPONG_OPS 2000
+
+/* Nonblocking write then read of one chunk: copy and lock cost per byte. */
+static void scd_bench_copy(struct kunit *test)
+{
+	static const size_t chunks[] = { 64, 512, 4096, SCD_TEST_CHUNK_MAX };
+	struct scd_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp[0];
+	size_t c, len, done;
+	u64 start, ns;
+	ssize_t n;
+	int i;
+
+	for (c = 0; c < ARRAY_SIZE(chunks); ++c) {
+		len = chunks[c];
+		start = ktime_get_ns();
+		for (i = 0; i < SCD_BENCH_COPY_OPS; ++i) {
+			for (done = 0; done < len; done += n) {
+				n = scd_write(filp, ctx->ubuf + done,
+					      len - done, NULL);
+				KUNIT_ASSERT_GT(test, n, (ssize_t)0);
+			}
+			for (done = 0; done < len; done += n) {
+				n = scd_read(filp, ctx->ubuf + done, len - done,
+					     NULL);
+				KUNIT_ASSERT_GT(test, n, (ssize_t)0);
+			}
+		}
+		ns = ktime_get_ns() - start;
+		kunit_info(test, "copy %zu bytes: %llu ns per write and read, %llu MB/s\n",
+			   len, div_u64(ns, SCD_BENCH_COPY_OPS),
+			   div64_u64((u64)len * SCD_BENCH_COPY_OPS * 1000,
+				     ns ? ns : 1));
+	}
+}
+
+/* The fixed costs of every call: the semaphore and waking an empty queue. */
+static void scd_bench_lock(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct scd_device *dev = &ctx->dev[0];
+	u64 start, ns;
+	int i;
+
+	start = ktime_get_ns();
+	for (i = 0; i < SCD_BENCH_LOCK_OPS; ++i) {
+		KUNIT_ASSERT_EQ(test, down_interruptible(&dev->sem), 0);
+		up(&dev->sem);
+	}
+	ns = ktime_get_ns() - start;
+	kunit_info(test, "semaphore down and up: %llu ns\n",
+		   div_u64(ns, SCD_BENCH_LOCK_OPS));
+
+	start = ktime_get_ns();
+	for (i = 0; i < SCD_BENCH_LOCK_OPS; ++i)
+		wake_up_interruptible(&dev->in_queue);
+	ns = ktime_get_ns() - start;
+	kunit_info(test, "wake up without waiters: %llu ns\n",
+		   div_u64(ns, SCD_BENCH_LOCK_OPS));
+}
+
+/* One byte to a peer blocked in read and back: two sleeps and two wakeups
+ * per round trip, unless both sides busy-poll for busy us.
+ */
+static void scd_bench_round_trips(struct kunit *test, int busy)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	int __user *arg = (int __user *)(ctx->ubuf + SCD_TEST_CHUNK_MAX - 4);
+	struct scd_test_peer *peer;
+	u64 start, ns;
+	char byte = 0;
+	int i;
+
+	KUNIT_ASSERT_EQ(test, scd_test_set_busy(&ctx->filp[0], arg, busy), 0L);
+	KUNIT_ASSERT_EQ(test, scd_test_set_busy(&ctx->filp[1], arg, busy), 0L);
+	scd_test_blocking(&ctx->filp[0], true);
+	scd_test_blocking(&ctx->filp[1], true);
+	peer = scd_test_start_peer(test, SCD_PEER_ECHO, 1,
+				   SCD_BENCH_PINGPONG_OPS);
+
+	start = ktime_get_ns();
+	for (i = 0; i < SCD_BENCH_PINGPONG_OPS; ++i) {
+		KUNIT_ASSERT_EQ(test, scd_test_write(&ctx->filp[0], ctx->ubuf,
+						     &byte, 1), (ssize_t)1);
+		KUNIT_ASSERT_EQ(test, scd_test_read(&ctx->filp[1], ctx->ubuf,
+						    &byte, 1), (ssize_t)1);
+	}
+	ns = ktime_get_ns() - start;
+	wait_for_completion(&peer->done);
+	KUNIT_EXPECT_EQ(test, peer->result, (ssize_t)1);
+	kunit_info(test, "blocking round trip, busy-poll %d us: %llu ns\n",
+		   busy, div_u64(ns, SCD_BENCH_PINGPONG_OPS));
+}
+
+static void scd_bench_pingpong(struct kunit *test)
+{
+	scd_bench_round_trips(test, 0);
+	scd_bench_round_trips(test, 50);
+}
+
+/* Chunks lent by a peer and read in place, to compare with scd_bench_copy. */
+static void scd_bench_gift(struct kunit *test)
+{
+	struct scd_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp[0];
+	struct scd_test_peer *peer;
+	size_t len = SCD_TEST_GIFT_MAX, done = 0, total;
+	u64 start, ns;
+	ssize_t n;
+
+	total = len * SCD_BENCH_COPY_OPS;
+	scd_test_blocking(filp, true);
+	start = ktime_get_ns();
+	peer = scd_test_start_peer(test, SCD_PEER_GIFT, len,
+				   SCD_BENCH_COPY_OPS);
+	for (; done < total; done += n) {
+		n = scd_read(filp, ctx->ubuf, SCD_TEST_CHUNK_MAX, NULL);
+		KUNIT_ASSERT_GT(test, n, (ssize_t)0);
+	}
+	ns = ktime_get_ns() - start;
+	wait_for_completion(&peer->done);
+	KUNIT_EXPECT_EQ(test, peer->result, (ssize_t)len);
+	kunit_info(test, "gift %zu bytes: %llu ns per gift and reads, %llu MB/s\n",
+		   len, div_u64(ns, SCD_BENCH_COPY_OPS),
+		   div64_u64((u64)total * 1000, ns ? ns : 1));
+}
+
+static struct kunit_case scd_bench_cases[] = {
+	KUNIT_CASE_SLOW(scd_bench_copy),
+	KUNIT_CASE_SLOW(scd_bench_gift),
+	KUNIT_CASE_SLOW(scd_bench_lock),
+	KUNIT_CASE_SLOW(scd_bench_pingpong),
+	{ }
+};
+
+static struct kunit_suite scd_bench_suite = {
+	.name = "scd_bench",
+	.init = scd_bench_init,
+	.exit = scd_test_exit,
+	.test_cases = scd_bench_cases,
+};
+
+kunit_test_suites(&scd_test_suite, &scd_bench_suite);
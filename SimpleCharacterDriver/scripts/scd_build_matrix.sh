@@ -0,0 +1,63 @@
+#!/bin/sh
+# Builds scd as a module against each given kernel with warnings as errors,
+# with and without the KUnit suites. The driver has branches for kernels
+# before 5.11 (SCD_IOGIFT), 6.0 and 6.7 (shrinker) and 6.12 (llseek), so a
+# kernel from each range should be listed. Each build runs in a copy of the
+# driver; the suites are only built for kernels with CONFIG_KUNIT from
+# Linux 6.10 on, and the run fails if none of the kernels is one.
+#
+# Usage: scd_build_matrix.sh KDIR...
+# e.g.   scd_build_matrix.sh /lib/modules/*/build
+
+if [ -z "$1" ] || [ "$1" = "-h" ]; then
+  echo "Usage: ${0##*/} KDIR..."
+  exit 1
+fi
+
+DRIVER=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+FAILED=0
+KUNIT_BUILT=0
+
+# build KDIR NAME [make options]: 0 if the build is clean.
+build()
+{
+  KDIR=$1
+  NAME=$2
+  shift 2
+  rm -rf "$WORK/scd" && mkdir "$WORK/scd" || return 1
+  cp "$DRIVER"/Makefile "$DRIVER"/*.c "$DRIVER"/*.h "$WORK/scd" || return 1
+  if ! make -C "$KDIR" M="$WORK/scd" KCFLAGS=-Werror "$@" modules \
+      > "$WORK/build.log" 2>&1; then
+    echo "FAILED  $NAME"
+    grep -E 'error|warning' "$WORK/build.log" | head -n 20
+    return 1
+  fi
+  echo "ok      $NAME"
+}
+
+for KDIR in "$@"; do
+  RELEASE=$(make -s -C "$KDIR" kernelrelease 2> /dev/null)
+  if [ -z "$RELEASE" ]; then
+    echo "FAILED  $KDIR is not a configured kernel build directory"
+    FAILED=1
+    continue
+  fi
+  build "$KDIR" "$RELEASE" || FAILED=1
+  MAJOR=${RELEASE%%.*}
+  MINOR=${RELEASE#*.}
+  MINOR=${MINOR%%[!0-9]*}
+  if [ $((MAJOR * 256 + MINOR)) -ge $((6 * 256 + 10)) ] &&
+      grep -q '^CONFIG_KUNIT=[ym]' "$KDIR/.config" 2> /dev/null; then
+    build "$KDIR" "$RELEASE kunit" SCD_KUNIT=1 || FAILED=1
+    KUNIT_BUILT=1
+  fi
+done
+
+if [ $KUNIT_BUILT -eq 0 ]; then
+  echo "FAILED  no kernel from 6.10 with CONFIG_KUNIT, scd_test.c not built"
+  FAILED=1
+fi
+
+exit $FAILED
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Runs the KUnit suites of scd under User-Mode Linux. Neither root nor a
+# VM is needed, only a kernel source tree (Linux 6.10 or later).
+#
+# Usage: scd_kunit.sh KERNEL_TREE [kunit.py run options]
+# e.g.   scd_kunit.sh ~/src/linux --filter_attr 'speed!=slow'
+
+if [ -z "$1" ] || [ "$1" = "-h" ]; then
+  echo "Usage: ${0##*/} KERNEL_TREE [kunit.py run options]"
+  exit 1
+fi
+
+KERNEL_TREE=$(cd "$1" && pwd) || exit 1
+shift
+DRIVER=$(cd "$(dirname "$0")/.." && pwd)
+
+if [ ! -x "$KERNEL_TREE/tools/testing/kunit/kunit.py" ]; then
+  echo "$KERNEL_TREE is not a kernel source tree with KUnit"
+  exit 1
+fi
+
+# Link the driver into drivers/char, once.
+CHAR="$KERNEL_TREE/drivers/char"
+ln -sfn "$DRIVER" "$CHAR/scd" || exit 1
+if ! grep -q 'drivers/char/scd/Kconfig' "$CHAR/Kconfig"; then
+  # Before the last endmenu, inside the Character devices menu.
+  LAST=$(grep -n '^endmenu' "$CHAR/Kconfig" | tail -n 1 | cut -d: -f 1)
+  sed -i "${LAST}i source \"drivers/char/scd/Kconfig\"\n" "$CHAR/Kconfig" || exit 1
+fi
+if ! grep -q 'CONFIG_SCD)' "$CHAR/Makefile"; then
+  echo 'obj-$(CONFIG_SCD)		+= scd/' >> "$CHAR/Makefile" || exit 1
+fi
+
+# Objects of an out of tree build would be taken as up to date.
+make -C "$DRIVER" clean > /dev/null
+
+cd "$KERNEL_TREE" && exec ./tools/testing/kunit/kunit.py run \
+  --kunitconfig=drivers/char/scd "$@"
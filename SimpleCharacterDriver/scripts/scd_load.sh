@@ -7,6 +7,7 @@ MODE="666"
 GROUP=""
 MAJOR="0"
 MINOR="0"
+COUNT="1"
 
 # User must be root to proceed.
 if [ "$(id -u)" != "0" ]; then
@@ -24,15 +25,16 @@ fi
 
 show_help() {
 cat << EOF
-		Usage: ${0##*/} [-h] [-M MajorNum] [-m MinorNum]
+		Usage: ${0##*/} [-h] [-M MajorNum] [-m MinorNum] [-n Count]
 		Will load a module with predefined MajorNum and MinorNum.
        		-h          Display this help and exit
        		-M MajorNum Set desired MajorNum.
        		-m MinorNum Set desired MinorNum.
+       		-n Count    Number of devices (/dev/scd0 .. /dev/scdCount-1).
 EOF
 }
 
-while getopts "hM:m:" opt; do
+while getopts "hM:m:n:" opt; do
     case "$opt" in
     h)
         show_help
@@ -50,12 +52,18 @@ while getopts "hM:m:" opt; do
 		else echo "Minor is not a number" && show_help && exit 0
 		fi
         ;;
+    n)  TMP=$OPTARG
+		if [[ $TMP =~ ^[1-9][0-9]*$ ]]
+		then COUNT=$TMP
+		else echo "Count is not a positive number" && show_help && exit 0
+		fi
+        ;;
     esac
 done
 
 if [[ $MAJOR -eq 0 ]]
-then $INSMOD ../$MODULE.ko || exit 1
-else $INSMOD ../$MODULE.ko scd_major=$MAJOR scd_minor=$MINOR || exit 1
+then $INSMOD ../$MODULE.ko scd_dev_n=$COUNT || exit 1
+else $INSMOD ../$MODULE.ko scd_major=$MAJOR scd_minor=$MINOR scd_dev_n=$COUNT || exit 1
 fi
 
 # get major number if it is determined dynamicaly.
@@ -63,9 +71,12 @@ if [[ $MAJOR -eq 0 ]]
 then MAJOR=`cat /proc/devices | grep $MODULE | cut -d' ' -f 1`
 fi
 
-rm -f /dev/${DEVICE}
-mknod /dev/${DEVICE} c $MAJOR 0
-#ln -sf ${DEVICE}0 /dev/${DEVICE}
-chgrp $GROUP /dev/${DEVICE} 
-chmod $MODE  /dev/${DEVICE}
+# One node per device, /dev/scd stays an alias of the first one.
+rm -f /dev/${DEVICE} /dev/${DEVICE}[0-9]*
+for (( i = 0; i < COUNT; i++ )); do
+    mknod /dev/${DEVICE}$i c $MAJOR $((MINOR + i))
+    chgrp $GROUP /dev/${DEVICE}$i
+    chmod $MODE  /dev/${DEVICE}$i
+done
+ln -sf ${DEVICE}0 /dev/${DEVICE}
 
@@ -11,5 +11,5 @@ fi
 /sbin/rmmod $MODULE || exit 1
 
 # Remove stale nodes
-rm -f /dev/${DEVICE} /dev/${DEVICE}
+rm -f /dev/${DEVICE} /dev/${DEVICE}[0-9]*
 
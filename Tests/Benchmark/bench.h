@@ -0,0 +1,106 @@
+/*
+ * bench.h -- Helpers shared by SimpleCharacterDriver benchmarks
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "../../SimpleCharacterDriver/scd.h"
+#include "../Emulation/scd_emu.h"
+
+/* Parses "4K,32K,1M" style lists. */
+inline bool parseSizes(const char *arg, std::vector<int> &sizes)
+{
+    sizes.clear();
+    while (*arg) {
+        char *end;
+        long size = strtol(arg, &end, 0);
+        if (end == arg || size < 0)
+            return false;
+        if (*end == 'K' || *end == 'k') {
+            size <<= 10;
+            ++end;
+        } else if (*end == 'M' || *end == 'm') {
+            size <<= 20;
+            ++end;
+        }
+        sizes.push_back(size);
+        if (*end == ',')
+            ++end;
+        else if (*end)
+            return false;
+        arg = end;
+    }
+    return !sizes.empty();
+}
+
+/* Parses a comma separated list of names, returning indexes into names. */
+inline bool parseNames(const char *arg, const char *const *names, int count,
+                       std::vector<int> &indexes)
+{
+    indexes.clear();
+    std::string list(arg);
+    size_t start = 0;
+    while (start <= list.length()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos)
+            end = list.length();
+        std::string name = list.substr(start, end - start);
+        int i = 0;
+        while (i < count && name != names[i])
+            ++i;
+        if (i == count)
+            return false;
+        indexes.push_back(i);
+        start = end + 1;
+    }
+    return !indexes.empty();
+}
+
+/* The buffer is allocated by the first open and freed by the last close, so
+ * a new size takes effect once every descriptor is closed.
+ */
+inline bool setBufferSize(const std::string &device, int size)
+{
+    if (!size)
+        return true;
+    int fd = scd_open(device.c_str(), O_RDONLY | O_NONBLOCK);
+    if (fd == -1)
+        return false;
+    int err = scd_ioctl(fd, SCD_IOSBSIZE, &size);
+    scd_close(fd);
+    return err != -1;
+}
+
+inline void resetBufferSize(const std::string &device)
+{
+    int fd = scd_open(device.c_str(), O_RDONLY | O_NONBLOCK);
+    if (fd == -1)
+        return;
+    scd_ioctl(fd, SCD_IORBSIZE);
+    scd_close(fd);
+}
+
+#endif
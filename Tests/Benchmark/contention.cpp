@@ -0,0 +1,365 @@
+/*
+ * contention.cpp -- Multi process contention harness for SimpleCharacterDriver
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <new>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "contention.h"
+
+#define DRAIN_TIMEOUT_NS 1000000000ULL  /* No progress for this long: lost. */
+
+static void onSignal(int)
+{
+}
+
+/* Opens the device, checks in and waits until every client has. */
+static int checkIn(SharedRun *run, const std::string &device, int flags)
+{
+    int fd = scd_open(device.c_str(), flags | O_NONBLOCK);
+    if (fd == -1) {
+        ++run->failed;
+        _exit(1);
+    }
+    scd_fcntl(fd, F_SETFL, scd_fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    ++run->opened;
+    while (!run->start && !run->failed)
+        usleep(100);
+    if (run->failed)
+        _exit(1);
+    return fd;
+}
+
+static void writerProcess(SharedRun *run, const std::string &device,
+                          int index, int payload)
+{
+    ClientStats &stats = run->writers[index];
+    int fd = checkIn(run, device, O_WRONLY);
+
+    /* Random payload, with prefix sums so partial writes are accounted
+     * for without another pass over the data.
+     */
+    std::vector<unsigned char> data(payload);
+    std::vector<uint64_t> prefix(payload + 1, 0);
+    srand(getpid());
+    for (int i = 0; i < payload; ++i) {
+        data[i] = rand();
+        prefix[i + 1] = prefix[i] + data[i];
+    }
+
+    size_t off = 0;
+    while (nowNs() < run->deadline) {
+        uint64_t begin = nowNs();
+        ssize_t n = scd_write(fd, data.data() + off, payload - off);
+        stats.blocked.Record(nowNs() - begin);
+        ++stats.calls;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        stats.byteSum += prefix[off + n] - prefix[off];
+        stats.bytes += n;
+        off = (off + n) % payload;
+    }
+    scd_close(fd);
+    ++run->writersDone;
+    _exit(0);
+}
+
+/* Readers block in read. When the harness has seen every byte arrive it
+ * sets stop and interrupts them with SIGUSR1.
+ */
+static void readerProcess(SharedRun *run, const std::string &device,
+                          int index, int payload, int writers)
+{
+    ClientStats &stats = run->readers[index];
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = onSignal;
+    sigaction(SIGUSR1, &sa, NULL);      /* No SA_RESTART. */
+
+    int fd = checkIn(run, device, O_RDONLY);
+    std::vector<unsigned char> buf(payload);
+    while (!run->stop) {
+        uint64_t begin = nowNs();
+        ssize_t n = scd_read(fd, buf.data(), buf.size());
+        if (n < 0)
+            continue;
+        stats.blocked.Record(nowNs() - begin);
+        ++stats.calls;
+        if (n == 0) {
+            /* Only pipes get here, once the writers are gone. */
+            if (run->writersDone == writers)
+                usleep(1000);
+            continue;
+        }
+        uint64_t sum = 0;
+        for (ssize_t i = 0; i < n; ++i)
+            sum += buf[i];
+        stats.byteSum += sum;
+        stats.bytes += n;
+    }
+    scd_close(fd);
+    _exit(0);
+}
+
+static uint64_t totalBytes(const ClientStats *clients, int count)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < count; ++i)
+        total += clients[i].bytes;
+    return total;
+}
+
+struct RunResult {
+    bool ok;
+    bool conserved;
+    double seconds;
+    uint64_t written;
+    uint64_t read;
+};
+
+static RunResult runOnce(SharedRun *run, const std::string &device,
+                         const RunConfig &config)
+{
+    RunResult result;
+    memset(&result, 0, sizeof result);
+    new (run) SharedRun();      /* Value initialized, so all zero. */
+
+    /* Readers first, so pipes can be opened for writing without blocking. */
+    std::vector<pid_t> readers, writers;
+    for (int i = 0; i < config.readers; ++i) {
+        pid_t pid = fork();
+        if (pid == 0)
+            readerProcess(run, device, i, config.payload, config.writers);
+        readers.push_back(pid);
+    }
+    while (run->opened < config.readers && !run->failed)
+        usleep(100);
+    for (int i = 0; i < config.writers && !run->failed; ++i) {
+        pid_t pid = fork();
+        if (pid == 0)
+            writerProcess(run, device, i, config.payload);
+        writers.push_back(pid);
+    }
+    while (run->opened < config.readers + config.writers && !run->failed)
+        usleep(100);
+
+    if (!run->failed) {
+        uint64_t start = nowNs();
+        run->deadline = start + static_cast<uint64_t>(config.seconds * 1e9);
+        run->start = 1;
+
+        for (size_t i = 0; i < writers.size(); ++i)
+            waitpid(writers[i], NULL, 0);
+        result.written = totalBytes(run->writers, config.writers);
+
+        /* Let the readers drain what is left in the device. */
+        uint64_t progress = nowNs();
+        uint64_t read = totalBytes(run->readers, config.readers);
+        while (read < result.written && nowNs() - progress < DRAIN_TIMEOUT_NS) {
+            usleep(1000);
+            uint64_t now = totalBytes(run->readers, config.readers);
+            if (now != read)
+                progress = nowNs();
+            read = now;
+        }
+        result.seconds = (nowNs() - start) / 1e9;
+        result.ok = true;
+    }
+
+    run->stop = 1;
+    for (size_t i = 0; i < readers.size(); ++i) {
+        while (waitpid(readers[i], NULL, WNOHANG) == 0) {
+            kill(readers[i], SIGUSR1);
+            usleep(1000);
+        }
+    }
+    for (size_t i = 0; i < writers.size(); ++i)
+        waitpid(writers[i], NULL, 0);
+
+    result.read = totalBytes(run->readers, config.readers);
+    uint64_t sumWritten = 0, sumRead = 0;
+    for (int i = 0; i < config.writers; ++i)
+        sumWritten += run->writers[i].byteSum;
+    for (int i = 0; i < config.readers; ++i)
+        sumRead += run->readers[i].byteSum;
+    result.conserved = result.ok && result.read == result.written &&
+                       sumRead == sumWritten;
+    return result;
+}
+
+static std::string toJson(const std::string &device, const RunConfig &config,
+                          const SharedRun *run, const RunResult &result,
+                          double baseline)
+{
+    std::vector<double> writerRates, readerRates;
+    Histogram writeBlocked, readBlocked;
+    uint64_t writeCalls = 0, readCalls = 0;
+    for (int i = 0; i < config.writers; ++i) {
+        writerRates.push_back(run->writers[i].bytes / 1048576.0 /
+                              result.seconds);
+        writeBlocked.Merge(run->writers[i].blocked);
+        writeCalls += run->writers[i].calls;
+    }
+    for (int i = 0; i < config.readers; ++i) {
+        readerRates.push_back(run->readers[i].bytes / 1048576.0 /
+                              result.seconds);
+        readBlocked.Merge(run->readers[i].blocked);
+        readCalls += run->readers[i].calls;
+    }
+    double rate = result.read / 1048576.0 / result.seconds;
+
+    JsonObject obj;
+    obj.Add("device", device)
+    .Add("backend", scd_emulated() ? "shm" : "kernel")
+    .Add("writers", config.writers)
+    .Add("readers", config.readers)
+    .Add("payload", config.payload)
+    .Add("seconds", result.seconds)
+    .Add("written", result.written)
+    .Add("read", result.read)
+    .Add("conserved", result.conserved)
+    .Add("mb_per_s", rate)
+    .Add("scaling", baseline ? rate / baseline : 1.0)
+    .Add("write_calls", writeCalls)
+    .Add("read_calls", readCalls)
+    .Add("fairness_writers", jainIndex(writerRates))
+    .Add("fairness_readers", jainIndex(readerRates))
+    .Add("writer_mb_per_s", writerRates)
+    .Add("reader_mb_per_s", readerRates)
+    .Add("write_blocked_ns", writeBlocked)
+    .Add("read_blocked_ns", readBlocked);
+    return obj.Str();
+}
+
+int main(int argc, char **argv)
+{
+    std::string device = "/dev/scd";
+    double seconds = 1;
+    int bufferSize = 0;
+    std::vector<int> writerCounts, readerCounts, payloads;
+    parseSizes("1,2,4,8", writerCounts);
+    parseSizes("1,2,4,8", readerCounts);
+    parseSizes("1K,16K", payloads);
+    FILE *out = stdout;
+
+    int opt;
+    bool ok = true;
+    std::vector<int> sizes;
+    while (ok && (opt = getopt(argc, argv, "d:t:b:w:r:c:o:")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 't':
+            seconds = atof(optarg);
+            ok = seconds > 0;
+            break;
+        case 'b':
+            ok = parseSizes(optarg, sizes) && sizes.size() == 1;
+            bufferSize = ok ? sizes[0] : 0;
+            break;
+        case 'w':
+        case 'r': {
+            std::vector<int> &counts = opt == 'w' ? writerCounts : readerCounts;
+            ok = parseSizes(optarg, counts);
+            for (size_t i = 0; ok && i < counts.size(); ++i)
+                ok = counts[i] > 0 && counts[i] <= MAX_CLIENTS;
+            break;
+        }
+        case 'c':
+            ok = parseSizes(optarg, payloads);
+            for (size_t i = 0; ok && i < payloads.size(); ++i)
+                ok = payloads[i] > 0;
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            ok = out != NULL;
+            break;
+        default:
+            ok = false;
+            break;
+        }
+    }
+    if (!ok || optind != argc) {
+        fprintf(stderr, "Usage: %s [-d device] [-t seconds] [-b buffer] "
+                "[-w writers] [-r readers] [-c payloads] [-o file]\n"
+                "Lists are comma separated, e.g. -w 1,2,4,8; sizes may end "
+                "in K or M.\n", argv[0]);
+        return 1;
+    }
+
+    if (!setBufferSize(device, bufferSize)) {
+        fprintf(stderr, "Can not set buffer size %d on %s\n", bufferSize,
+                device.c_str());
+        return 1;
+    }
+
+    /* Child processes report through an anonymous shared mapping. */
+    void *map = mmap(NULL, sizeof(SharedRun), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error mapping shared memory\n");
+        return 1;
+    }
+    SharedRun *run = static_cast<SharedRun *>(map);
+
+    /* Scaling is relative to the first point with the same payload. */
+    std::map<int, double> baselines;
+    bool failed = false;
+    fprintf(out, "[\n");
+    for (size_t c = 0; c < payloads.size(); ++c)
+        for (size_t w = 0; w < writerCounts.size(); ++w)
+            for (size_t r = 0; r < readerCounts.size(); ++r) {
+                RunConfig config;
+                config.writers = writerCounts[w];
+                config.readers = readerCounts[r];
+                config.payload = payloads[c];
+                config.seconds = seconds;
+
+                RunResult result = runOnce(run, device, config);
+                if (!result.ok) {
+                    fprintf(stderr, "Error opening %s\n", device.c_str());
+                    failed = true;
+                    break;
+                }
+                failed |= !result.conserved;
+                double rate = result.read / 1048576.0 / result.seconds;
+                if (!baselines.count(config.payload))
+                    baselines[config.payload] = rate;
+                fprintf(out, "%s  %s", c || w || r ? ",\n" : "",
+                        toJson(device, config, run, result,
+                               baselines[config.payload]).c_str());
+                fflush(out);
+            }
+    fprintf(out, "\n]\n");
+
+    if (bufferSize)
+        resetBufferSize(device);
+    munmap(map, sizeof(SharedRun));
+    if (out != stdout)
+        fclose(out);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * contention.h -- Multi process contention harness for SimpleCharacterDriver
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CONTENTION_H__
+#define __CONTENTION_H__
+
+#include <atomic>
+#include <stdint.h>
+
+#include "stats.h"
+
+#define MAX_CLIENTS 64
+
+/* Statistics of one writer or reader process. */
+struct ClientStats {
+    std::atomic<uint64_t> bytes;    /* Read by the harness while running. */
+    uint64_t calls;
+    uint64_t byteSum;       /* Sum of all bytes moved, for conservation. */
+    Histogram blocked;      /* Time spent in each read or write call. */
+};
+
+/* Shared between the harness and all client processes of one run. Clients
+ * open the device, check in and wait for start: opening resets the device,
+ * so nothing may be written before every client has opened it.
+ */
+struct SharedRun {
+    std::atomic<int> opened;
+    std::atomic<int> failed;
+    std::atomic<int> start;
+    std::atomic<int> writersDone;
+    std::atomic<int> stop;
+    uint64_t deadline;      /* CLOCK_MONOTONIC ns at which writers stop. */
+    ClientStats writers[MAX_CLIENTS];
+    ClientStats readers[MAX_CLIENTS];
+};
+
+/* One point of the scaling curve. */
+struct RunConfig {
+    int writers;
+    int readers;
+    int payload;            /* Bytes per write call. */
+    double seconds;
+};
+
+#endif
@@ -0,0 +1,246 @@
+/*
+ * stats.h -- Statistics helpers for SimpleCharacterDriver benchmarks
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Log-linear histogram of nanosecond values: every power of two is split in
+ * HIST_SUB buckets, so percentiles are within about 3% at any scale and a
+ * run can record millions of samples in constant memory. It is a plain
+ * array, so it can also live in memory shared between processes.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct Histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+    double sum;
+
+    Histogram()
+    {
+        Reset();
+    }
+
+    void Reset()
+    {
+        memset(counts, 0, sizeof counts);
+        count = 0;
+        max = 0;
+        sum = 0;
+    }
+
+    static int Bucket(uint64_t value)
+    {
+        if (value < HIST_SUB)
+            return value;
+        int msb = 63 - __builtin_clzll(value);
+        int shift = msb - HIST_SUB_BITS;
+        return (shift + 1) * HIST_SUB + ((value >> shift) & (HIST_SUB - 1));
+    }
+
+    /* Largest value which falls in bucket. */
+    static uint64_t BucketTop(int bucket)
+    {
+        if (bucket < HIST_SUB)
+            return bucket;
+        int shift = bucket / HIST_SUB - 1;
+        uint64_t base = (HIST_SUB | (bucket % HIST_SUB)) << shift;
+        return base + (1ULL << shift) - 1;
+    }
+
+    void Record(uint64_t value)
+    {
+        ++counts[Bucket(value)];
+        ++count;
+        sum += value;
+        if (value > max)
+            max = value;
+    }
+
+    void Merge(const Histogram &other)
+    {
+        for (int i = 0; i < HIST_BUCKETS; ++i)
+            counts[i] += other.counts[i];
+        count += other.count;
+        sum += other.sum;
+        if (other.max > max)
+            max = other.max;
+    }
+
+    /* Value below which a fraction q of the samples fall. */
+    uint64_t Percentile(double q) const
+    {
+        if (!count)
+            return 0;
+        uint64_t rank = q * count;
+        if (rank >= count)
+            rank = count - 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < HIST_BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen > rank)
+                return BucketTop(i) < max ? BucketTop(i) : max;
+        }
+        return max;
+    }
+
+    double Mean() const
+    {
+        return count ? sum / count : 0;
+    }
+};
+
+inline uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Jain's fairness index: 1 when all shares are equal, 1/n when one client
+ * gets everything.
+ */
+inline double jainIndex(const std::vector<double> &shares)
+{
+    double sum = 0;
+    double squares = 0;
+    for (size_t i = 0; i < shares.size(); ++i) {
+        sum += shares[i];
+        squares += shares[i] * shares[i];
+    }
+    return squares ? sum * sum / (shares.size() * squares) : 0;
+}
+
+/* Minimal JSON writer, enough for flat result records. */
+class JsonObject
+{
+public:
+    JsonObject() : text("{") {}
+
+    JsonObject& Add(const char *key, const std::string &value)
+    {
+        addKey(key);
+        text += '"';
+        for (size_t i = 0; i < value.length(); ++i) {
+            if (value[i] == '"' || value[i] == '\\')
+                text += '\\';
+            text += value[i];
+        }
+        text += '"';
+        return *this;
+    }
+
+    JsonObject& Add(const char *key, const char *value)
+    {
+        return Add(key, std::string(value));
+    }
+
+    JsonObject& Add(const char *key, double value)
+    {
+        char buf[64];
+        snprintf(buf, sizeof buf, "%.6g", value);
+        addKey(key);
+        text += buf;
+        return *this;
+    }
+
+    JsonObject& Add(const char *key, uint64_t value)
+    {
+        char buf[32];
+        snprintf(buf, sizeof buf, "%llu",
+                 static_cast<unsigned long long>(value));
+        addKey(key);
+        text += buf;
+        return *this;
+    }
+
+    JsonObject& Add(const char *key, bool value)
+    {
+        addKey(key);
+        text += value ? "true" : "false";
+        return *this;
+    }
+
+    JsonObject& Add(const char *key, int value)
+    {
+        return Add(key, static_cast<uint64_t>(value));
+    }
+
+    JsonObject& Add(const char *key, const std::vector<double> &values)
+    {
+        char buf[64];
+        addKey(key);
+        text += '[';
+        for (size_t i = 0; i < values.size(); ++i) {
+            snprintf(buf, sizeof buf, "%s%.6g", i ? ", " : "", values[i]);
+            text += buf;
+        }
+        text += ']';
+        return *this;
+    }
+
+    JsonObject& Add(const char *key, const JsonObject &value)
+    {
+        addKey(key);
+        text += value.Str();
+        return *this;
+    }
+
+    /* Percentiles of a histogram, in nanoseconds. */
+    JsonObject& Add(const char *key, const Histogram &hist)
+    {
+        JsonObject obj;
+        obj.Add("count", hist.count)
+        .Add("mean", hist.Mean())
+        .Add("p50", hist.Percentile(0.5))
+        .Add("p99", hist.Percentile(0.99))
+        .Add("p999", hist.Percentile(0.999))
+        .Add("max", hist.max);
+        return Add(key, obj);
+    }
+
+    std::string Str() const
+    {
+        return text + "}";
+    }
+
+private:
+    std::string text;
+
+    void addKey(const char *key)
+    {
+        if (text.length() > 1)
+            text += ", ";
+        text += '"';
+        text += key;
+        text += "\": ";
+    }
+};
+
+#endif
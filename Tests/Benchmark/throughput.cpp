@@ -0,0 +1,341 @@
+/*
+ * throughput.cpp -- Throughput and latency benchmark for SimpleCharacterDriver
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <thread>
+#include <algorithm>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "throughput.h"
+
+static const char *modeName(IoMode mode)
+{
+    static const char *const names[] = {"blocking", "poll", "nonblock",
+                                        "gift", "busy"
+                                       };
+    return names[mode];
+}
+
+static const char *pinningName(Pinning pinning)
+{
+    static const char *const names[] = {"none", "same", "split"};
+    return names[pinning];
+}
+
+/* Pins the calling thread; side 0 is the writer, 1 the reader. */
+static void pinThread(Pinning pinning, int side)
+{
+    if (pinning == PIN_NONE)
+        return;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof allowed, &allowed) == -1)
+        return;
+    int wanted = pinning == PIN_SPLIT ? side : 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed) || wanted--)
+            continue;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof set, &set);
+        return;
+    }
+}
+
+/* Called after EAGAIN. Polling mode sleeps in poll, the non blocking mode
+ * just tries again.
+ */
+static void waitReady(int fd, short events, IoMode mode, SideStats &stats)
+{
+    if (mode != MODE_POLL)
+        return;
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    ++stats.syscalls;
+    scd_poll(&pfd, 1, -1);
+}
+
+static void fail(const char *what)
+{
+    fprintf(stderr, "%s failed, errno: %d\n", what, errno);
+    exit(1);
+}
+
+static void writerLoop(int fd, const BenchPoint &point, uint64_t deadline,
+                       SideStats &stats)
+{
+    pinThread(point.pinning, 0);
+    std::vector<char> chunk(point.chunkSize, 'x');
+    ChunkStamp stamp;
+    do {
+        stamp.sent = nowNs();
+        stamp.last = stamp.sent >= deadline;
+        memcpy(chunk.data(), &stamp, sizeof stamp);
+        size_t off = 0;
+        while (off < chunk.size()) {
+            ++stats.syscalls;
+            ssize_t n;
+            if (point.mode == MODE_GIFT) {
+                struct scd_gift gift;
+                gift.addr = reinterpret_cast<uintptr_t>(chunk.data() + off);
+                gift.len = chunk.size() - off;
+                n = scd_ioctl(fd, SCD_IOGIFT, &gift);
+            } else {
+                n = scd_write(fd, chunk.data() + off, chunk.size() - off);
+            }
+            if (n < 0) {
+                if (errno == EAGAIN) {
+                    ++stats.again;
+                    waitReady(fd, POLLOUT, point.mode, stats);
+                } else if (errno != EINTR) {
+                    fail(point.mode == MODE_GIFT ? "gift" : "write");
+                }
+                continue;
+            }
+            off += n;
+            stats.bytes += n;
+        }
+    } while (!stamp.last);
+}
+
+static void readerLoop(int fd, const BenchPoint &point, BenchResult &result)
+{
+    pinThread(point.pinning, 1);
+    SideStats &stats = result.reader;
+    std::vector<char> buf(point.chunkSize);
+    ChunkStamp stamp;
+    size_t pos = 0;             /* Position within the current chunk. */
+    bool last = false;
+
+    while (!last) {
+        ++stats.syscalls;
+        ssize_t n = scd_read(fd, buf.data(), buf.size());
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                ++stats.again;
+                waitReady(fd, POLLIN, point.mode, stats);
+            } else if (errno != EINTR) {
+                fail("read");
+            }
+            continue;
+        }
+        uint64_t now = nowNs();
+        stats.bytes += n;
+
+        const char *p = buf.data();
+        size_t left = n;
+        while (left) {
+            if (pos < sizeof stamp)
+                memcpy(reinterpret_cast<char *>(&stamp) + pos, p,
+                       std::min(left, sizeof stamp - pos));
+            size_t count = std::min(left, point.chunkSize - pos);
+            pos += count;
+            p += count;
+            left -= count;
+            if (pos == static_cast<size_t>(point.chunkSize)) {
+                result.latency.Record(now - stamp.sent);
+                ++result.chunks;
+                pos = 0;
+                last = stamp.last;
+            }
+        }
+    }
+}
+
+static BenchResult runPoint(const std::string &device, const BenchPoint &point,
+                            double seconds)
+{
+    BenchResult result;
+    memset(&result.writer, 0, sizeof result.writer);
+    memset(&result.reader, 0, sizeof result.reader);
+    result.chunks = 0;
+    result.seconds = 0;
+    result.ok = false;
+
+    if (!setBufferSize(device, point.bufferSize)) {
+        fprintf(stderr, "Can not set buffer size %d on %s\n",
+                point.bufferSize, device.c_str());
+        return result;
+    }
+
+    /* Opening resets the device, so both ends are open before any data
+     * flows. Non blocking opens also keep FIFOs usable for a dry run.
+     */
+    int readFd = scd_open(device.c_str(), O_RDONLY | O_NONBLOCK);
+    int writeFd = scd_open(device.c_str(), O_WRONLY | O_NONBLOCK);
+    if (readFd == -1 || writeFd == -1) {
+        fprintf(stderr, "Error opening %s, errno: %d\n", device.c_str(),
+                errno);
+        scd_close(readFd);
+        scd_close(writeFd);
+        return result;
+    }
+    if (point.mode == MODE_BUSY && scd_ioctl(readFd, SCD_IOSBUSY,
+                                             &point.busy) == -1) {
+        fprintf(stderr, "Can not set busy-poll budget %d on %s\n",
+                point.busy, device.c_str());
+        scd_close(readFd);
+        scd_close(writeFd);
+        return result;
+    }
+    if (point.mode != MODE_POLL && point.mode != MODE_NONBLOCK) {
+        scd_fcntl(readFd, F_SETFL, scd_fcntl(readFd, F_GETFL) & ~O_NONBLOCK);
+        scd_fcntl(writeFd, F_SETFL, scd_fcntl(writeFd, F_GETFL) & ~O_NONBLOCK);
+    }
+
+    uint64_t start = nowNs();
+    uint64_t deadline = start + static_cast<uint64_t>(seconds * 1e9);
+    std::thread writer(writerLoop, writeFd, std::cref(point), deadline,
+                       std::ref(result.writer));
+    readerLoop(readFd, point, result);
+    result.seconds = (nowNs() - start) / 1e9;
+    writer.join();
+
+    scd_close(writeFd);
+    scd_close(readFd);
+    result.ok = result.reader.bytes == result.writer.bytes;
+    return result;
+}
+
+static std::string toJson(const std::string &device, const BenchPoint &point,
+                          const BenchResult &result)
+{
+    double mb = result.reader.bytes / 1048576.0;
+    uint64_t syscalls = result.writer.syscalls + result.reader.syscalls;
+    JsonObject obj;
+    obj.Add("device", device)
+    .Add("backend", scd_emulated() ? "shm" : "kernel")
+    .Add("buffer", point.bufferSize)
+    .Add("chunk", point.chunkSize)
+    .Add("mode", modeName(point.mode))
+    .Add("pinning", pinningName(point.pinning))
+    .Add("busy_us", point.mode == MODE_BUSY ? point.busy : 0)
+    .Add("ok", result.ok)
+    .Add("seconds", result.seconds)
+    .Add("bytes", result.reader.bytes)
+    .Add("mb_per_s", result.seconds ? mb / result.seconds : 0)
+    .Add("ops_per_s", result.seconds ? result.chunks / result.seconds : 0)
+    .Add("syscalls_per_mb", mb ? syscalls / mb : 0)
+    .Add("write_syscalls", result.writer.syscalls)
+    .Add("write_again", result.writer.again)
+    .Add("read_syscalls", result.reader.syscalls)
+    .Add("read_again", result.reader.again)
+    .Add("latency_ns", result.latency);
+    return obj.Str();
+}
+
+int main(int argc, char **argv)
+{
+    static const char *const modes[] = {"blocking", "poll", "nonblock", "gift",
+                                        "busy"
+                                       };
+    static const char *const pinnings[] = {"none", "same", "split"};
+    std::string device = "/dev/scd";
+    double seconds = 1;
+    int busy = 50;
+    std::vector<int> buffers, chunks, modeList, pinList;
+    parseSizes("4K,32K,256K,1M", buffers);
+    parseSizes("64,1K,16K,64K", chunks);
+    parseNames("blocking,poll,nonblock", modes, 5, modeList);
+    parseNames("none,split", pinnings, 3, pinList);
+    FILE *out = stdout;
+
+    int opt;
+    bool ok = true;
+    while (ok && (opt = getopt(argc, argv, "d:t:b:c:m:p:u:o:")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 't':
+            seconds = atof(optarg);
+            ok = seconds > 0;
+            break;
+        case 'b':
+            ok = parseSizes(optarg, buffers);
+            break;
+        case 'c':
+            ok = parseSizes(optarg, chunks);
+            for (size_t i = 0; ok && i < chunks.size(); ++i)
+                ok = chunks[i] >= static_cast<int>(MIN_CHUNK);
+            break;
+        case 'm':
+            ok = parseNames(optarg, modes, 5, modeList);
+            break;
+        case 'p':
+            ok = parseNames(optarg, pinnings, 3, pinList);
+            break;
+        case 'u':
+            busy = atoi(optarg);
+            ok = busy > 0 && busy <= SCD_BUSY_MAX;
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            ok = out != NULL;
+            break;
+        default:
+            ok = false;
+            break;
+        }
+    }
+    if (!ok || optind != argc) {
+        fprintf(stderr, "Usage: %s [-d device] [-t seconds] [-b buffers] "
+                "[-c chunks] [-m blocking,poll,nonblock,gift,busy] "
+                "[-p none,same,split] [-u busy_us] [-o file]\n"
+                "Sizes are comma separated and may end in K or M; buffer "
+                "size 0 keeps the current size.\n", argv[0]);
+        return 1;
+    }
+
+    /* One result per line, so runs can be compared with diff tools. */
+    fprintf(out, "[\n");
+    bool first = true;
+    bool resized = false;
+    for (size_t b = 0; b < buffers.size(); ++b)
+        for (size_t c = 0; c < chunks.size(); ++c)
+            for (size_t m = 0; m < modeList.size(); ++m)
+                for (size_t p = 0; p < pinList.size(); ++p) {
+                    BenchPoint point;
+                    point.bufferSize = buffers[b];
+                    point.chunkSize = chunks[c];
+                    point.mode = static_cast<IoMode>(modeList[m]);
+                    point.pinning = static_cast<Pinning>(pinList[p]);
+                    point.busy = busy;
+                    resized |= point.bufferSize != 0;
+
+                    BenchResult result = runPoint(device, point, seconds);
+                    fprintf(out, "%s  %s", first ? "" : ",\n",
+                            toJson(device, point, result).c_str());
+                    fflush(out);
+                    first = false;
+                }
+    fprintf(out, "\n]\n");
+
+    if (resized)
+        resetBufferSize(device);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * throughput.h -- Throughput and latency benchmark for SimpleCharacterDriver
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __THROUGHPUT_H__
+#define __THROUGHPUT_H__
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "stats.h"
+
+/* How both sides wait for the device. */
+enum IoMode {
+    MODE_BLOCKING,      /* Blocking read and write. */
+    MODE_POLL,          /* O_NONBLOCK, poll after EAGAIN. */
+    MODE_NONBLOCK,      /* O_NONBLOCK, retry immediately after EAGAIN. */
+    MODE_GIFT,          /* Blocking; chunks are lent with SCD_IOGIFT. */
+    MODE_BUSY,          /* Blocking; the reader busy-polls, SCD_IOSBUSY. */
+};
+
+enum Pinning {
+    PIN_NONE,
+    PIN_SAME,           /* Writer and reader on the first CPU. */
+    PIN_SPLIT,          /* Writer on the first CPU, reader on the second. */
+};
+
+/* One point of the sweep. */
+struct BenchPoint {
+    int bufferSize;     /* Set with SCD_IOSBSIZE, 0 leaves it as it is. */
+    int chunkSize;      /* Bytes per write; each chunk is one operation. */
+    IoMode mode;
+    Pinning pinning;
+    int busy;           /* Busy-poll budget of MODE_BUSY, in us. */
+};
+
+struct SideStats {
+    uint64_t bytes;
+    uint64_t syscalls;  /* read or write, and poll. */
+    uint64_t again;     /* Calls which returned EAGAIN. */
+};
+
+struct BenchResult {
+    bool ok;
+    double seconds;
+    uint64_t chunks;
+    SideStats writer;
+    SideStats reader;
+    Histogram latency;  /* Write of a chunk started until it was read. */
+};
+
+/* Every chunk starts with the time its write started, so the reader can
+ * measure one way latency. The last chunk of a run is flagged, which ends
+ * the run in band without closing the device.
+ */
+struct ChunkStamp {
+    uint64_t sent;
+    uint64_t last;
+};
+
+#define MIN_CHUNK sizeof(ChunkStamp)
+
+#endif
@@ -21,8 +21,11 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <climits>
+#include <stdio.h>
 
 #include "../../SimpleCharacterDriver/scd.h"
+#include "../Emulation/scd_emu.h"
 
 class ScdBasicTests : public ::testing::Test
 {
@@ -37,17 +40,17 @@ protected:
 
     virtual void SetUp()
     {
-        fd = open (device_name.c_str(), O_RDONLY);
+        fd = scd_open(device_name.c_str(), O_RDONLY);
         ASSERT_NE(fd, -1);
     }
 
     virtual void TearDown()
     {
         /* Reset buffer size to default. */
-        int err = ioctl(fd, SCD_IORBSIZE);
+        int err = scd_ioctl(fd, SCD_IORBSIZE);
         ASSERT_NE(err, -1);
         /* Close file. */
-        err = close(fd);
+        err = scd_close(fd);
         ASSERT_EQ(err, 0);
     }
 
@@ -61,7 +64,7 @@ TEST_F(ScdBasicTests, OpenCloseRDONLY)
 
     std::string str ("Test");
     int len = str.length();
-    err = write(fd, str.c_str(), len);
+    err = scd_write(fd, str.c_str(), len);
     EXPECT_EQ(err, -1);
 }
 
@@ -71,7 +74,7 @@ TEST_F(ScdBasicTests, GetIOCTL)
 
     /* Get buffer size and verify its value. */
     int buf_sz;
-    err = ioctl(fd, SCD_IOGBSIZE, &buf_sz);
+    err = scd_ioctl(fd, SCD_IOGBSIZE, &buf_sz);
     EXPECT_NE(err, -1);
 
     EXPECT_EQ(SCD_BUFFER_SIZE, buf_sz);
@@ -83,12 +86,12 @@ TEST_F(ScdBasicTests, SetIOCTL)
 
     /* Set new buffer size. */
     int buf_sz = 0x4000;
-    err = ioctl(fd, SCD_IOSBSIZE, &buf_sz);
+    err = scd_ioctl(fd, SCD_IOSBSIZE, &buf_sz);
     EXPECT_NE(err, -1);
 
     /* Verify that new size has been set. */
     int get_buf_sz;
-    err = ioctl(fd, SCD_IOGBSIZE, &get_buf_sz);
+    err = scd_ioctl(fd, SCD_IOGBSIZE, &get_buf_sz);
     EXPECT_NE(err, -1);
 
     EXPECT_EQ(get_buf_sz, buf_sz);
@@ -100,25 +103,28 @@ TEST_F(ScdBasicTests, SetIOCTLOpen)
 
     /* Set new buffer size. */
     int buf_sz = 0x4000;
-    err = ioctl(fd, SCD_IOSBSIZE, &buf_sz);
+    err = scd_ioctl(fd, SCD_IOSBSIZE, &buf_sz);
     EXPECT_NE(err, -1);
 
     /* Verify that new size has been set. */
     int get_buf_sz;
-    err = ioctl(fd, SCD_IOGBSIZE, &get_buf_sz);
+    err = scd_ioctl(fd, SCD_IOGBSIZE, &get_buf_sz);
     EXPECT_NE(err, -1);
 
     EXPECT_EQ(get_buf_sz, buf_sz);
 
-    int fd2 = open (device_name.c_str(), O_RDONLY);
+    int fd2 = scd_open(device_name.c_str(), O_RDONLY);
     ASSERT_NE(fd, -1);
 
     /* Verify that new size has been set. */
     get_buf_sz;
-    err = ioctl(fd2, SCD_IOGBSIZE, &get_buf_sz);
+    err = scd_ioctl(fd2, SCD_IOGBSIZE, &get_buf_sz);
     EXPECT_NE(err, -1);
 
     EXPECT_EQ(get_buf_sz, buf_sz);
+
+    err = scd_close(fd2);
+    EXPECT_EQ(err, 0);
 }
 
 TEST_F(ScdBasicTests, ResetIOCTL)
@@ -127,24 +133,157 @@ TEST_F(ScdBasicTests, ResetIOCTL)
 
     /* Set buffer size which differs from default. */
     int buf_sz = 0x4000;
-    err = ioctl(fd, SCD_IOSBSIZE, &buf_sz);
+    err = scd_ioctl(fd, SCD_IOSBSIZE, &buf_sz);
     EXPECT_NE(err, -1);
 
     /* Verify new size. */
     int get_buf_sz;
-    err = ioctl(fd, SCD_IOGBSIZE, &get_buf_sz);
+    err = scd_ioctl(fd, SCD_IOGBSIZE, &get_buf_sz);
     EXPECT_NE(err, -1);
 
     EXPECT_EQ(get_buf_sz, buf_sz);
 
     /* Reset buffer size to default. */
-    err = ioctl(fd, SCD_IORBSIZE);
+    err = scd_ioctl(fd, SCD_IORBSIZE);
     EXPECT_NE(err, -1);
 
     /* Get new value and verify it is the same as default. */
-    err = ioctl(fd, SCD_IOGBSIZE, &get_buf_sz);
+    err = scd_ioctl(fd, SCD_IOGBSIZE, &get_buf_sz);
     EXPECT_NE(err, -1);
 
     EXPECT_EQ(SCD_BUFFER_SIZE, get_buf_sz);
 }
 
+
+TEST_F(ScdBasicTests, LaneIOCTL)
+{
+    int err;
+
+    /* Openings read all lanes and write to bulk by default. */
+    int lane = 0;
+    err = scd_ioctl(fd, SCD_IOGLANE, &lane);
+    EXPECT_NE(err, -1);
+    EXPECT_EQ(SCD_LANE_ALL, lane);
+
+    int set_lane = SCD_LANE_HIGH;
+    err = scd_ioctl(fd, SCD_IOSLANE, &set_lane);
+    EXPECT_NE(err, -1);
+    err = scd_ioctl(fd, SCD_IOGLANE, &lane);
+    EXPECT_NE(err, -1);
+    EXPECT_EQ(SCD_LANE_HIGH, lane);
+
+    /* Lanes out of range are rejected and the lane is kept. */
+    set_lane = SCD_LANES;
+    err = scd_ioctl(fd, SCD_IOSLANE, &set_lane);
+    EXPECT_EQ(err, -1);
+    EXPECT_EQ(EINVAL, errno);
+    err = scd_ioctl(fd, SCD_IOGLANE, &lane);
+    EXPECT_NE(err, -1);
+    EXPECT_EQ(SCD_LANE_HIGH, lane);
+}
+
+TEST_F(ScdBasicTests, BusyIOCTL)
+{
+    int err;
+
+    /* Openings sleep at once by default. */
+    int busy = -1;
+    err = scd_ioctl(fd, SCD_IOGBUSY, &busy);
+    EXPECT_NE(err, -1);
+    EXPECT_EQ(0, busy);
+
+    int set_busy = 50;
+    err = scd_ioctl(fd, SCD_IOSBUSY, &set_busy);
+    EXPECT_NE(err, -1);
+    err = scd_ioctl(fd, SCD_IOGBUSY, &busy);
+    EXPECT_NE(err, -1);
+    EXPECT_EQ(50, busy);
+
+    /* Budgets out of range are rejected and the budget is kept. */
+    set_busy = SCD_BUSY_MAX + 1;
+    err = scd_ioctl(fd, SCD_IOSBUSY, &set_busy);
+    EXPECT_EQ(err, -1);
+    EXPECT_EQ(EINVAL, errno);
+    set_busy = -1;
+    err = scd_ioctl(fd, SCD_IOSBUSY, &set_busy);
+    EXPECT_EQ(err, -1);
+    EXPECT_EQ(EINVAL, errno);
+    err = scd_ioctl(fd, SCD_IOGBUSY, &busy);
+    EXPECT_NE(err, -1);
+    EXPECT_EQ(50, busy);
+
+    set_busy = 0;
+    err = scd_ioctl(fd, SCD_IOSBUSY, &set_busy);
+    EXPECT_NE(err, -1);
+}
+
+TEST_F(ScdBasicTests, SpillIOCTL)
+{
+    int err;
+    FILE *file = tmpfile();
+    ASSERT_TRUE(file != NULL);
+
+    struct scd_spill spill;
+    spill.fd = fileno(file);
+    spill.watermark = 0;
+    spill.limit = 0;
+    err = scd_ioctl(fd, SCD_IOSSPILL, &spill);
+    EXPECT_NE(err, -1);
+
+    /* Spill files must be regular, readable and writable. */
+    int null_fd = open("/dev/null", O_RDWR);
+    ASSERT_NE(null_fd, -1);
+    spill.fd = null_fd;
+    err = scd_ioctl(fd, SCD_IOSSPILL, &spill);
+    EXPECT_EQ(err, -1);
+    EXPECT_EQ(EINVAL, errno);
+    close(null_fd);
+
+    spill.fd = INT_MAX;
+    err = scd_ioctl(fd, SCD_IOSSPILL, &spill);
+    EXPECT_EQ(err, -1);
+    EXPECT_EQ(EBADF, errno);
+
+    spill.fd = -1;
+    spill.watermark = -1;
+    err = scd_ioctl(fd, SCD_IOSSPILL, &spill);
+    EXPECT_EQ(err, -1);
+    EXPECT_EQ(EINVAL, errno);
+
+    struct scd_stats stats;
+    err = scd_ioctl(fd, SCD_IOGSTATS, &stats);
+    EXPECT_NE(err, -1);
+    EXPECT_EQ((unsigned int)SCD_BUFFER_SIZE, stats.lanes[SCD_LANE_BULK].size);
+    EXPECT_EQ(0U, stats.lanes[SCD_LANE_BULK].used);
+    EXPECT_EQ(0ULL, stats.lanes[SCD_LANE_BULK].spill_used);
+
+    spill.watermark = 0;
+    err = scd_ioctl(fd, SCD_IOSSPILL, &spill);
+    EXPECT_NE(err, -1);
+    fclose(file);
+}
+
+TEST_F(ScdBasicTests, FdIOCTL)
+{
+    int err;
+
+    /* Only openings for writing send files. */
+    struct scd_fd req;
+    req.fd = 0;
+    req.flags = 0;
+    req.offset = 0;
+    req.len = 0;
+    err = scd_ioctl(fd, SCD_IOSENDFD, &req);
+    EXPECT_EQ(err, -1);
+    EXPECT_EQ(EBADF, errno);
+
+    /* Nothing was sent. */
+    err = scd_ioctl(fd, SCD_IORECVFD, &req);
+    EXPECT_EQ(err, -1);
+    EXPECT_EQ(ENODATA, errno);
+
+    req.flags = O_NONBLOCK;
+    err = scd_ioctl(fd, SCD_IORECVFD, &req);
+    EXPECT_EQ(err, -1);
+    EXPECT_EQ(EINVAL, errno);
+}
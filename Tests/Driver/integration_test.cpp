@@ -22,12 +22,18 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
 #include "../../SimpleCharacterDriver/scd.h"
+#include "../Emulation/scd_emu.h"
 #include <thread>
 #include <chrono>
 #include <atomic>
 #include <iostream>
 #include <climits>
+#include <vector>
+#include <algorithm>
 
 class ScdIntegrationTests : public ::testing::TestWithParam<int>
 {
@@ -42,7 +48,7 @@ protected:
 
     virtual void SetUp()
     {
-        fd = open (device_name.c_str(), O_RDWR);
+        fd = scd_open(device_name.c_str(), O_RDWR);
         ASSERT_NE(fd, -1);
         pfd.fd = fd;
     }
@@ -50,10 +56,10 @@ protected:
     virtual void TearDown()
     {
         /* Reset buffer size to default. */
-        int err = ioctl(fd, SCD_IORBSIZE);
+        int err = scd_ioctl(fd, SCD_IORBSIZE);
         ASSERT_NE(err, -1);
         /* Close file. */
-        err = close(fd);
+        err = scd_close(fd);
         ASSERT_EQ(err, 0);
     }
 
@@ -68,13 +74,13 @@ TEST_F(ScdIntegrationTests, ReadWrite)
 
     std::thread t([&]() {
         int len = str.length();
-        int err = write(fd, str.c_str(), len);
+        int err = scd_write(fd, str.c_str(), len);
         EXPECT_NE(err, -1);
     });
 
     char buff[100];
     memset(buff, 0, sizeof buff);
-    int err = read(fd, buff, sizeof buff);
+    int err = scd_read(fd, buff, sizeof buff);
     EXPECT_NE(err, -1);
     EXPECT_EQ(str, buff);
 
@@ -96,14 +102,14 @@ TEST_F(ScdIntegrationTests, PollRead)
 
             if (do_write) {
                 int len = str.length();
-                int err = write(fd, str.c_str(), len);
+                int err = scd_write(fd, str.c_str(), len);
                 EXPECT_NE(err, -1);
             }
         }
     });
 
     /* Wait for 10 seconds. If TO occurs we'll set do_write so the thread can exit.*/
-    int err = poll(&pfd, 1, 10000);
+    int err = scd_poll(&pfd, 1, 10000);
     /* Error if TO occurs. */
     EXPECT_GT(err, 0);
 
@@ -112,7 +118,7 @@ TEST_F(ScdIntegrationTests, PollRead)
     if (pfd.revents & POLLIN) {
         char buff[100];
         memset(buff, 0, sizeof buff);
-        err = read(fd, buff, sizeof buff);
+        err = scd_read(fd, buff, sizeof buff);
         EXPECT_NE(err, -1);
         EXPECT_EQ(str, buff);
     }
@@ -127,13 +133,13 @@ TEST_F(ScdIntegrationTests, PollWrite)
 
     std::thread t([&]() {
         /* Wait for 10 seconds. */
-        int err = poll(&pfd, 1, 10000);
+        int err = scd_poll(&pfd, 1, 10000);
         /* Error if TO occurs. */
         EXPECT_GT(err, 0);
 
         if (pfd.revents & POLLOUT) {
             int len = str.length();
-            err = write(fd, str.c_str(), len);
+            err = scd_write(fd, str.c_str(), len);
             EXPECT_NE(err, -1);
             do_read = true;
         }
@@ -145,13 +151,340 @@ TEST_F(ScdIntegrationTests, PollWrite)
 
     char buff[100];
     memset(buff, 0, sizeof buff);
-    int err = read(fd, buff, sizeof buff);
+    int err = scd_read(fd, buff, sizeof buff);
     EXPECT_NE(err, -1);
     EXPECT_EQ(str, buff);
 
     t.join();
 }
 
+TEST_F(ScdIntegrationTests, HighLaneFirst)
+{
+    int err;
+
+    /* Bulk data first, then a control message. */
+    std::string bulk(1000, 'b');
+    err = scd_write(fd, bulk.c_str(), bulk.length());
+    EXPECT_EQ(err, (int)bulk.length());
+
+    int lane = SCD_LANE_HIGH;
+    err = scd_ioctl(fd, SCD_IOSLANE, &lane);
+    EXPECT_NE(err, -1);
+    std::string control ("Control");
+    err = scd_write(fd, control.c_str(), control.length());
+    EXPECT_EQ(err, (int)control.length());
+    lane = SCD_LANE_ALL;
+    err = scd_ioctl(fd, SCD_IOSLANE, &lane);
+    EXPECT_NE(err, -1);
+
+    /* POLLPRI tells the high lane has data; it is read first and alone. */
+    pfd.events = POLLIN | POLLPRI;
+    err = scd_poll(&pfd, 1, 0);
+    EXPECT_EQ(err, 1);
+    EXPECT_EQ(pfd.revents, POLLIN | POLLPRI);
+
+    char buff[2000];
+    memset(buff, 0, sizeof buff);
+    err = scd_read(fd, buff, sizeof buff);
+    EXPECT_EQ(err, (int)control.length());
+    EXPECT_EQ(control, buff);
+
+    err = scd_poll(&pfd, 1, 0);
+    EXPECT_EQ(err, 1);
+    EXPECT_EQ(pfd.revents, POLLIN);
+    memset(buff, 0, sizeof buff);
+    err = scd_read(fd, buff, sizeof buff);
+    EXPECT_EQ(err, (int)bulk.length());
+    EXPECT_EQ(bulk, buff);
+}
+
+TEST_F(ScdIntegrationTests, LaneReader)
+{
+    int err;
+
+    /* A blocked reader of the high lane is not woken by bulk data. */
+    int control_fd = scd_open(device_name.c_str(), O_RDWR);
+    ASSERT_NE(control_fd, -1);
+    int lane = SCD_LANE_HIGH;
+    err = scd_ioctl(control_fd, SCD_IOSLANE, &lane);
+    EXPECT_NE(err, -1);
+
+    std::atomic_bool done(false);
+    std::string control ("Heartbeat");
+    std::thread t([&]() {
+        char buff[100];
+        memset(buff, 0, sizeof buff);
+        int err = scd_read(control_fd, buff, sizeof buff);
+        EXPECT_EQ(err, (int)control.length());
+        EXPECT_EQ(control, buff);
+        done = true;
+    });
+
+    std::string bulk ("Bulk");
+    err = scd_write(fd, bulk.c_str(), bulk.length());
+    EXPECT_EQ(err, (int)bulk.length());
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_FALSE(done);
+
+    err = scd_write(control_fd, control.c_str(), control.length());
+    EXPECT_EQ(err, (int)control.length());
+    t.join();
+
+    /* The bulk data is still there for the other opening. */
+    char buff[100];
+    memset(buff, 0, sizeof buff);
+    err = scd_read(fd, buff, sizeof buff);
+    EXPECT_EQ(err, (int)bulk.length());
+    EXPECT_EQ(bulk, buff);
+
+    err = scd_close(control_fd);
+    EXPECT_EQ(err, 0);
+}
+
+TEST_F(ScdIntegrationTests, Gift)
+{
+    /* Larger than the buffer, starting and ending within a page. */
+    std::vector<char> data(100000 + 2 * 4096);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = i * 7;
+    const char *lent = data.data() + 1000;
+    const size_t len = 100000;
+
+    std::string head ("Head");
+    int err = scd_write(fd, head.c_str(), head.length());
+    EXPECT_EQ(err, (int)head.length());
+
+    std::thread t([&]() {
+        struct scd_gift gift;
+        gift.addr = reinterpret_cast<uintptr_t>(lent);
+        gift.len = len;
+        int err = scd_ioctl(fd, SCD_IOGIFT, &gift);
+        EXPECT_EQ(err, (int)len);
+    });
+
+    /* Data written before the gift comes first. */
+    std::vector<char> buff(len);
+    err = scd_read(fd, buff.data(), head.length());
+    EXPECT_EQ(err, (int)head.length());
+    EXPECT_EQ(0, memcmp(buff.data(), head.c_str(), head.length()));
+
+    size_t done = 0;
+    while (done < len) {
+        err = scd_read(fd, buff.data() + done, len - done);
+        ASSERT_GT(err, 0);
+        done += err;
+    }
+    EXPECT_EQ(0, memcmp(buff.data(), lent, len));
+
+    t.join();
+}
+
+TEST_F(ScdIntegrationTests, BusyPollPingPong)
+{
+    /* Requests go over the high lane, replies over bulk; both busy-poll. */
+    int request_fd = scd_open(device_name.c_str(), O_RDWR);
+    ASSERT_NE(request_fd, -1);
+    int lane = SCD_LANE_HIGH;
+    int err = scd_ioctl(request_fd, SCD_IOSLANE, &lane);
+    EXPECT_NE(err, -1);
+    lane = SCD_LANE_BULK;
+    err = scd_ioctl(fd, SCD_IOSLANE, &lane);
+    EXPECT_NE(err, -1);
+    int busy = SCD_BUSY_MAX;
+    err = scd_ioctl(fd, SCD_IOSBUSY, &busy);
+    EXPECT_NE(err, -1);
+    err = scd_ioctl(request_fd, SCD_IOSBUSY, &busy);
+    EXPECT_NE(err, -1);
+
+    const int rounds = 1000;
+    std::thread t([&]() {
+        char byte;
+        for (int i = 0; i < rounds; ++i) {
+            int err = scd_read(request_fd, &byte, 1);
+            ASSERT_EQ(err, 1);
+            err = scd_write(fd, &byte, 1);
+            ASSERT_EQ(err, 1);
+        }
+    });
+
+    for (int i = 0; i < rounds; ++i) {
+        char byte = i;
+        err = scd_write(request_fd, &byte, 1);
+        ASSERT_EQ(err, 1);
+        /* Poll spins too before reading. */
+        pfd.events = POLLIN;
+        err = scd_poll(&pfd, 1, 10000);
+        ASSERT_EQ(err, 1);
+        char echo = 0;
+        err = scd_read(fd, &echo, 1);
+        ASSERT_EQ(err, 1);
+        EXPECT_EQ(byte, echo);
+    }
+    t.join();
+
+    err = scd_close(request_fd);
+    EXPECT_EQ(err, 0);
+}
+
+TEST_F(ScdIntegrationTests, Spill)
+{
+    int spill_fd = memfd_create("scd-spill", MFD_CLOEXEC);
+    ASSERT_NE(spill_fd, -1);
+    struct scd_spill spill;
+    spill.fd = spill_fd;
+    spill.watermark = 1000;
+    spill.limit = 0;
+    int err = scd_ioctl(fd, SCD_IOSSPILL, &spill);
+    ASSERT_NE(err, -1);
+    /* The device keeps its own reference. */
+    close(spill_fd);
+
+    /* A writer which never blocks, with nobody reading. */
+    err = scd_fcntl(fd, F_SETFL, scd_fcntl(fd, F_GETFL) | O_NONBLOCK);
+    ASSERT_NE(err, -1);
+    std::vector<char> data(200000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = i * 13;
+    size_t done = 0;
+    while (done < data.size()) {
+        err = scd_write(fd, data.data() + done, data.size() - done);
+        ASSERT_GT(err, 0);
+        done += err;
+    }
+
+    struct scd_stats stats;
+    err = scd_ioctl(fd, SCD_IOGSTATS, &stats);
+    ASSERT_NE(err, -1);
+    EXPECT_EQ(1000U, stats.lanes[SCD_LANE_BULK].used);
+    EXPECT_EQ(data.size() - 1000, stats.lanes[SCD_LANE_BULK].spill_used);
+    EXPECT_EQ(data.size() - 1000, stats.lanes[SCD_LANE_BULK].spilled);
+
+    /* Read back in order, buffer first. */
+    std::vector<char> buff(data.size());
+    done = 0;
+    while (done < buff.size()) {
+        err = scd_read(fd, buff.data() + done, buff.size() - done);
+        ASSERT_GT(err, 0);
+        done += err;
+    }
+    EXPECT_TRUE(data == buff);
+    err = scd_read(fd, buff.data(), 1);
+    EXPECT_EQ(err, -1);
+    EXPECT_EQ(EAGAIN, errno);
+
+    spill.fd = -1;
+    err = scd_ioctl(fd, SCD_IOSSPILL, &spill);
+    EXPECT_NE(err, -1);
+}
+
+TEST_F(ScdIntegrationTests, LazyBuffers)
+{
+    /* Nothing is held until the first write, then the written lane only. */
+    struct scd_stats stats;
+    int err = scd_ioctl(fd, SCD_IOGSTATS, &stats);
+    ASSERT_NE(err, -1);
+    EXPECT_EQ(0ULL, stats.memory);
+    EXPECT_EQ((unsigned int)SCD_BUFFER_SIZE, stats.lanes[SCD_LANE_BULK].size);
+
+    std::string str ("Test");
+    err = scd_write(fd, str.c_str(), str.length());
+    EXPECT_EQ(err, (int)str.length());
+    err = scd_ioctl(fd, SCD_IOGSTATS, &stats);
+    ASSERT_NE(err, -1);
+    EXPECT_EQ((unsigned long long)SCD_BUFFER_SIZE, stats.memory);
+    EXPECT_EQ(str.length(), stats.lanes[SCD_LANE_BULK].used);
+    EXPECT_EQ(0U, stats.lanes[SCD_LANE_HIGH].used);
+
+    char buff[100];
+    err = scd_read(fd, buff, sizeof buff);
+    EXPECT_EQ(err, (int)str.length());
+}
+
+TEST_F(ScdIntegrationTests, SendFd)
+{
+    /* A sealed blob, of which the reader is meant to take all but a page. */
+    int blob_fd = memfd_create("scd-blob", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    ASSERT_NE(blob_fd, -1);
+    std::vector<char> data(1 << 20);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = i * 7;
+    ASSERT_EQ((ssize_t)data.size(), pwrite(blob_fd, data.data(), data.size(), 0));
+    const int seals = F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+    ASSERT_NE(-1, fcntl(blob_fd, F_ADD_SEALS, seals));
+
+    std::string head ("head"), tail ("tail");
+    int err = scd_write(fd, head.c_str(), head.length());
+    EXPECT_EQ(err, (int)head.length());
+    struct scd_fd req;
+    req.fd = blob_fd;
+    req.flags = 0;
+    req.offset = 4096;
+    req.len = data.size() - 4096;
+    err = scd_ioctl(fd, SCD_IOSENDFD, &req);
+    ASSERT_NE(err, -1);
+    /* The device keeps its own reference. */
+    close(blob_fd);
+    err = scd_write(fd, tail.c_str(), tail.length());
+    EXPECT_EQ(err, (int)tail.length());
+
+    /* Data written before the file comes first, then the file. */
+    char buff[100];
+    err = scd_read(fd, buff, sizeof buff);
+    ASSERT_EQ(err, (int)head.length());
+    EXPECT_EQ(head, std::string(buff, err));
+    pfd.events = POLLIN | POLLMSG;
+    err = scd_poll(&pfd, 1, 0);
+    EXPECT_EQ(1, err);
+    EXPECT_EQ(POLLIN | POLLMSG, pfd.revents & (POLLIN | POLLMSG));
+    err = scd_read(fd, buff, sizeof buff);
+    EXPECT_EQ(err, -1);
+    EXPECT_EQ(ENOMSG, errno);
+
+    req.fd = -1;
+    req.flags = O_CLOEXEC;
+    err = scd_ioctl(fd, SCD_IORECVFD, &req);
+    ASSERT_NE(err, -1);
+    ASSERT_GE(req.fd, 0);
+    EXPECT_EQ(4096ULL, req.offset);
+    EXPECT_EQ(data.size() - 4096, req.len);
+    EXPECT_EQ(seals, fcntl(req.fd, F_GET_SEALS));
+    EXPECT_EQ(FD_CLOEXEC, fcntl(req.fd, F_GETFD));
+    std::vector<char> blob(req.len);
+    EXPECT_EQ((ssize_t)req.len, pread(req.fd, blob.data(), req.len, req.offset));
+    EXPECT_TRUE(std::equal(blob.begin(), blob.end(), data.begin() + 4096));
+    close(req.fd);
+
+    err = scd_read(fd, buff, sizeof buff);
+    ASSERT_EQ(err, (int)tail.length());
+    EXPECT_EQ(tail, std::string(buff, err));
+}
+
+/* Files which could hold the device open themselves are refused. */
+TEST_F(ScdIntegrationTests, SendFdRefused)
+{
+    int sv[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv));
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    ASSERT_NE(ep, -1);
+
+    struct scd_fd req;
+    req.flags = 0;
+    req.offset = 0;
+    req.len = 0;
+    req.fd = sv[0];
+    EXPECT_EQ(-1, scd_ioctl(fd, SCD_IOSENDFD, &req));
+    EXPECT_EQ(EINVAL, errno);
+    req.fd = ep;
+    EXPECT_EQ(-1, scd_ioctl(fd, SCD_IOSENDFD, &req));
+    EXPECT_EQ(EINVAL, errno);
+    close(sv[0]);
+    close(sv[1]);
+    close(ep);
+
+    pfd.events = POLLIN | POLLMSG;
+    EXPECT_EQ(0, scd_poll(&pfd, 1, 0));
+}
+
 INSTANTIATE_TEST_CASE_P(IntegrationTests, ScdIntegrationTests, ::testing::Values(1, 2, 100, 101, 16384, 16385, 32768, 32769, 65536, 65537));
 TEST_P(ScdIntegrationTests, ReadWriteExchange)
 {
@@ -169,7 +502,7 @@ TEST_P(ScdIntegrationTests, ReadWriteExchange)
         int w_count = 0;
         char* current_pos = w_buff;
         while (1) {
-            w_count = write(fd, current_pos, w_len);
+            w_count = scd_write(fd, current_pos, w_len);
             EXPECT_NE(w_count, -1);
             if (w_count <= 0) /* Nothing was written or error occured. */
                 break;
@@ -183,7 +516,7 @@ TEST_P(ScdIntegrationTests, ReadWriteExchange)
     });
 
     /* Wait for 10 seconds. If TO occurs we'll set do_write so the thread can exit.*/
-    int err = poll(&pfd, 1, 10000);
+    int err = scd_poll(&pfd, 1, 10000);
     /* Error if TO occurs. */
     EXPECT_GT(err, 0);
 
@@ -191,7 +524,7 @@ TEST_P(ScdIntegrationTests, ReadWriteExchange)
         int r_len = size_read;
         int r_count = 0;
         while (r_count < size) {
-            int ret = read(fd, r_buff, r_len);
+            int ret = scd_read(fd, r_buff, r_len);
             EXPECT_NE(ret, -1);
             if (ret <= 0)
                 break;
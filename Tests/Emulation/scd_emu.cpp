@@ -0,0 +1,1088 @@
+/*
+ * scd_emu.cpp -- User space emulation of SimpleCharacterDriver
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "../../SimpleCharacterDriver/scd.h"
+#include "scd_emu.h"
+
+#define SCD_EMU_MAGIC 0x554D4553   /* "SEMU" */
+
+/* A file sent, as struct scd_ref. It is a descriptor of the process which
+ * sent it, other processes open it again through /proc. The sender keeps
+ * its duplicate until it exits then.
+ */
+struct EmuRef {
+    int pid, fd;
+    int mode;                       /* O_ACCMODE, for opening it again. */
+    int64_t pos;
+    uint64_t offset, len;
+};
+
+/* Mirror struct scd_ring and struct scd_device, with offsets instead of
+ * pointers as buffers are mapped at different addresses in each process.
+ * seq stands in for in_queue and out_queue: it changes whenever a buffer
+ * does, and waiters sleep on it with futex.
+ */
+struct EmuRing {
+    int buffersize;
+    int allocated;                  /* As begin != NULL, for stats. */
+    int read, write;
+    /* The spill file is a descriptor of the process which set it, other
+     * processes open it through /proc. spillGen tells files apart.
+     */
+    int spillPid, spillFd;
+    uint32_t spillGen;
+    int spillMark;
+    int64_t spillLimit, spillRead, spillWrite, spilled;
+    int64_t in, out;
+    EmuRef refs[SCD_FD_MAX];
+    int refHead, nrefs;
+};
+
+struct EmuDevice {
+    pthread_mutex_t sem;
+    int allocated;
+    EmuRing lanes[SCD_LANES];
+    int nreaders, nwriters;
+    int nbusy;
+    int64_t lastWrite, writeGap;    /* ns, as last_write and write_gap. */
+    std::atomic<uint32_t> seq;
+    std::atomic<int> waiters;
+};
+
+struct EmuModule {
+    uint32_t magic;
+    std::atomic<int> ready;
+    std::atomic<int> buffSz;        /* scd_buff_sz, shared by all devices. */
+    std::atomic<uint32_t> seq;      /* Changes with any device, for poll. */
+    std::atomic<int> pollers;
+    EmuDevice devices[SCD_EMU_DEVICES];
+};
+
+#define SCD_EMU_DATA   ((sizeof(EmuModule) + 4095) & ~4095UL)
+#define SCD_EMU_SIZE   (SCD_EMU_DATA + SCD_EMU_DEVICES * SCD_LANES * \
+                        (size_t) SCD_EMU_MAX_BUFFER)
+
+/* An open emulated device, per process. */
+struct EmuFile {
+    int device;
+    int flags;
+    int lane;
+    int busy;
+};
+
+static std::mutex filesMutex;
+static std::map<int, EmuFile> files;
+
+/* Spill files opened by this process, by device and lane: gen, fd. */
+static std::mutex spillMutex;
+static std::map<std::pair<int, int>, std::pair<uint32_t, int> > spillFiles;
+
+bool scd_emulated()
+{
+    static const bool emulated = getenv("SCD_BACKEND") &&
+                                 strcmp(getenv("SCD_BACKEND"), "shm") == 0;
+    return emulated;
+}
+
+/* Maps the emulated module, creating it on first use. Its state lives on,
+ * like a loaded module, until the shared memory object is removed.
+ */
+static EmuModule *module()
+{
+    static EmuModule *mod = NULL;
+    static std::once_flag once;
+    std::call_once(once, []() {
+        const char *name = getenv("SCD_EMU_NAME");
+        if (!name)
+            name = "/scd-emu";
+        bool created = true;
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+        if (fd == -1 && errno == EEXIST) {
+            created = false;
+            fd = shm_open(name, O_RDWR, 0666);
+        }
+        if (fd == -1)
+            return;
+        struct stat st;
+        if (created ? ftruncate(fd, SCD_EMU_SIZE) == -1 :
+            fstat(fd, &st) == -1 || st.st_size != (off_t) SCD_EMU_SIZE) {
+            fprintf(stderr, "scd_emu: %s does not match this build, remove "
+                    "it from /dev/shm\n", name);
+            close(fd);
+            return;
+        }
+        void *map = mmap(NULL, SCD_EMU_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+            return;
+        EmuModule *m = static_cast<EmuModule *>(map);
+
+        if (created) {
+            pthread_mutexattr_t attr;
+            pthread_mutexattr_init(&attr);
+            pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+            pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+            for (int i = 0; i < SCD_EMU_DEVICES; ++i)
+                pthread_mutex_init(&m->devices[i].sem, &attr);
+            pthread_mutexattr_destroy(&attr);
+            m->buffSz = SCD_BUFFER_SIZE;
+            m->magic = SCD_EMU_MAGIC;
+            m->ready = 1;
+        } else {
+            for (int i = 0; i < 1000 && !m->ready; ++i)
+                usleep(1000);
+            if (!m->ready || m->magic != SCD_EMU_MAGIC) {
+                munmap(map, SCD_EMU_SIZE);
+                return;
+            }
+        }
+        mod = m;
+    });
+    return mod;
+}
+
+static char *bufferOf(EmuModule *m, int device, int lane)
+{
+    return reinterpret_cast<char *>(m) + SCD_EMU_DATA +
+           (device * SCD_LANES + lane) * (size_t) SCD_EMU_MAX_BUFFER;
+}
+
+/* Emulated devices are those named scd followed by an optional number. */
+static int deviceIndex(const char *path)
+{
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    if (strncmp(name, "scd", 3) != 0)
+        return -1;
+    name += 3;
+    if (!*name)
+        return 0;
+    char *end;
+    long index = strtol(name, &end, 10);
+    if (*end || index < 0)
+        return -1;
+    return index;
+}
+
+static bool lookup(int fd, EmuFile &file)
+{
+    std::lock_guard<std::mutex> lock(filesMutex);
+    std::map<int, EmuFile>::iterator it = files.find(fd);
+    if (it == files.end())
+        return false;
+    file = it->second;
+    return true;
+}
+
+/* A process which died holding the lock leaves the device as it was. */
+static void lockDevice(EmuDevice &dev)
+{
+    if (pthread_mutex_lock(&dev.sem) == EOWNERDEAD)
+        pthread_mutex_consistent(&dev.sem);
+}
+
+static void unlockDevice(EmuDevice &dev)
+{
+    pthread_mutex_unlock(&dev.sem);
+}
+
+static int futexWait(std::atomic<uint32_t> &word, uint32_t seen,
+                     const struct timespec *timeout)
+{
+    return syscall(SYS_futex, &word, FUTEX_WAIT, seen, timeout, NULL, 0);
+}
+
+static void futexWake(std::atomic<uint32_t> &word)
+{
+    syscall(SYS_futex, &word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Called with the device locked, after its buffer changed. */
+static void changed(EmuModule *m, EmuDevice &dev)
+{
+    ++dev.seq;
+    ++m->seq;
+}
+
+/* Called after unlocking; wakes everyone, as wake_up_interruptible does. */
+static void wakeUp(EmuModule *m, EmuDevice &dev)
+{
+    if (dev.waiters)
+        futexWake(dev.seq);
+    if (m->pollers)
+        futexWake(m->seq);
+}
+
+/* Sleeps until the device changes from seen. Returns false if interrupted
+ * by a signal (EINTR, unless the handler restarts system calls).
+ */
+static bool waitChange(EmuDevice &dev, uint32_t seen)
+{
+    int ret = futexWait(dev.seq, seen, NULL);
+    --dev.waiters;
+    return !(ret == -1 && errno == EINTR);
+}
+
+static int64_t nowNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* As scd_note_write. Called with the device locked. */
+static void noteWrite(EmuDevice &dev)
+{
+    int64_t now = nowNs();
+    if (dev.lastWrite) {
+        int64_t gap = std::min<int64_t>(now - dev.lastWrite,
+                                        2LL * SCD_BUSY_MAX * 1000);
+        if (dev.writeGap)
+            dev.writeGap += (gap - dev.writeGap) / 8;
+        else
+            dev.writeGap = gap;
+    }
+    dev.lastWrite = now;
+}
+
+static void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+static int freespace(const EmuRing &ring)
+{
+    if (ring.read == ring.write)
+        return ring.buffersize - 1;
+    else if (ring.read > ring.write)
+        return ring.read - ring.write - 1;
+    else
+        return ring.buffersize - (ring.write - ring.read) - 1;
+}
+
+static int used(const EmuRing &ring)
+{
+    return ring.buffersize - 1 - freespace(ring);
+}
+
+/* As scd_spill_mark, scd_spilling, scd_readable and scd_writable. */
+static int spillMark(const EmuRing &ring)
+{
+    int full = ring.buffersize - 1;
+    return ring.spillMark ? std::min(ring.spillMark, full) : full;
+}
+
+static bool spilling(const EmuRing &ring)
+{
+    return ring.spillPid && (ring.spillRead != ring.spillWrite ||
+                             used(ring) >= spillMark(ring));
+}
+
+static bool readable(const EmuRing &ring)
+{
+    return ring.read != ring.write || ring.spillRead != ring.spillWrite ||
+           ring.nrefs;
+}
+
+static bool writable(const EmuRing &ring)
+{
+    if (spilling(ring))
+        return !ring.spillLimit ||
+               ring.spillWrite - ring.spillRead < ring.spillLimit;
+    return freespace(ring);
+}
+
+/* As scd_read_lane: the lane to read next, -1 if there is nothing. */
+static int readLane(const EmuDevice &dev, int lane)
+{
+    if (lane != SCD_LANE_ALL)
+        return readable(dev.lanes[lane]) ? lane : -1;
+    for (int i = 0; i < SCD_LANES; ++i)
+        if (readable(dev.lanes[i]))
+            return i;
+    return -1;
+}
+
+/* The spill file of a lane in this process, -1 if it can not be opened. */
+static int spillFile(int device, int lane, const EmuRing &ring)
+{
+    if (ring.spillPid == getpid())
+        return ring.spillFd;
+    std::lock_guard<std::mutex> lock(spillMutex);
+    std::pair<uint32_t, int> &cached =
+        spillFiles[std::make_pair(device, lane)];
+    if (cached.first == ring.spillGen)
+        return cached.second;
+    if (cached.first && cached.second != -1)
+        close(cached.second);
+    char path[64];
+    snprintf(path, sizeof path, "/proc/%d/fd/%d", ring.spillPid,
+             ring.spillFd);
+    cached.first = ring.spillGen;
+    cached.second = open(path, O_RDWR | O_CLOEXEC);
+    return cached.second;
+}
+
+/* As scd_read_spill and scd_write_spill. Called with the device locked. */
+static ssize_t readSpill(int device, int lane, EmuRing &ring, void *buf,
+                         size_t count)
+{
+    count = std::min<int64_t>(count, ring.spillWrite - ring.spillRead);
+    count = std::min<size_t>(count, SCD_SPILL_CHUNK);
+    if (!count)
+        return 0;
+    int fd = spillFile(device, lane, ring);
+    ssize_t n = fd == -1 ? -1 : pread(fd, buf, count, ring.spillRead);
+    if (n == 0) {
+        errno = EIO;
+        return -1;
+    }
+    if (n > 0) {
+        ring.spillRead += n;
+        if (ring.spillRead == ring.spillWrite)
+            ring.spillRead = ring.spillWrite = 0;
+    }
+    return n;
+}
+
+static ssize_t writeSpill(int device, int lane, EmuRing &ring,
+                          const void *buf, size_t count)
+{
+    if (ring.spillLimit)
+        count = std::min<int64_t>(count, ring.spillLimit -
+                                  (ring.spillWrite - ring.spillRead));
+    count = std::min<size_t>(count, SCD_SPILL_CHUNK);
+    if (!count)
+        return 0;
+    int fd = spillFile(device, lane, ring);
+    ssize_t n = fd == -1 ? -1 : pwrite(fd, buf, count, ring.spillWrite);
+    if (n == 0) {
+        errno = EIO;
+        return -1;
+    }
+    if (n > 0) {
+        ring.spillWrite += n;
+        ring.spilled += n;
+    }
+    return n;
+}
+
+/* Called with the device locked. */
+static void releaseSpill(EmuRing &ring)
+{
+    if (ring.spillPid == getpid())
+        close(ring.spillFd);
+    ring.spillPid = 0;
+    ring.spillRead = ring.spillWrite = ring.spilled = 0;
+}
+
+/* As scd_next_ref and scd_drop_refs. Called with the device locked. */
+static EmuRef *nextRef(EmuRing &ring)
+{
+    return ring.nrefs ? &ring.refs[ring.refHead] : NULL;
+}
+
+static void dropRefs(EmuRing &ring)
+{
+    EmuRef *ref;
+    while ((ref = nextRef(ring))) {
+        if (ref->pid == getpid())
+            close(ref->fd);
+        ref->pid = 0;
+        ring.refHead = (ring.refHead + 1) % SCD_FD_MAX;
+        --ring.nrefs;
+    }
+    ring.refHead = 0;
+}
+
+/* As scd_busy_budget and scd_busy_poll. The device is read unlocked, as
+ * the module does; whoever returns checks again with it locked. There is
+ * no need_resched here, so the spin yields to threads waiting for the CPU
+ * instead of stopping for them.
+ */
+static int64_t busyBudget(const EmuDevice &dev, const EmuFile &file)
+{
+    int64_t budget = file.busy * 1000LL;
+    int64_t gap = __atomic_load_n(&dev.writeGap, __ATOMIC_RELAXED);
+    if (!gap)
+        return budget;
+    if (gap > budget)
+        return 0;
+    return std::min(2 * gap, budget);
+}
+
+static bool busyPoll(const EmuDevice &dev, const EmuFile &file)
+{
+    if (!file.busy)
+        return false;
+    int64_t budget = busyBudget(dev, file), start = nowNs();
+    while (nowNs() - start < budget) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (readLane(dev, file.lane) != -1)
+            return true;
+        cpuRelax();
+        sched_yield();
+    }
+    return false;
+}
+
+static int writeLane(int lane)
+{
+    return lane == SCD_LANE_ALL ? SCD_LANE_BULK : lane;
+}
+
+static unsigned int pollMask(EmuDevice &dev, int lane)
+{
+    unsigned int mask = 0;
+    lockDevice(dev);
+    int next = readLane(dev, lane);
+    if (next != -1)
+        mask |= POLLIN | POLLRDNORM;
+    EmuRef *ref = next != -1 ? nextRef(dev.lanes[next]) : NULL;
+    if (ref && ref->pos == dev.lanes[next].out)
+        mask |= POLLMSG;
+    if (next == SCD_LANE_HIGH)
+        mask |= POLLPRI;
+    if (writable(dev.lanes[writeLane(lane)]))
+        mask |= POLLOUT | POLLWRNORM;
+    if (writable(dev.lanes[SCD_LANE_HIGH]))
+        mask |= POLLWRBAND;
+    unlockDevice(dev);
+    return mask;
+}
+
+int scd_open(const char *path, int flags)
+{
+    int index = scd_emulated() ? deviceIndex(path) : -1;
+    if (index < 0)
+        return open(path, flags);
+
+    EmuModule *m = module();
+    if (!m) {
+        errno = ENODEV;
+        return -1;
+    }
+    if (index >= SCD_EMU_DEVICES) {
+        errno = ENXIO;
+        return -1;
+    }
+
+    /* A real descriptor keeps the number unique within the process. */
+    int fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    EmuDevice &dev = m->devices[index];
+    lockDevice(dev);
+    int size = m->buffSz;
+    if (size <= 0 || size > SCD_EMU_MAX_BUFFER) {
+        unlockDevice(dev);
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    dev.allocated = 1;
+    for (int i = 0; i < SCD_LANES; ++i) {
+        if (dev.lanes[i].buffersize != size)
+            dev.lanes[i].allocated = 0;
+        dev.lanes[i].buffersize = size;
+        dev.lanes[i].read = dev.lanes[i].write = 0;
+        dev.lanes[i].spillRead = dev.lanes[i].spillWrite = 0;
+        dev.lanes[i].in = dev.lanes[i].out = 0;
+        dropRefs(dev.lanes[i]);
+    }
+    int mode = flags & O_ACCMODE;
+    if (mode == O_RDONLY || mode == O_RDWR)
+        ++dev.nreaders;
+    if (mode == O_WRONLY || mode == O_RDWR)
+        ++dev.nwriters;
+    unlockDevice(dev);
+
+    EmuFile file = { index, flags & (O_ACCMODE | O_NONBLOCK), SCD_LANE_ALL,
+                     0 };
+    std::lock_guard<std::mutex> lock(filesMutex);
+    files[fd] = file;
+    return fd;
+}
+
+int scd_close(int fd)
+{
+    EmuFile file;
+    if (!lookup(fd, file))
+        return close(fd);
+
+    EmuDevice &dev = module()->devices[file.device];
+    lockDevice(dev);
+    int mode = file.flags & O_ACCMODE;
+    if (mode == O_RDONLY || mode == O_RDWR)
+        --dev.nreaders;
+    if (mode == O_WRONLY || mode == O_RDWR)
+        --dev.nwriters;
+    if (file.busy)
+        --dev.nbusy;
+    if (dev.nreaders == 0 && dev.nwriters == 0) {
+        dev.allocated = 0;
+        for (int i = 0; i < SCD_LANES; ++i) {
+            dev.lanes[i].allocated = 0;
+            releaseSpill(dev.lanes[i]);
+            dropRefs(dev.lanes[i]);
+        }
+    }
+    unlockDevice(dev);
+
+    {
+        std::lock_guard<std::mutex> lock(filesMutex);
+        files.erase(fd);
+    }
+    return close(fd);
+}
+
+ssize_t scd_read(int fd, void *buf, size_t count)
+{
+    EmuFile file;
+    if (!lookup(fd, file))
+        return read(fd, buf, count);
+    if ((file.flags & O_ACCMODE) == O_WRONLY) {
+        errno = EBADF;
+        return -1;
+    }
+
+    EmuModule *m = module();
+    EmuDevice &dev = m->devices[file.device];
+    int lane;
+    lockDevice(dev);
+    while ((lane = readLane(dev, file.lane)) == -1) {
+        uint32_t seen = dev.seq;
+        ++dev.waiters;
+        unlockDevice(dev);
+        if (file.flags & O_NONBLOCK) {
+            --dev.waiters;
+            errno = EAGAIN;
+            return -1;
+        }
+        if (busyPoll(dev, file)) {
+            --dev.waiters;
+        } else if (!waitChange(dev, seen)) {
+            errno = EINTR;
+            return -1;
+        }
+        lockDevice(dev);
+    }
+
+    EmuRing &ring = dev.lanes[lane];
+    EmuRef *ref = nextRef(ring);
+    if (ref) {
+        if (ref->pos == ring.out) {
+            unlockDevice(dev);
+            errno = ENOMSG;
+            return -1;
+        }
+        count = std::min<int64_t>(count, ref->pos - ring.out);
+    }
+    if (ring.read == ring.write) {
+        ssize_t ret = readSpill(file.device, lane, ring, buf, count);
+        if (ret > 0) {
+            ring.out += ret;
+            changed(m, dev);
+        }
+        unlockDevice(dev);
+        wakeUp(m, dev);
+        return ret;
+    }
+    if (ring.write > ring.read)
+        count = std::min(count, (size_t) (ring.write - ring.read));
+    else
+        count = std::min(count, (size_t) (ring.buffersize - ring.read));
+    memcpy(buf, bufferOf(m, file.device, lane) + ring.read, count);
+    ring.read += count;
+    if (ring.read == ring.buffersize)
+        ring.read = 0;
+    ring.out += count;
+    changed(m, dev);
+    unlockDevice(dev);
+
+    wakeUp(m, dev);
+    return count;
+}
+
+ssize_t scd_write(int fd, const void *buf, size_t count)
+{
+    EmuFile file;
+    if (!lookup(fd, file))
+        return write(fd, buf, count);
+    if ((file.flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+
+    EmuModule *m = module();
+    EmuDevice &dev = m->devices[file.device];
+    int lane = writeLane(file.lane);
+    EmuRing &ring = dev.lanes[lane];
+    lockDevice(dev);
+    while (!writable(ring)) {
+        uint32_t seen = dev.seq;
+        ++dev.waiters;
+        unlockDevice(dev);
+        if (file.flags & O_NONBLOCK) {
+            --dev.waiters;
+            errno = EAGAIN;
+            return -1;
+        }
+        if (!waitChange(dev, seen)) {
+            errno = EINTR;
+            return -1;
+        }
+        lockDevice(dev);
+    }
+
+    if (spilling(ring)) {
+        ssize_t ret = writeSpill(file.device, lane, ring, buf, count);
+        if (ret > 0) {
+            ring.in += ret;
+            if (dev.nbusy)
+                noteWrite(dev);
+            changed(m, dev);
+        }
+        unlockDevice(dev);
+        wakeUp(m, dev);
+        return ret;
+    }
+
+    if (ring.write >= ring.read) {
+        if (ring.read == 0)
+            count = std::min(count, (size_t) (ring.buffersize - ring.write - 1));
+        else
+            count = std::min(count, (size_t) (ring.buffersize - ring.write));
+    } else {
+        count = std::min(count, (size_t) (ring.read - ring.write - 1));
+    }
+    if (ring.spillPid)
+        count = std::min(count, (size_t) (spillMark(ring) - used(ring)));
+    ring.allocated = 1;
+    memcpy(bufferOf(m, file.device, lane) + ring.write, buf, count);
+    ring.write += count;
+    if (ring.write == ring.buffersize)
+        ring.write = 0;
+    ring.in += count;
+    if (dev.nbusy)
+        noteWrite(dev);
+    changed(m, dev);
+    unlockDevice(dev);
+
+    wakeUp(m, dev);
+    return count;
+}
+
+static int gift(int fd, const struct scd_gift &req)
+{
+    const char *data = reinterpret_cast<const char *>(req.addr);
+    size_t len = std::min<unsigned long long>(req.len, SCD_GIFT_MAX);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = scd_write(fd, data + done, len - done);
+        if (n >= 0) {
+            done += n;
+        } else if (errno == EAGAIN && done) {
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            scd_poll(&pfd, 1, -1);
+        } else {
+            return done ? done : -1;
+        }
+    }
+    return done;
+}
+
+/* As scd_holds_files: sockets, epoll and io_uring instances. */
+static bool holdsFiles(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode))
+        return true;
+    char path[64], target[64];
+    snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(path, target, sizeof target - 1);
+    if (len < 0)
+        return false;
+    target[len] = '\0';
+    return strcmp(target, "anon_inode:[eventpoll]") == 0 ||
+           strcmp(target, "anon_inode:[io_uring]") == 0;
+}
+
+/* As scd_send_fd. Gifts are written through the buffer, so only the
+ * number of files waits.
+ */
+static int sendFd(const EmuFile &file, const struct scd_fd &req)
+{
+    EmuFile sent;
+    if ((file.flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+    if (req.offset + req.len < req.offset || lookup(req.fd, sent) ||
+        holdsFiles(req.fd)) {
+        errno = EINVAL;
+        return -1;
+    }
+    int mode = fcntl(req.fd, F_GETFL);
+    int dup = fcntl(req.fd, F_DUPFD_CLOEXEC, 0);
+    if (mode == -1 || dup == -1)
+        return -1;
+
+    EmuModule *m = module();
+    EmuDevice &dev = m->devices[file.device];
+    EmuRing &ring = dev.lanes[writeLane(file.lane)];
+    lockDevice(dev);
+    while (ring.nrefs == SCD_FD_MAX) {
+        uint32_t seen = dev.seq;
+        ++dev.waiters;
+        unlockDevice(dev);
+        int err = 0;
+        if (file.flags & O_NONBLOCK) {
+            --dev.waiters;
+            err = EAGAIN;
+        } else if (!waitChange(dev, seen)) {
+            err = EINTR;
+        }
+        if (err) {
+            close(dup);
+            errno = err;
+            return -1;
+        }
+        lockDevice(dev);
+    }
+
+    EmuRef &ref = ring.refs[(ring.refHead + ring.nrefs) % SCD_FD_MAX];
+    ref.pid = getpid();
+    ref.fd = dup;
+    ref.mode = mode & O_ACCMODE;
+    ref.pos = ring.in;
+    ref.offset = req.offset;
+    ref.len = req.len;
+    ++ring.nrefs;
+    if (dev.nbusy)
+        noteWrite(dev);
+    changed(m, dev);
+    unlockDevice(dev);
+    wakeUp(m, dev);
+    return 0;
+}
+
+/* As scd_recv_fd; returns an errno. Called with the device locked. */
+static int recvFd(EmuDevice &dev, const EmuFile &file, struct scd_fd &req)
+{
+    if ((file.flags & O_ACCMODE) == O_WRONLY)
+        return EBADF;
+    if (req.flags & ~O_CLOEXEC)
+        return EINVAL;
+    int lane = readLane(dev, file.lane);
+    EmuRef *ref = lane != -1 ? nextRef(dev.lanes[lane]) : NULL;
+    if (!ref || ref->pos != dev.lanes[lane].out)
+        return ENODATA;
+
+    int fd = ref->fd;
+    if (ref->pid == getpid()) {
+        if (!(req.flags & O_CLOEXEC) && fcntl(fd, F_SETFD, 0) == -1)
+            return errno;
+    } else {
+        char path[64];
+        snprintf(path, sizeof path, "/proc/%d/fd/%d", ref->pid, ref->fd);
+        fd = open(path, ref->mode | (req.flags & O_CLOEXEC));
+        if (fd == -1)
+            return errno;
+    }
+    req.fd = fd;
+    req.offset = ref->offset;
+    req.len = ref->len;
+
+    EmuRing &ring = dev.lanes[lane];
+    ref->pid = 0;
+    ring.refHead = (ring.refHead + 1) % SCD_FD_MAX;
+    --ring.nrefs;
+    return 0;
+}
+
+/* As scd_ioctl_spill; returns an errno. */
+static int setSpill(EmuRing &ring, const struct scd_spill &req)
+{
+    if (req.watermark < 0 || (long long) req.limit < 0)
+        return EINVAL;
+    if (ring.spillRead != ring.spillWrite)
+        return EBUSY;
+
+    int spill = -1;
+    if (req.fd >= 0) {
+        struct stat st;
+        if (fstat(req.fd, &st) == -1)
+            return EBADF;
+        int flags = fcntl(req.fd, F_GETFL);
+        if (!S_ISREG(st.st_mode) || (flags & O_ACCMODE) != O_RDWR ||
+            (flags & O_APPEND))
+            return EINVAL;
+        spill = fcntl(req.fd, F_DUPFD_CLOEXEC, 0);
+        if (spill == -1)
+            return errno;
+    }
+
+    releaseSpill(ring);
+    if (spill != -1) {
+        ring.spillPid = getpid();
+        ring.spillFd = spill;
+        ++ring.spillGen;
+    }
+    ring.spillMark = req.watermark;
+    ring.spillLimit = req.limit;
+    return 0;
+}
+
+static void getStats(const EmuDevice &dev, struct scd_stats &stats)
+{
+    memset(&stats, 0, sizeof stats);
+    for (int i = 0; i < SCD_LANES && dev.allocated; ++i) {
+        const EmuRing &ring = dev.lanes[i];
+        if (ring.allocated)
+            stats.memory += ring.buffersize;
+        stats.lanes[i].size = ring.buffersize;
+        stats.lanes[i].used = used(ring);
+        stats.lanes[i].spill_used = ring.spillWrite - ring.spillRead;
+        stats.lanes[i].spilled = ring.spilled;
+    }
+}
+
+int scd_ioctl(int fd, unsigned long cmd, ...)
+{
+    va_list ap;
+    va_start(ap, cmd);
+    unsigned long arg = va_arg(ap, unsigned long);
+    va_end(ap);
+
+    EmuFile file;
+    if (!lookup(fd, file))
+        return ioctl(fd, cmd, arg);
+
+    if (_IOC_TYPE(cmd) != SCD_IOMAGIC || _IOC_NR(cmd) > SCD_IOMAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* There are no pages to lend here: gifts are written through the
+     * buffer, and like in the module the call returns once all is taken.
+     */
+    if (cmd == SCD_IOGIFT)
+        return gift(fd, *reinterpret_cast<const struct scd_gift *>(arg));
+    if (cmd == SCD_IOSENDFD)
+        return sendFd(file, *reinterpret_cast<const struct scd_fd *>(arg));
+
+    EmuModule *m = module();
+    EmuDevice &dev = m->devices[file.device];
+    int err = 0, lane, busy;
+    lockDevice(dev);
+    switch (cmd) {
+    case SCD_IORBSIZE:
+        m->buffSz = SCD_BUFFER_SIZE;
+        break;
+    case SCD_IOGBSIZE:
+        *reinterpret_cast<int *>(arg) = m->buffSz;
+        break;
+    case SCD_IOSBSIZE:
+        m->buffSz = *reinterpret_cast<int *>(arg);
+        break;
+    case SCD_IOSLANE:
+        lane = *reinterpret_cast<int *>(arg);
+        if (lane != SCD_LANE_ALL && (lane < 0 || lane >= SCD_LANES)) {
+            err = EINVAL;
+        } else {
+            std::lock_guard<std::mutex> lock(filesMutex);
+            files[fd].lane = lane;
+        }
+        break;
+    case SCD_IOGLANE:
+        *reinterpret_cast<int *>(arg) = file.lane;
+        break;
+    case SCD_IOSBUSY:
+        busy = *reinterpret_cast<int *>(arg);
+        if (busy < 0 || busy > SCD_BUSY_MAX) {
+            err = EINVAL;
+        } else {
+            if (busy && !file.busy && !dev.nbusy++)
+                dev.lastWrite = dev.writeGap = 0;
+            if (!busy && file.busy)
+                --dev.nbusy;
+            std::lock_guard<std::mutex> lock(filesMutex);
+            files[fd].busy = busy;
+        }
+        break;
+    case SCD_IOGBUSY:
+        *reinterpret_cast<int *>(arg) = file.busy;
+        break;
+    case SCD_IOSSPILL:
+        err = setSpill(dev.lanes[writeLane(file.lane)],
+                       *reinterpret_cast<const struct scd_spill *>(arg));
+        if (!err)
+            changed(m, dev);
+        break;
+    case SCD_IOGSTATS:
+        getStats(dev, *reinterpret_cast<struct scd_stats *>(arg));
+        break;
+    case SCD_IORECVFD:
+        err = recvFd(dev, file, *reinterpret_cast<struct scd_fd *>(arg));
+        if (!err)
+            changed(m, dev);
+        break;
+    }
+    unlockDevice(dev);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/* Emulated descriptors can not be mixed with others in one call. */
+int scd_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    std::vector<EmuFile> opened(nfds);
+    nfds_t emulated = 0;
+    for (nfds_t i = 0; i < nfds; ++i)
+        if (fds[i].fd >= 0 && lookup(fds[i].fd, opened[i]))
+            ++emulated;
+    if (!emulated)
+        return poll(fds, nfds, timeout);
+    if (emulated != nfds) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    EmuModule *m = module();
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    /* With one device its own counter is enough, otherwise wait for any. */
+    std::atomic<uint32_t> &word = nfds == 1 ? m->devices[opened[0].device].seq :
+                                  m->seq;
+    std::atomic<int> &waiters = nfds == 1 ? m->devices[opened[0].device].waiters :
+                                m->pollers;
+    bool spun = false;
+    while (1) {
+        uint32_t seen = word;
+        ++waiters;
+        int ready = 0;
+        for (nfds_t i = 0; i < nfds; ++i) {
+            fds[i].revents = pollMask(m->devices[opened[i].device],
+                                      opened[i].lane) &
+                             (fds[i].events | POLLERR | POLLHUP);
+            if (fds[i].revents)
+                ++ready;
+        }
+        if (ready || timeout == 0) {
+            --waiters;
+            return ready;
+        }
+
+        /* Busy-polling descriptors spin once before the first sleep. */
+        if (!spun) {
+            spun = true;
+            bool spin = false;
+            for (nfds_t i = 0; i < nfds && !spin; ++i)
+                spin = (fds[i].events & POLLIN) &&
+                       busyPoll(m->devices[opened[i].device], opened[i]);
+            if (spin) {
+                --waiters;
+                continue;
+            }
+        }
+
+        struct timespec left, *wait = NULL;
+        if (timeout > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left.tv_sec = deadline.tv_sec - now.tv_sec;
+            left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (left.tv_nsec < 0) {
+                --left.tv_sec;
+                left.tv_nsec += 1000000000L;
+            }
+            if (left.tv_sec < 0) {
+                --waiters;
+                return 0;
+            }
+            wait = &left;
+        }
+        int ret = futexWait(word, seen, wait);
+        --waiters;
+        if (ret == -1 && errno == EINTR)
+            return -1;
+    }
+}
+
+int scd_fcntl(int fd, int cmd, ...)
+{
+    va_list ap;
+    va_start(ap, cmd);
+    long arg = va_arg(ap, long);
+    va_end(ap);
+
+    EmuFile file;
+    if (!lookup(fd, file))
+        return fcntl(fd, cmd, arg);
+
+    std::lock_guard<std::mutex> lock(filesMutex);
+    switch (cmd) {
+    case F_GETFL:
+        return files[fd].flags;
+    case F_SETFL:
+        files[fd].flags = (files[fd].flags & ~O_NONBLOCK) | (arg & O_NONBLOCK);
+        return 0;
+    default:
+        return fcntl(fd, cmd, arg);
+    }
+}
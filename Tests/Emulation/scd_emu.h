@@ -0,0 +1,52 @@
+/*
+ * scd_emu.h -- User space emulation of SimpleCharacterDriver
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SCD_EMU_H__
+#define __SCD_EMU_H__
+
+#include <poll.h>
+#include <sys/types.h>
+
+/* Tests and benchmarks call these instead of the system calls. Normally
+ * they are the system calls. With SCD_BACKEND=shm in the environment,
+ * opening a device whose name starts with "scd" opens an emulated device
+ * instead: the same circular buffer, blocking, poll and ioctl behaviour as
+ * the module, kept in shared memory (SCD_EMU_NAME, /scd-emu by default) so
+ * separate processes exchange data as through the module. Devices are
+ * numbered by the digits ending their name, /dev/scd being /dev/scd0.
+ *
+ * Emulated descriptors are real descriptors (of /dev/null) so their numbers
+ * do not clash, but they are not shared over fork: a child has to open the
+ * device itself.
+ */
+#define SCD_EMU_DEVICES    16
+#define SCD_EMU_MAX_BUFFER (4 << 20)   /* The largest kmalloc. */
+
+int scd_open(const char *path, int flags);
+int scd_close(int fd);
+ssize_t scd_read(int fd, void *buf, size_t count);
+ssize_t scd_write(int fd, const void *buf, size_t count);
+int scd_ioctl(int fd, unsigned long cmd, ...);
+int scd_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int scd_fcntl(int fd, int cmd, ...);
+
+/* True if devices are emulated. */
+bool scd_emulated();
+
+#endif
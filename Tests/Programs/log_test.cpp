@@ -0,0 +1,119 @@
+/*
+ * log_test.cpp -- Tests for the logging shared by the programs
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <string>
+#include <fstream>
+#include <thread>
+#include <chrono>
+
+#include "../../Programs/log.h"
+
+/* Runs body in a child and returns what it logged. The log thread writes
+ * everything which is left when the child exits.
+ */
+static std::string logOf(void (*body)())
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        return "";
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDERR_FILENO);
+        body();
+        exit(0);
+    }
+    close(fds[1]);
+    std::string log;
+    char buffer[4096];
+    ssize_t count;
+    while ((count = read(fds[0], buffer, sizeof buffer)) > 0)
+        log.append(buffer, count);
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    return log;
+}
+
+static int logged()
+{
+    LOGERR() << "inner";
+    return 42;
+}
+
+static void nested()
+{
+    LOGERR() << "outer " << logged() << " end";
+    LOGERR() << "after";
+}
+
+/* A statement which logs while its record is being written. */
+TEST(ScdLogTests, Nested)
+{
+    std::string log = logOf(nested);
+    EXPECT_NE(std::string::npos, log.find("outer 42 end\n")) << log;
+    EXPECT_NE(std::string::npos, log.find("after\n")) << log;
+}
+
+/* Voluntary context switches of all threads of this process. */
+static long switches()
+{
+    long total = 0;
+    DIR *dir = opendir("/proc/self/task");
+    if (!dir)
+        return -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        std::ifstream status((std::string("/proc/self/task/") +
+                              entry->d_name + "/status").c_str());
+        std::string line;
+        while (std::getline(status, line))
+            if (line.compare(0, 24, "voluntary_ctxt_switches:") == 0)
+                total += atol(line.c_str() + 24);
+    }
+    closedir(dir);
+    return total;
+}
+
+static void idle()
+{
+    LOGERR() << "first";
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    long before = switches();
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    long after = switches();
+    LOGERR() << "woken " << after - before;
+}
+
+/* The log thread sleeps while there is nothing to write. */
+TEST(ScdLogTests, Idle)
+{
+    std::string log = logOf(idle);
+    size_t pos = log.find("woken ");
+    ASSERT_NE(std::string::npos, pos) << log;
+    EXPECT_LT(atol(log.c_str() + pos + 6), 5) << log;
+    EXPECT_NE(std::string::npos, log.find("first\n")) << log;
+}
@@ -0,0 +1,390 @@
+/*
+ * programs_test.cpp -- Tests for the writer and reader programs
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+
+#include "../../Programs/protocol.h"
+
+/* The programs run as they are built in Programs. Regular files stand in
+ * for the devices: the writer appends its frames to them, and the reader
+ * reads them up to the end and exits. Cutting and joining such files
+ * replays what a reader sees when it opens a device at some point.
+ */
+class ScdProgramsTests : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+        char dir[] = "/tmp/scd-programs-XXXXXX";
+        ASSERT_TRUE(mkdtemp(dir) != NULL);
+        tmp = dir;
+        ASSERT_EQ(0, mkdir((tmp + "/in").c_str(), 0755));
+        ASSERT_EQ(0, mkdir((tmp + "/out").c_str(), 0755));
+        writer = -1;
+    }
+
+    virtual void TearDown()
+    {
+        stopWriter();
+        std::string cmd = "rm -rf " + tmp;
+        EXPECT_EQ(0, system(cmd.c_str()));
+    }
+
+    /* Runs a program with its log in tmp/<log>. */
+    pid_t start(const std::string &program,
+                const std::vector<std::string> &args, const std::string &log)
+    {
+        std::string path = std::string(PROGRAMS_DIR) + "/" + program;
+        std::vector<char *> argv;
+        argv.push_back(const_cast<char *>(path.c_str()));
+        for (size_t i = 0; i < args.size(); ++i)
+            argv.push_back(const_cast<char *>(args[i].c_str()));
+        argv.push_back(NULL);
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            int fd = open((tmp + "/" + log).c_str(),
+                          O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (fd != -1)
+                dup2(fd, STDERR_FILENO);
+            execv(path.c_str(), argv.data());
+            _exit(127);
+        }
+        return pid;
+    }
+
+    /* Starts the writer on devs, watching tmp/in, once it is watching. */
+    void startWriter(const std::vector<std::string> &opts,
+                     const std::vector<std::string> &devs)
+    {
+        std::vector<std::string> args(opts);
+        for (size_t i = 0; i < devs.size(); ++i)
+            writeFile(devs[i], "");
+        args.push_back(devs.size() == 1 ? devs[0] :
+                       devs[0].substr(0, devs[0].length() - 1));
+        args.push_back(tmp + "/in");
+        writer = start("Writer/writer", args, "writer.log");
+        ASSERT_GT(writer, 0);
+        /* The hello goes out before the folder is watched. */
+        waitStable(devs);
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+
+    void stopWriter()
+    {
+        if (writer <= 0)
+            return;
+        kill(writer, SIGTERM);
+        waitpid(writer, NULL, 0);
+        writer = -1;
+    }
+
+    /* Runs the reader over devs until their end, returns its exit code. */
+    int runReader(const std::vector<std::string> &opts,
+                  const std::vector<std::string> &devs)
+    {
+        std::vector<std::string> args(opts);
+        args.push_back(devs.size() == 1 ? devs[0] :
+                       devs[0].substr(0, devs[0].length() - 1));
+        args.push_back(tmp + "/out");
+        pid_t pid = start("Reader/reader", args, "reader.log");
+        int status = -1;
+        waitpid(pid, &status, 0);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+
+    /* Device names: tmp/name, or tmp/name0 to tmp/nameN-1 with stripes. */
+    std::vector<std::string> devices(const std::string &name, int stripes)
+    {
+        std::vector<std::string> devs;
+        if (!stripes)
+            devs.push_back(tmp + "/" + name);
+        for (int i = 0; i < stripes; ++i) {
+            std::ostringstream dev;
+            dev << tmp << "/" << name << i;
+            devs.push_back(dev.str());
+        }
+        return devs;
+    }
+
+    /* Waits until the writer wrote something and then stopped writing. */
+    void waitStable(const std::vector<std::string> &devs)
+    {
+        off_t last = -1;
+        for (int i = 0; i < 200; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            off_t total = 0;
+            for (size_t d = 0; d < devs.size(); ++d)
+                total += fileSize(devs[d]);
+            if (total && total == last)
+                return;
+            last = total;
+        }
+        FAIL() << "Writer did not settle";
+    }
+
+    /* Adds a file to the watched folder and waits until it was sent. */
+    void send(const std::string &name, const std::string &data,
+              const std::vector<std::string> &devs)
+    {
+        writeFile(tmp + "/in/" + name, data);
+        waitStable(devs);
+    }
+
+    /* Length of the first count frames in data. */
+    static size_t frameEnd(const std::string &data, int count)
+    {
+        size_t end = 0;
+        for (int i = 0; i < count && end + sizeof(FrameHeader) <= data.size();
+             ++i) {
+            FrameHeader hdr;
+            memcpy(&hdr, data.data() + end, sizeof hdr);
+            end += sizeof hdr + hdr.nameLen + hdr.payloadLen;
+        }
+        return std::min(end, data.size());
+    }
+
+    static off_t fileSize(const std::string &path)
+    {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 ? st.st_size : -1;
+    }
+
+    static void writeFile(const std::string &path, const std::string &data)
+    {
+        std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+        out << data;
+    }
+
+    static std::string readFile(const std::string &path)
+    {
+        std::ifstream in(path.c_str(), std::ios::binary);
+        std::ostringstream data;
+        data << in.rdbuf();
+        return data.str();
+    }
+
+    static bool exists(const std::string &path)
+    {
+        return access(path.c_str(), F_OK) == 0;
+    }
+
+    /* Text which compresses well, different for each seed. */
+    static std::string text(size_t len, int seed)
+    {
+        std::ostringstream data;
+        for (int i = 0; data.tellp() < static_cast<std::streamoff>(len); ++i)
+            data << "line " << seed << " " << i << "\n";
+        return data.str().substr(0, len);
+    }
+
+    std::string tmp;
+    pid_t writer;
+};
+
+TEST_F(ScdProgramsTests, SendFiles)
+{
+    std::vector<std::string> dev = devices("scd", 0);
+    startWriter(std::vector<std::string>(), dev);
+    std::string a = text(100000, 1), b = text(10, 2);
+    send("a", a, dev);
+    send("b", b, dev);
+    stopWriter();
+
+    EXPECT_EQ(0, runReader(std::vector<std::string>(), dev));
+    EXPECT_EQ(a, readFile(tmp + "/out/a"));
+    EXPECT_EQ(b, readFile(tmp + "/out/b"));
+}
+
+/* Opening the device resets it, so a reader started after the writer never
+ * sees the hello; compressed files must arrive all the same.
+ */
+TEST_F(ScdProgramsTests, ReaderAfterWriter)
+{
+    std::vector<std::string> dev = devices("scd", 0);
+    std::vector<std::string> opts(1, "-c");
+    startWriter(opts, dev);
+    std::string a = text(100000, 1), b = text(100000, 2);
+    send("a", a, dev);
+    off_t opened = fileSize(dev[0]);
+    send("b", b, dev);
+    stopWriter();
+
+    std::string late = tmp + "/late";
+    writeFile(late, readFile(dev[0]).substr(opened));
+    EXPECT_LT(fileSize(late), static_cast<off_t>(b.size()));
+    EXPECT_EQ(0, runReader(std::vector<std::string>(),
+                           std::vector<std::string>(1, late)));
+    EXPECT_FALSE(exists(tmp + "/out/a"));
+    EXPECT_EQ(b, readFile(tmp + "/out/b"));
+}
+
+/* A new writer on striped devices: one device may deliver frames of the new
+ * stream while another still delivers the end of the old one.
+ */
+TEST_F(ScdProgramsTests, NewWriterStriped)
+{
+    std::vector<std::string> opts;
+    opts.push_back("-s");
+    opts.push_back("2");
+    std::vector<std::string> old = devices("old", 2);
+    startWriter(opts, old);
+    send("a", text(8000000, 1), old);
+    stopWriter();
+    ASSERT_GT(fileSize(old[0]), 0);
+    ASSERT_GT(fileSize(old[1]), 0);
+
+    std::vector<std::string> dev = devices("scd", 2);
+    startWriter(opts, dev);
+    std::string b = text(4000000, 2);
+    send("b", b, dev);
+    stopWriter();
+
+    for (size_t i = 0; i < dev.size(); ++i)
+        writeFile(dev[i], readFile(old[i]) + readFile(dev[i]));
+    EXPECT_EQ(0, runReader(opts, dev));
+    EXPECT_EQ(b, readFile(tmp + "/out/b"));
+}
+
+/* A writer which goes away in the middle of a file leaves no part of it,
+ * whether the reader then sees the end of the device or a new writer.
+ */
+TEST_F(ScdProgramsTests, StreamCutOff)
+{
+    std::vector<std::string> old = devices("old", 0);
+    startWriter(std::vector<std::string>(), old);
+    send("a", text(1000000, 1), old);
+    stopWriter();
+    std::string cut = readFile(old[0]);
+    cut.resize(frameEnd(cut, 10));
+    writeFile(old[0], cut);
+
+    EXPECT_EQ(0, runReader(std::vector<std::string>(), old));
+    EXPECT_FALSE(exists(tmp + "/out/a"));
+
+    std::vector<std::string> dev = devices("scd", 0);
+    startWriter(std::vector<std::string>(), dev);
+    std::string b = text(100000, 2);
+    send("b", b, dev);
+    stopWriter();
+    writeFile(dev[0], cut + readFile(dev[0]));
+    EXPECT_EQ(0, runReader(std::vector<std::string>(), dev));
+    EXPECT_FALSE(exists(tmp + "/out/a"));
+    EXPECT_EQ(b, readFile(tmp + "/out/b"));
+}
+
+/* Content goes as a digest only to the stream it was sent in full to; a
+ * restarted writer may talk to a reader which never got it.
+ */
+TEST_F(ScdProgramsTests, DedupPerStream)
+{
+    std::vector<std::string> opts;
+    opts.push_back("-d");
+    opts.push_back(tmp + "/writer.cache");
+    std::vector<std::string> dev = devices("scd", 0);
+    std::string a = text(100000, 1);
+    startWriter(opts, dev);
+    send("a", a, dev);
+    off_t full = fileSize(dev[0]);
+    send("b", a, dev);
+    stopWriter();
+    EXPECT_LT(fileSize(dev[0]) - full, 1000);
+
+    std::vector<std::string> readerOpts;
+    readerOpts.push_back("-d");
+    readerOpts.push_back(tmp + "/reader.cache");
+    EXPECT_EQ(0, runReader(readerOpts, dev));
+    EXPECT_EQ(a, readFile(tmp + "/out/a"));
+    EXPECT_EQ(a, readFile(tmp + "/out/b"));
+
+    std::vector<std::string> late = devices("late", 0);
+    startWriter(opts, late);
+    send("c", a, late);
+    stopWriter();
+    EXPECT_GT(fileSize(late[0]), static_cast<off_t>(a.size()));
+}
+
+/* Names get new content after theirs was sent. Content goes as a digest
+ * only while some name still holds it, and the reader recreates it from
+ * whichever name that is.
+ */
+TEST_F(ScdProgramsTests, DedupNameReused)
+{
+    std::vector<std::string> opts;
+    opts.push_back("-d");
+    opts.push_back(tmp + "/writer.cache");
+    std::vector<std::string> dev = devices("scd", 0);
+    std::string x = text(100000, 1), y = text(50000, 2);
+    startWriter(opts, dev);
+    send("a", x, dev);
+    send("a", y, dev);
+    send("b", x, dev);
+    send("c", x, dev);
+    send("c", y, dev);
+    off_t full = fileSize(dev[0]);
+    send("d", x, dev);
+    stopWriter();
+    EXPECT_LT(fileSize(dev[0]) - full, 1000);
+
+    std::vector<std::string> readerOpts;
+    readerOpts.push_back("-d");
+    readerOpts.push_back(tmp + "/reader.cache");
+    EXPECT_EQ(0, runReader(readerOpts, dev));
+    EXPECT_EQ(y, readFile(tmp + "/out/a"));
+    EXPECT_EQ(x, readFile(tmp + "/out/b"));
+    EXPECT_EQ(y, readFile(tmp + "/out/c"));
+    EXPECT_EQ(x, readFile(tmp + "/out/d"));
+}
+
+/* The cache keeps only the records in effect once it is loaded again. */
+TEST_F(ScdProgramsTests, CacheCompacted)
+{
+    std::vector<std::string> opts;
+    opts.push_back("-d");
+    opts.push_back(tmp + "/writer.cache");
+    std::vector<std::string> dev = devices("scd", 0);
+    startWriter(opts, dev);
+    send("a", text(1000, 1), dev);
+    send("a", text(1000, 2), dev);
+    send("b", text(1000, 3), dev);
+    stopWriter();
+    EXPECT_EQ(0, unlink((tmp + "/in/b").c_str()));
+    std::string cache = readFile(tmp + "/writer.cache");
+    EXPECT_EQ(3, std::count(cache.begin(), cache.end(), '\n'));
+
+    startWriter(opts, dev);
+    stopWriter();
+    cache = readFile(tmp + "/writer.cache");
+    EXPECT_EQ(1, std::count(cache.begin(), cache.end(), '\n'));
+    EXPECT_NE(std::string::npos, cache.find(tmp + "/in/a"));
+}
@@ -0,0 +1,135 @@
+/*
+ * trace_test.cpp -- Tests for the binary trace shared by the programs
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include "../../Programs/log.h"
+
+#define TRACE_EVENTS 100000
+
+class ScdTraceTests : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+        char dir[] = "/tmp/scd-trace-XXXXXX";
+        ASSERT_TRUE(mkdtemp(dir) != NULL);
+        tmp = dir;
+    }
+
+    virtual void TearDown()
+    {
+        std::string cmd = "rm -rf " + tmp;
+        EXPECT_EQ(0, system(cmd.c_str()));
+    }
+
+    /* Traces events numbered from 0 in a child, into a trace of mb MB. */
+    void trace(const char *mb, void (*body)() = NULL)
+    {
+        pid_t pid = fork();
+        if (pid == 0) {
+            setenv("SCD_TRACE", (tmp + "/trace").c_str(), 1);
+            setenv("SCD_TRACE_MB", mb, 1);
+            if (body)
+                body();
+            for (int i = 0; i < TRACE_EVENTS; ++i)
+                LOGTRACE("event {}", i);
+            exit(0);
+        }
+        int status = -1;
+        waitpid(pid, &status, 0);
+        ASSERT_EQ(0, status);
+    }
+
+    static void defineAll()
+    {
+        Trace &trace = Trace::Instance();
+        for (int i = 0; i < 100000; ++i) {
+            uint32_t site = trace.Define("site {}", __FILE__, i);
+            if (site == TRACE_SITE_NONE) {
+                trace.Write(site, i);
+                exit(0);
+            }
+        }
+        exit(1);
+    }
+
+    /* Numbers of the events tracedecode renders, in order. */
+    std::vector<int> decode()
+    {
+        std::string cmd = std::string(PROGRAMS_DIR) +
+                          "/TraceDecode/tracedecode " + tmp + "/trace 2>" +
+                          tmp + "/stats";
+        std::vector<int> events;
+        FILE *out = popen(cmd.c_str(), "r");
+        if (!out)
+            return events;
+        char line[512];
+        while (fgets(line, sizeof line, out)) {
+            const char *event = strstr(line, "] event ");
+            if (event)
+                events.push_back(atoi(event + 8));
+        }
+        pclose(out);
+        return events;
+    }
+
+    std::string tmp;
+};
+
+TEST_F(ScdTraceTests, AllEvents)
+{
+    trace("64");
+    std::vector<int> events = decode();
+    ASSERT_EQ(static_cast<size_t>(TRACE_EVENTS), events.size());
+    for (size_t i = 0; i < events.size(); ++i)
+        ASSERT_EQ(static_cast<int>(i), events[i]);
+}
+
+/* A full ring keeps the latest events, in order. */
+TEST_F(ScdTraceTests, Wraps)
+{
+    trace("1");
+    std::vector<int> events = decode();
+    ASSERT_FALSE(events.empty());
+    EXPECT_LT(events.size(), static_cast<size_t>(TRACE_EVENTS));
+    EXPECT_GT(events.size(), static_cast<size_t>(TRACE_EVENTS / 10));
+    EXPECT_EQ(TRACE_EVENTS - 1, events.back());
+    for (size_t i = 1; i < events.size(); ++i)
+        ASSERT_EQ(events[i - 1] + 1, events[i]);
+}
+
+/* Sites beyond the room for definitions are not traced at all. */
+TEST_F(ScdTraceTests, DefinitionsFull)
+{
+    trace("1", defineAll);
+    EXPECT_TRUE(decode().empty());
+    std::ifstream in((tmp + "/stats").c_str());
+    std::string stats;
+    std::getline(in, stats);
+    EXPECT_EQ(0u, stats.find("0 records, 0 incomplete")) << stats;
+}
@@ -0,0 +1,86 @@
+/*
+ * ring_bench.cpp -- Microbenchmarks for the Ring template
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <benchmark/benchmark.h>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "../../Programs/ring.h"
+
+#define BENCH_RING_SIZE 0x8000      /* SCD_BUFFER_SIZE */
+
+/* Write a chunk and read it back on one thread: the cost of the copies and
+ * of the position updates, without any waiting.
+ */
+template <typename Policy>
+static void BM_WriteRead(benchmark::State &state)
+{
+    std::unique_ptr<Ring<BENCH_RING_SIZE, Policy> > ring(
+        new Ring<BENCH_RING_SIZE, Policy>);
+    std::vector<char> buf(state.range(0), 'x');
+
+    for (auto _ : state) {
+        size_t off = 0;
+        while (off < buf.size()) {
+            size_t n = ring->Write(buf.data() + off, buf.size() - off);
+            ring->Read(buf.data() + off, n);
+            off += n;
+        }
+        benchmark::DoNotOptimize(buf.data());
+    }
+    state.SetBytesProcessed(state.iterations() * buf.size());
+}
+
+BENCHMARK_TEMPLATE(BM_WriteRead, SpscLockFree)->Range(8, 16 << 10);
+BENCHMARK_TEMPLATE(BM_WriteRead, MpmcLocked)->Range(8, 16 << 10);
+BENCHMARK_TEMPLATE(BM_WriteRead, TwoSegmentBulk)->Range(8, 16 << 10);
+
+/* A writer and a reader thread moving chunks through one ring. Thread 0
+ * writes, thread 1 reads; both move the same number of chunks, so the ring
+ * is empty between runs.
+ */
+template <typename Policy>
+static void BM_Transfer(benchmark::State &state)
+{
+    static Ring<BENCH_RING_SIZE, Policy> ring;
+    std::vector<char> buf(state.range(0), 'x');
+
+    for (auto _ : state) {
+        size_t off = 0;
+        while (off < buf.size()) {
+            size_t n = state.thread_index() == 0 ?
+                       ring.Write(buf.data() + off, buf.size() - off) :
+                       ring.Read(buf.data() + off, buf.size() - off);
+            off += n;
+            if (!n)
+                std::this_thread::yield();
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * buf.size());
+}
+
+BENCHMARK_TEMPLATE(BM_Transfer, SpscLockFree)->Range(64, 16 << 10)
+->Threads(2)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Transfer, MpmcLocked)->Range(64, 16 << 10)
+->Threads(2)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Transfer, TwoSegmentBulk)->Range(64, 16 << 10)
+->Threads(2)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,281 @@
+/*
+ * ring_test.cpp -- Property tests for the Ring template
+ *
+ * Copyright (C) 2014 Nemanja Hirsl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+#include <deque>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "../../Programs/ring.h"
+
+/* The driver's pointer arithmetic, with offsets for pointers, transcribed
+ * from scd_read, scd_write and freespace(). Rings are checked against it.
+ */
+struct DriverModel {
+    size_t begin, end, read, write;
+    bool bulk;
+    std::deque<char> data;
+
+    DriverModel(size_t size, bool bulk) : begin(0), end(size), read(0),
+        write(0), bulk(bulk) {}
+
+    size_t freespace() const
+    {
+        size_t buffersize = end - begin;
+        if (read == write)
+            return buffersize - 1;
+        else if (read > write)
+            return read - write - 1;
+        else
+            return buffersize - (write - read) - 1;
+    }
+
+    size_t writeCount(size_t count) const
+    {
+        if (bulk)
+            return std::min(count, freespace());
+        if (!freespace())
+            return 0;
+        if (write >= read) {
+            if (read == begin)
+                return std::min(count, end - write - 1);
+            return std::min(count, end - write);
+        }
+        return std::min(count, read - write - 1);
+    }
+
+    size_t readCount(size_t count) const
+    {
+        if (bulk)
+            return std::min(count, data.size());
+        if (read == write)
+            return 0;
+        if (write > read)
+            return std::min(count, write - read);
+        return std::min(count, end - read);
+    }
+
+    void advance(size_t &pos, size_t count)
+    {
+        pos = begin + (pos - begin + count) % (end - begin);
+    }
+};
+
+template <typename Policy>
+class RingTest : public ::testing::Test
+{
+};
+
+typedef ::testing::Types<SpscLockFree, MpmcLocked, TwoSegmentBulk> Policies;
+TYPED_TEST_CASE(RingTest, Policies);
+
+TYPED_TEST(RingTest, Empty)
+{
+    std::unique_ptr<Ring<64, TypeParam> > ring(new Ring<64, TypeParam>);
+    char buf[8];
+
+    EXPECT_TRUE(ring->Empty());
+    EXPECT_EQ(63U, ring->Free());
+    EXPECT_EQ(0U, ring->Read(buf, sizeof buf));
+}
+
+/* Heap allocated rings keep their positions on separate cache lines. */
+TYPED_TEST(RingTest, HeapAligned)
+{
+    for (int i = 0; i < 8; ++i) {
+        std::unique_ptr<Ring<64, TypeParam> > ring(new Ring<64, TypeParam>);
+        EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(ring.get()) %
+                  RING_CACHE_LINE);
+    }
+}
+
+TYPED_TEST(RingTest, OneSlotStaysEmpty)
+{
+    std::unique_ptr<Ring<64, TypeParam> > ring(new Ring<64, TypeParam>);
+    char buf[64] = {0};
+
+    EXPECT_EQ(63U, ring->Write(buf, sizeof buf));
+    EXPECT_EQ(0U, ring->Free());
+    EXPECT_EQ(0U, ring->Write(buf, 1));
+    EXPECT_EQ(63U, ring->Size());
+}
+
+/* Random writes and reads, checked against the driver and a FIFO. */
+TYPED_TEST(RingTest, MatchesDriver)
+{
+    const size_t size = 256;
+    std::unique_ptr<Ring<size, TypeParam> > ring(new Ring<size, TypeParam>);
+    DriverModel model(size, TypeParam::bulk);
+    std::mt19937 rng(1234);
+    std::vector<char> buf(2 * size);
+    char next = 0;
+
+    for (int step = 0; step < 100000; ++step) {
+        size_t len = rng() % (size + size / 2);
+        if (rng() % 2) {
+            for (size_t i = 0; i < len; ++i)
+                buf[i] = next + i;
+            size_t expect = model.writeCount(len);
+            ASSERT_EQ(expect, ring->Write(buf.data(), len)) << "step " << step;
+            for (size_t i = 0; i < expect; ++i)
+                model.data.push_back(buf[i]);
+            model.advance(model.write, expect);
+            next += expect;
+        } else {
+            size_t expect = model.readCount(len);
+            ASSERT_EQ(expect, ring->Read(buf.data(), len)) << "step " << step;
+            for (size_t i = 0; i < expect; ++i) {
+                ASSERT_EQ(model.data.front(), buf[i]) << "step " << step;
+                model.data.pop_front();
+            }
+            model.advance(model.read, expect);
+        }
+        ASSERT_EQ(model.freespace(), ring->Free());
+        ASSERT_EQ(model.data.size(), ring->Size());
+        ASSERT_EQ(size - 1, ring->Free() + ring->Size());
+    }
+}
+
+/* A writer starting at the end of the buffer while read is at the
+ * beginning must stop one short of the end, or the ring would look empty.
+ */
+TYPED_TEST(RingTest, WrapKeepsReadDistinct)
+{
+    std::unique_ptr<Ring<16, TypeParam> > ring(new Ring<16, TypeParam>);
+    char buf[16] = {0};
+
+    EXPECT_EQ(15U, ring->Write(buf, 16));
+    EXPECT_EQ(0U, ring->Write(buf, 1));
+    EXPECT_EQ(4U, ring->Read(buf, 4));
+    /* Write is at 15, read at 4: the driver writes one byte up to the end
+     * and wraps, the bulk policy continues to one before read.
+     */
+    EXPECT_EQ(TypeParam::bulk ? 4U : 1U, ring->Write(buf, 8));
+}
+
+/* Producers and consumers on separate threads; every byte arrives once. */
+template <typename Policy>
+static void transfer(int producers, int consumers, uint64_t perProducer)
+{
+    std::unique_ptr<Ring<4096, Policy> > ring(new Ring<4096, Policy>);
+    std::atomic<uint64_t> remaining(producers * perProducer);
+    std::atomic<uint64_t> sentSum(0), receivedSum(0);
+    std::vector<std::thread> threads;
+
+    for (int p = 0; p < producers; ++p) {
+        threads.push_back(std::thread([&, p]() {
+            std::mt19937 rng(p);
+            std::vector<unsigned char> buf(300);
+            uint64_t left = perProducer, sum = 0;
+            while (left) {
+                size_t len = std::min<uint64_t>(left, 1 + rng() % buf.size());
+                for (size_t i = 0; i < len; ++i)
+                    buf[i] = rng();
+                size_t off = 0;
+                while (off < len) {
+                    size_t n = ring->Write(buf.data() + off, len - off);
+                    for (size_t i = 0; i < n; ++i)
+                        sum += buf[off + i];
+                    off += n;
+                    if (!n)
+                        std::this_thread::yield();
+                }
+                left -= len;
+            }
+            sentSum += sum;
+        }));
+    }
+    for (int c = 0; c < consumers; ++c) {
+        threads.push_back(std::thread([&]() {
+            std::vector<unsigned char> buf(500);
+            uint64_t sum = 0;
+            while (remaining) {
+                size_t n = ring->Read(buf.data(), buf.size());
+                for (size_t i = 0; i < n; ++i)
+                    sum += buf[i];
+                remaining -= n;
+                if (!n)
+                    std::this_thread::yield();
+            }
+            receivedSum += sum;
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+    EXPECT_EQ(0U, remaining);
+    EXPECT_EQ(sentSum, receivedSum);
+    EXPECT_TRUE(ring->Empty());
+}
+
+/* Single producer, single consumer: order is kept exactly. Values may be
+ * split by the wrap, so both sides move them as a byte stream.
+ */
+TYPED_TEST(RingTest, SpscKeepsOrder)
+{
+    std::unique_ptr<Ring<1024, TypeParam> > ring(new Ring<1024, TypeParam>);
+    const uint32_t count = 1000000;
+
+    std::thread producer([&]() {
+        uint32_t value = 0;
+        size_t off = 0;
+        while (value < count) {
+            const char *bytes = reinterpret_cast<const char *>(&value);
+            off += ring->Write(bytes + off, sizeof value - off);
+            if (off == sizeof value) {
+                ++value;
+                off = 0;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    uint32_t expect = 0;
+    uint32_t value;
+    size_t off = 0;
+    while (expect < count) {
+        size_t n = ring->Read(reinterpret_cast<char *>(&value) + off,
+                              sizeof value - off);
+        if (!n) {
+            std::this_thread::yield();
+            continue;
+        }
+        off += n;
+        if (off == sizeof value) {
+            ASSERT_EQ(expect, value);
+            ++expect;
+            off = 0;
+        }
+    }
+    producer.join();
+}
+
+TYPED_TEST(RingTest, SpscTransfer)
+{
+    transfer<TypeParam>(1, 1, 4 << 20);
+}
+
+TEST(MpmcLockedTest, ManyProducersAndConsumers)
+{
+    transfer<MpmcLocked>(4, 4, 1 << 20);
+}